@@ -30,6 +30,8 @@
 // AVR-GCC includes:
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <util/atomic.h>
+#include <util/delay.h>
 
 #include "TWI_Master.h"
 
@@ -37,17 +39,51 @@
 #define FALSE         0
 
 static unsigned char TWI_buf[ TWI_BUFFER_SIZE ];    // Transceiver buffer
-static unsigned char TWI_msgSize;                   // Number of bytes to be transmitted.
 static unsigned char TWI_state = TWI_NO_STATE;      // State byte. Default set to TWI_NO_STATE.
 
+// The single-message functions below are implemented as this job, which
+// reads and writes TWI_buf (after the address byte).
+static TWI_Job TWI_msgJob;
+
+// Circular queue of jobs. The job at TWI_queueHead is the one on the bus.
+static TWI_Job *TWI_queue[ TWI_QUEUE_SIZE ];
+static unsigned char TWI_queueHead;
+static volatile unsigned char TWI_queueCount;
+
+#if ENABLE_TWI_RECOVERY
+// Fault recovery state, see TWI_Check_Bus().
+static volatile unsigned char TWI_activity;         // Set by the ISR, cleared by TWI_Check_Bus().
+static volatile unsigned char TWI_clearing;         // Queued jobs don't start while set.
+static unsigned char TWI_arbLost;                   // Arbitration losses of the current job.
+static unsigned char TWI_stuckChecks;
+#endif
+
 union TWI_statusReg TWI_statusReg = {0};            // TWI_statusReg is defined in TWI_Master.h
+#if ENABLE_TWI_RECOVERY
+TWI_Counters TWI_counters;                          // TWI_counters is defined in TWI_Master.h
+
+// Open drain outputs for the bus clear. The PORT bit is cleared before
+// making the pin an output (and set after making it an input), so that the
+// pin is never driven high.
+#define TWI_PIN_LOW( bit )      do { TWI_PORT &= ~(bit); TWI_DDR |= (bit); } while (0)
+#define TWI_PIN_RELEASE( bit )  do { TWI_DDR &= ~(bit); TWI_PORT |= (bit); } while (0)
+#define TWI_HALF_CLOCK_US       5                   // 100KHz
+
+static void TWI_Clear_Bus( void );
+#endif
 
 /****************************************************************************
 Call this function to set up the TWI master to its initial standby state.
 Remember to enable interrupts from the main application after initializing the TWI.
+With ENABLE_TWI_RECOVERY, if SDA is low (a slave was left in the middle of a transfer, for instance by a
+watchdog reset), the bus is cleared first.
 ****************************************************************************/
 void TWI_Master_Initialise(void)
 {
+#if ENABLE_TWI_RECOVERY
+  if ( !( TWI_PIN & TWI_SDA_BIT ) )
+    TWI_Clear_Bus();
+#endif
   TWBR = TWI_TWBR;                                  // Set bit rate register (Baudrate). Defined in header file.
 // TWSR = TWI_TWPS;                                  // Not used. Driver presumes prescaler to be 00.
   TWDR = 0xFF;                                      // Default content = SDA released.
@@ -76,6 +112,40 @@ unsigned char TWI_Get_State_Info( void )
   return ( TWI_state );                         // Return error state.
 }
 
+/****************************************************************************
+Call this function to queue a job (see TWI_Job in TWI_Master.h). If the bus is idle, the job starts
+immediately. Otherwise, the ISR starts it after the previous jobs, with a STOP followed by a START.
+Does not wait for anything. Returns FALSE if the queue is full (and then the job is not queued).
+Can also be called from a job callback.
+****************************************************************************/
+unsigned char TWI_Enqueue_Job( TWI_Job *job )
+{
+  unsigned char queued = FALSE;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    if ( TWI_queueCount < TWI_QUEUE_SIZE )
+    {
+      job->status = TWI_JOB_PENDING;
+      TWI_queue[ (TWI_queueHead + TWI_queueCount) & (TWI_QUEUE_SIZE - 1) ] = job;
+#if ENABLE_TWI_RECOVERY
+      if ( TWI_queueCount++ == 0 && !TWI_clearing ) // Bus is idle, start now.
+#else
+      if ( TWI_queueCount++ == 0 )              // Bus is idle, start now.
+#endif
+      {
+        TWI_state = TWI_NO_STATE ;
+        TWCR = (1<<TWEN)|                       // TWI Interface enabled.
+               (1<<TWIE)|(1<<TWINT)|            // Enable TWI Interupt and clear the flag.
+               (0<<TWEA)|(1<<TWSTA)|(0<<TWSTO)| // Initiate a START condition.
+               (0<<TWWC);                       //
+      }
+      queued = TRUE;
+    }
+  }
+  return queued;
+}
+
 /****************************************************************************
 Call this function to send a prepared message. The first byte must contain the slave address and the
 read/write bit. Consecutive bytes contain the data to be sent, or empty locations for data to be read
@@ -89,19 +159,24 @@ void TWI_Start_Transceiver_With_Data( unsigned char *msg, unsigned char msgSize
 
   while ( TWI_Transceiver_Busy() );             // Wait until TWI is ready for next transmission.
 
-  TWI_msgSize = msgSize;                        // Number of data to transmit.
-  TWI_buf[0]  = msg[0];                         // Store slave address with R/W setting.
-  if (!( msg[0] & (TRUE<<TWI_READ_BIT) ))       // If it is a write operation, then also copy data.
+  TWI_msgJob.address = msg[0] & ~(TRUE<<TWI_READ_BIT);
+  TWI_msgJob.write_data = TWI_buf + 1;
+  TWI_msgJob.read_data  = TWI_buf + 1;
+  if ( msg[0] & (TRUE<<TWI_READ_BIT) )          // Read operation, without writing anything before.
+  {
+    TWI_msgJob.write_size = 0;
+    TWI_msgJob.read_size  = msgSize - 1;
+  }
+  else                                          // Write operation, also copy data.
   {
     for ( temp = 1; temp < msgSize; temp++ )
       TWI_buf[ temp ] = msg[ temp ];
+    TWI_msgJob.write_size = msgSize - 1;
+    TWI_msgJob.read_size  = 0;
   }
-  TWI_statusReg.all = 0;
-  TWI_state         = TWI_NO_STATE ;
-  TWCR = (1<<TWEN)|                             // TWI Interface enabled.
-         (1<<TWIE)|(1<<TWINT)|                  // Enable TWI Interupt and clear the flag.
-         (0<<TWEA)|(1<<TWSTA)|(0<<TWSTO)|       // Initiate a START condition.
-         (0<<TWWC);                             //
+  TWI_buf[0] = msg[0];
+
+  TWI_Start_Transceiver();
 }
 
 /****************************************************************************
@@ -112,12 +187,8 @@ then initialize the next operation and return.
 void TWI_Start_Transceiver( void )
 {
   while ( TWI_Transceiver_Busy() );             // Wait until TWI is ready for next transmission.
-  TWI_statusReg.all = 0;
-  TWI_state         = TWI_NO_STATE ;
-  TWCR = (1<<TWEN)|                             // TWI Interface enabled.
-         (1<<TWIE)|(1<<TWINT)|                  // Enable TWI Interupt and clear the flag.
-         (0<<TWEA)|(1<<TWSTA)|(0<<TWSTO)|       // Initiate a START condition.
-         (0<<TWWC);                             //
+  TWI_statusReg.lastTransOK = FALSE;            // busFault is kept for TWI_Check_Bus().
+  TWI_Enqueue_Job( &TWI_msgJob );               // Can't fail, the queue is empty.
 }
 
 /****************************************************************************
@@ -131,20 +202,164 @@ If there was an error in the previous transmission the function will return the
 unsigned char TWI_Get_Data_From_Transceiver( unsigned char *msg, unsigned char msgSize )
 {
   unsigned char i;
+  unsigned char lastTransOK;
 
   while ( TWI_Transceiver_Busy() );             // Wait until TWI is ready for next transmission.
 
-  if( TWI_statusReg.lastTransOK )               // Last transmission competed successfully.
+  lastTransOK = ( TWI_msgJob.status == TWI_JOB_DONE );
+  if( lastTransOK )                             // Last transmission competed successfully.
   {
     for ( i=0; i<msgSize; i++ )                 // Copy data from Transceiver buffer.
     {
       msg[ i ] = TWI_buf[ i ];
     }
   }
-  return( TWI_statusReg.lastTransOK );
+  return( lastTransOK );
 }
 
 // ********** Interrupt Handlers ********** //
+/****************************************************************************
+Called by the ISR at the end of the current job, either successfully or not. Removes the job from the
+queue, and then either starts the next one or releases the bus.
+****************************************************************************/
+static void TWI_Finish_Job( unsigned char ok )
+{
+  TWI_Job *job = TWI_queue[ TWI_queueHead ];
+
+  TWI_statusReg.lastTransOK = ok;
+  job->status = ok ? TWI_JOB_DONE : TWI_JOB_ERROR;
+#if ENABLE_TWI_RECOVERY
+  if ( !ok )
+    TWI_counters.errors++;
+  TWI_arbLost = 0;
+#endif
+  TWI_queueHead = (TWI_queueHead + 1) & (TWI_QUEUE_SIZE - 1);
+
+  if ( --TWI_queueCount )                       // More jobs waiting.
+  {
+    TWCR = (1<<TWEN)|                           // TWI Interface enabled
+           (1<<TWIE)|(1<<TWINT)|                // Keep TWI Interrupt enabled and clear the flag
+           (0<<TWEA)|(1<<TWSTA)|(1<<TWSTO)|     // Initiate a STOP condition, followed by a START.
+           (0<<TWWC);                           //
+  }
+  else                                          // Also after an error: SCL is held low until TWINT is cleared.
+  {                                             // After a bus error, TWSTO only resets the TWI (no STOP on the bus).
+    TWCR = (1<<TWEN)|                           // TWI Interface enabled
+           (0<<TWIE)|(1<<TWINT)|                // Disable TWI Interrupt and clear the flag
+           (0<<TWEA)|(0<<TWSTA)|(1<<TWSTO)|     // Initiate a STOP condition.
+           (0<<TWWC);                           //
+  }
+
+  // Last, so that the callback can queue another job.
+  if ( job->callback )
+    job->callback( job );
+}
+
+#if ENABLE_TWI_RECOVERY
+// ********** Fault Recovery ********** //
+/****************************************************************************
+Fails every queued job, without touching the bus. The TWI module must be disabled, and the interrupts too.
+****************************************************************************/
+static void TWI_Abort_Jobs( void )
+{
+  TWI_Job *job;
+
+  while ( TWI_queueCount )
+  {
+    job = TWI_queue[ TWI_queueHead ];
+    job->status = TWI_JOB_ERROR;
+    TWI_counters.errors++;
+    TWI_queueHead = (TWI_queueHead + 1) & (TWI_QUEUE_SIZE - 1);
+    TWI_queueCount--;
+    if ( job->callback )
+      job->callback( job );                     // May queue another job, which waits for the bus clear.
+  }
+  TWI_statusReg.lastTransOK = FALSE;
+  TWI_arbLost = 0;
+}
+
+/****************************************************************************
+Frees a slave that is holding SDA low, because it was interrupted in the middle of a byte (by noise, or
+by a reset of the master): up to 9 clock pulses, until SDA is released, followed by a STOP condition.
+The TWI module must be disabled. Takes about 110us, with the interrupts enabled.
+****************************************************************************/
+static void TWI_Clear_Bus( void )
+{
+  unsigned char i;
+
+  for ( i = 0; i < 9 && !( TWI_PIN & TWI_SDA_BIT ); i++ )
+  {
+    TWI_PIN_LOW( TWI_SCL_BIT );
+    _delay_us( TWI_HALF_CLOCK_US );
+    TWI_PIN_RELEASE( TWI_SCL_BIT );
+    _delay_us( TWI_HALF_CLOCK_US );
+  }
+
+  // STOP: SDA goes high while SCL is high.
+  TWI_PIN_LOW( TWI_SCL_BIT );
+  _delay_us( TWI_HALF_CLOCK_US );
+  TWI_PIN_LOW( TWI_SDA_BIT );
+  _delay_us( TWI_HALF_CLOCK_US );
+  TWI_PIN_RELEASE( TWI_SCL_BIT );
+  _delay_us( TWI_HALF_CLOCK_US );
+  TWI_PIN_RELEASE( TWI_SDA_BIT );
+  _delay_us( TWI_HALF_CLOCK_US );
+}
+
+/****************************************************************************
+Call this function periodically from the main loop (once per Timer0 overflow). It detects a stuck bus
+(a pending job without any TWI interrupt, or SDA/SCL held low on an idle bus, for TWI_STUCK_CHECKS calls)
+and the faults reported by the ISR (bus error, or too many arbitration losses). Then it fails all queued
+jobs, clears the bus and initializes the TWI module again. Returns TRUE if the bus has been cleared, and
+then the slaves may have lost their state (the caller should check, or restore, their configuration).
+****************************************************************************/
+unsigned char TWI_Check_Bus( void )
+{
+  unsigned char stuck = FALSE;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    if ( TWI_statusReg.busFault )
+      stuck = TRUE;
+    else if ( TWI_activity
+      || ( TWI_queueCount == 0 && ( TWI_PIN & (TWI_SDA_BIT|TWI_SCL_BIT) ) == (TWI_SDA_BIT|TWI_SCL_BIT) ) )
+      TWI_stuckChecks = 0;
+    else if ( ++TWI_stuckChecks >= TWI_STUCK_CHECKS )
+      stuck = TRUE;
+    TWI_activity = FALSE;
+
+    if ( stuck )
+    {
+      TWCR = 0;                                 // Disable TWI, the pins go back to PORTC.
+      TWI_clearing = TRUE;
+      TWI_Abort_Jobs();
+    }
+  }
+  if ( !stuck )
+    return FALSE;
+
+  TWI_Clear_Bus();
+  TWI_Master_Initialise();
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    TWI_clearing = FALSE;
+    TWI_stuckChecks = 0;
+    TWI_statusReg.busFault = FALSE;
+    TWI_counters.recoveries++;
+    if ( TWI_queueCount )                       // Queued while clearing.
+    {
+      TWI_state = TWI_NO_STATE ;
+      TWCR = (1<<TWEN)|                         // TWI Interface enabled.
+             (1<<TWIE)|(1<<TWINT)|              // Enable TWI Interupt and clear the flag.
+             (0<<TWEA)|(1<<TWSTA)|(0<<TWSTO)|   // Initiate a START condition.
+             (0<<TWWC);                         //
+    }
+  }
+  return TRUE;
+}
+#endif
+
 /****************************************************************************
 This function is the Interrupt Service Routine (ISR), and called when the TWI interrupt is triggered;
 that is whenever a TWI event has occurred. This function should not be called directly from the main
@@ -166,34 +381,57 @@ application.
 ISR(TWI_vect)
 {
   static unsigned char TWI_bufPtr;
+  TWI_Job *job = TWI_queue[ TWI_queueHead ];
+
+#if ENABLE_TWI_RECOVERY
+  TWI_activity = TRUE;
+#endif
 
   switch (TWSR)
   {
     case TWI_START:             // START has been transmitted
+      TWI_bufPtr = 0;                                     // Set buffer pointer to the first data byte
+      if ( job->write_size == 0 && job->read_size != 0 )
+        TWDR = job->address | (TRUE<<TWI_READ_BIT);      // Nothing to write, go straight to reading.
+      else
+        TWDR = job->address;
+      TWCR = (1<<TWEN)|                                 // TWI Interface enabled
+             (1<<TWIE)|(1<<TWINT)|                      // Enable TWI Interupt and clear the flag to send byte
+             (0<<TWEA)|(0<<TWSTA)|(0<<TWSTO)|           //
+             (0<<TWWC);                                 //
+      break;
     case TWI_REP_START:         // Repeated START has been transmitted
-      TWI_bufPtr = 0;                                     // Set buffer pointer to the TWI Address location
+      TWI_bufPtr = 0;                                     // Set buffer pointer to the first data byte
+      TWDR = job->address | (TRUE<<TWI_READ_BIT);
+      TWCR = (1<<TWEN)|                                 // TWI Interface enabled
+             (1<<TWIE)|(1<<TWINT)|                      // Enable TWI Interupt and clear the flag to send byte
+             (0<<TWEA)|(0<<TWSTA)|(0<<TWSTO)|           //
+             (0<<TWWC);                                 //
+      break;
     case TWI_MTX_ADR_ACK:       // SLA+W has been tramsmitted and ACK received
     case TWI_MTX_DATA_ACK:      // Data byte has been tramsmitted and ACK received
-      if (TWI_bufPtr < TWI_msgSize)
+      if (TWI_bufPtr < job->write_size)
       {
-        TWDR = TWI_buf[TWI_bufPtr++];
+        TWDR = job->write_data[TWI_bufPtr++];
         TWCR = (1<<TWEN)|                                 // TWI Interface enabled
                (1<<TWIE)|(1<<TWINT)|                      // Enable TWI Interupt and clear the flag to send byte
                (0<<TWEA)|(0<<TWSTA)|(0<<TWSTO)|           //
                (0<<TWWC);                                 //
-      }else                    // Send STOP after last byte
+      }else if (job->read_size)  // Switch to reading, without releasing the bus
       {
-        TWI_statusReg.lastTransOK = TRUE;                 // Set status bits to completed successfully.
         TWCR = (1<<TWEN)|                                 // TWI Interface enabled
-               (0<<TWIE)|(1<<TWINT)|                      // Disable TWI Interrupt and clear the flag
-               (0<<TWEA)|(0<<TWSTA)|(1<<TWSTO)|           // Initiate a STOP condition.
+               (1<<TWIE)|(1<<TWINT)|                      // Enable TWI Interupt and clear the flag
+               (0<<TWEA)|(1<<TWSTA)|(0<<TWSTO)|           // Initiate a repeated START condition.
                (0<<TWWC);                                 //
+      }else                    // Send STOP after last byte
+      {
+        TWI_Finish_Job(TRUE);                             // Set status bits to completed successfully.
       }
       break;
     case TWI_MRX_DATA_ACK:      // Data byte has been received and ACK tramsmitted
-      TWI_buf[TWI_bufPtr++] = TWDR;
+      job->read_data[TWI_bufPtr++] = TWDR;
     case TWI_MRX_ADR_ACK:       // SLA+R has been tramsmitted and ACK received
-      if (TWI_bufPtr < (TWI_msgSize-1) )                  // Detect the last byte to NACK it.
+      if (TWI_bufPtr < (job->read_size-1) )               // Detect the last byte to NACK it.
       {
         TWCR = (1<<TWEN)|                                 // TWI Interface enabled
                (1<<TWIE)|(1<<TWINT)|                      // Enable TWI Interupt and clear the flag to read next byte
@@ -208,30 +446,37 @@ ISR(TWI_vect)
       }
       break;
     case TWI_MRX_DATA_NACK:     // Data byte has been received and NACK tramsmitted
-      TWI_buf[TWI_bufPtr] = TWDR;
-      TWI_statusReg.lastTransOK = TRUE;                 // Set status bits to completed successfully.
-      TWCR = (1<<TWEN)|                                 // TWI Interface enabled
-             (0<<TWIE)|(1<<TWINT)|                      // Disable TWI Interrupt and clear the flag
-             (0<<TWEA)|(0<<TWSTA)|(1<<TWSTO)|           // Initiate a STOP condition.
-             (0<<TWWC);                                 //
+      job->read_data[TWI_bufPtr] = TWDR;
+      TWI_Finish_Job(TRUE);                             // Set status bits to completed successfully.
       break;
     case TWI_ARB_LOST:          // Arbitration lost
-      TWCR = (1<<TWEN)|                                 // TWI Interface enabled
-             (1<<TWIE)|(1<<TWINT)|                      // Enable TWI Interupt and clear the flag
-             (0<<TWEA)|(1<<TWSTA)|(0<<TWSTO)|           // Initiate a (RE)START condition.
-             (0<<TWWC);                                 //
+#if ENABLE_TWI_RECOVERY
+      if ( TWI_arbLost++ < TWI_ARB_LOST_RETRIES )
+#endif
+      {
+        TWCR = (1<<TWEN)|                               // TWI Interface enabled
+               (1<<TWIE)|(1<<TWINT)|                    // Enable TWI Interupt and clear the flag
+               (0<<TWEA)|(1<<TWSTA)|(0<<TWSTO)|         // Initiate a (RE)START condition.
+               (0<<TWWC);                               //
+        break;
+      }
+#if ENABLE_TWI_RECOVERY
+      TWI_statusReg.busFault = TRUE;                    // There is no other master, something is wrong.
+      TWI_state = TWSR;
+      TWI_Finish_Job(FALSE);
+      break;
+    case TWI_BUS_ERROR:         // Bus error due to an illegal START or STOP condition
+      TWI_statusReg.busFault = TRUE;                    // Cleared by TWI_Check_Bus().
+      TWI_state = TWSR;
+      TWI_Finish_Job(FALSE);
       break;
+#endif
     case TWI_MTX_ADR_NACK:      // SLA+W has been tramsmitted and NACK received
     case TWI_MRX_ADR_NACK:      // SLA+R has been tramsmitted and NACK received
     case TWI_MTX_DATA_NACK:     // Data byte has been tramsmitted and NACK received
 //    case TWI_NO_STATE              // No relevant state information available; TWINT = "0"
-    case TWI_BUS_ERROR:         // Bus error due to an illegal START or STOP condition
-    default:
+    default:                    // A NACK only fails the job, the caller may retry it.
       TWI_state = TWSR;                                 // Store TWSR and automatically sets clears noErrors bit.
-                                                        // Reset TWI Interface
-      TWCR = (1<<TWEN)|                                 // Enable TWI-interface and release TWI pins
-             (0<<TWIE)|(0<<TWINT)|                      // Disable Interupt
-             (0<<TWEA)|(0<<TWSTA)|(0<<TWSTO)|           // No Signal requests
-             (0<<TWWC);                                 //
+      TWI_Finish_Job(FALSE);                            // Drop the job, go on with the next one (if any).
   }
 }
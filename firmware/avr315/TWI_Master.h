@@ -27,8 +27,9 @@
   TWI Status/Control register definitions
 ****************************************************************************/
 // Set this to the largest message size that will be sent including address byte.
-// 7 should be enough for reading 3x 16-bit numbers.
-#define TWI_BUFFER_SIZE     7
+// Only used by the single-message functions, which are now only used for
+// writing one register (address + register + value). Reads use TWI_Job.
+#define TWI_BUFFER_SIZE     3
 
 // TWI Bit rate Register setting.
 // See pages 4 and 5 from "AVR315 - Using the TWI module as I2C master"
@@ -39,6 +40,26 @@
 // Not used! This driver presumes prescaler = 00
 //#define TWI_TWPS          0x00
 
+#if ENABLE_TWI_RECOVERY
+// TWI pins, used directly by the bus clear (see TWI_Check_Bus()).
+// On the ATmega8, SDA is PC4 and SCL is PC5.
+#define TWI_PORT            PORTC
+#define TWI_DDR             DDRC
+#define TWI_PIN             PINC
+#define TWI_SDA_BIT         (1<<4)
+#define TWI_SCL_BIT         (1<<5)
+
+// Fault recovery. With a single master, losing arbitration only happens
+// because of noise (or a slave holding SDA), so the START is retried only
+// a few times before the job fails and the bus is cleared.
+#define TWI_ARB_LOST_RETRIES  3
+// TWI_Check_Bus() calls without any TWI interrupt, while a job is pending
+// (or while SDA is low on an idle bus), before the bus is considered stuck.
+// At one call per Timer0 overflow (1.365ms), a full queue takes less than
+// one call.
+#define TWI_STUCK_CHECKS      3
+#endif
+
 /****************************************************************************
   Global definitions
 ****************************************************************************/
@@ -49,12 +70,55 @@ union TWI_statusReg                       // Status byte holding flags.
 	struct
 	{
 		unsigned char lastTransOK:1;
-		unsigned char unusedBits:7;
+		unsigned char busFault:1;               // Bus error or arbitration lost, clear the bus.
+		unsigned char unusedBits:6;
 	};
 };
 
 extern union TWI_statusReg TWI_statusReg;
 
+#if ENABLE_TWI_RECOVERY
+// Fault counters. They only go up (and wrap around).
+typedef struct TWI_Counters
+{
+  unsigned int errors;                          // Jobs finished with TWI_JOB_ERROR.
+  unsigned int retries;                         // Failed jobs queued again. Counted by the callers.
+  unsigned int recoveries;                      // Bus clears done by TWI_Check_Bus().
+} TWI_Counters;
+
+extern TWI_Counters TWI_counters;
+#endif
+
+/****************************************************************************
+  Transaction queue
+****************************************************************************/
+// A job is a complete bus transaction: START, SLA+W, write_data, then
+// (if read_size is not zero) a repeated START, SLA+R, and read_data, and
+// finally STOP. Queued jobs are chained by the ISR, without any help from
+// the main code. The job structs and their buffers belong to the caller,
+// and must not be touched while status is TWI_JOB_PENDING.
+
+// Maximum number of queued jobs. Must be a power of 2.
+#define TWI_QUEUE_SIZE      4
+
+#define TWI_JOB_IDLE        0   // Never queued.
+#define TWI_JOB_PENDING     1   // Queued or being transmitted.
+#define TWI_JOB_DONE        2
+#define TWI_JOB_ERROR       3   // TWI_Get_State_Info() has the TWI state code.
+
+typedef struct TWI_Job
+{
+  unsigned char address;                        // Slave address with R/W bit = 0.
+  unsigned char write_size;
+  unsigned char read_size;
+  volatile unsigned char status;
+  unsigned char *write_data;
+  unsigned char *read_data;
+  // Optional, called from the ISR after the job has finished (either
+  // TWI_JOB_DONE or TWI_JOB_ERROR). Must be short.
+  void (*callback)( struct TWI_Job * );
+} TWI_Job;
+
 /****************************************************************************
   Function definitions
 ****************************************************************************/
@@ -64,6 +128,10 @@ unsigned char TWI_Get_State_Info( void );
 void TWI_Start_Transceiver_With_Data( unsigned char * , unsigned char );
 void TWI_Start_Transceiver( void );
 unsigned char TWI_Get_Data_From_Transceiver( unsigned char *, unsigned char );
+unsigned char TWI_Enqueue_Job( TWI_Job * );
+#if ENABLE_TWI_RECOVERY
+unsigned char TWI_Check_Bus( void );
+#endif
 
 /****************************************************************************
   Bit and byte definitions
@@ -13,7 +13,12 @@
 
 
 // http://www.tty1.net/blog/2008-04-29-avr-gcc-optimisations_en.html
+#ifdef __AVR__
 #define FIX_POINTER(_ptr) __asm__ __volatile__("" : "=b" (_ptr) : "0" (_ptr))
+#else
+// Building on a PC (see host/ directory), where this trick is meaningless.
+#define FIX_POINTER(_ptr)
+#endif
 
 
 #endif  // __common_h_included__
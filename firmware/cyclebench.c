@@ -0,0 +1,460 @@
+/* Name: cyclebench.c
+ * Project: atmega8-magnetometer-usb-mouse
+ * Tabsize: 4
+ * License: GNU GPL v2 or GNU GPL v3
+ *
+ * Counts how many CPU cycles each function from the main loop takes, using
+ * fixed input vectors. This is a separate program (not the firmware), meant
+ * to be run under simavr with "make benchmark", although it also runs on
+ * the real hardware.
+ *
+ * Each call is timed by Timer1, running at the CPU clock, with interrupts
+ * disabled. The cost of the timing code itself is measured once and
+ * subtracted from every sample.
+ *
+ * The TWI driver is replaced by the stubs below, which return the fixed
+ * vectors instantly. Thus, sensor_read_data_registers() is measured without
+ * the I2C transfer time and without the TWI interrupt.
+ *
+ * The results are printed through the UART (PD1, the debug tx pin), which
+ * simavr copies to its output:
+ *
+ *   function                          min    avg    max
+ *   update_button_state(0)             ..     ..     ..
+ *   ...
+ *
+ * The main loop polls TOV0 once per iteration, and Timer0 overflows every
+ * 16384 cycles. If an iteration takes longer than that, ticks get lost (and
+ * usbPoll() is called late). Thus, the benchmark fails if any single call,
+ * or the worst-case sum of one main loop iteration, goes over
+ * CYCLEBENCH_BUDGET cycles. The worst case for mouse_prepare_next_report()
+ * is a full sample ring, as every waiting sample is converted in the same
+ * call. It also fails if the fixed vectors don't make
+ * it into the report, as the numbers would then come from a shorter path.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "avr315/TWI_Master.h"
+#include "buttons.h"
+#include "common.h"
+#include "keyemu.h"
+#include "sensor.h"
+
+// The mouse emulation code is included directly, in order to reach
+// apply_smoothing() and the cached basis (same as projection/mouseemu_replay.c).
+#include "mouseemu.c"
+
+
+#ifndef CYCLEBENCH_BUDGET
+#define CYCLEBENCH_BUDGET 16384
+#endif
+
+#define BAUD 38400
+#include <util/setbaud.h>
+
+
+////////////////////////////////////////////////////////////
+// Fixed input data                                      {{{
+
+// Calibration and a few samples from projection/2011-10-24_*.txt
+static const XYZVector corners[4] = {
+	{ 108, 198,   3},  // topleft
+	{ -90, 209,  11},  // topright
+	{ 137,  48, 160},  // bottomleft
+	{-112,  56, 170},  // bottomright
+};
+
+#define VECTORS_COUNT 20
+static const XYZVector vectors[VECTORS_COUNT] = {
+	{90, 191, 59},
+	{86, 194, 57},
+	{88, 192, 60},
+	{84, 190, 68},
+	{83, 187, 74},
+	{81, 187, 79},
+	{78, 189, 77},
+	{81, 191, 69},
+	{79, 192, 73},
+	{67, 194, 76},
+	{60, 196, 77},
+	{56, 203, 63},
+	{47, 211, 47},
+	{48, 201, 74},
+	{57, 195, 81},
+	{40, 200, 83},
+	{35, 192, 97},
+	{55, 192, 89},
+	// Out-of-bounds (pointing backwards)
+	{-90, -191, -59},
+	// Sensor overflow
+	{SENSOR_DATA_OVERFLOW, 0, 0},
+};
+
+// What the menu would usually type (see XYZVector_to_string())
+static const char typed_string[] PROGMEM = "-1234\t1234\t-1234\n";
+
+// }}}
+
+////////////////////////////////////////////////////////////
+// TWI_Master stubs                                      {{{
+
+union TWI_statusReg TWI_statusReg;
+#if ENABLE_TWI_RECOVERY
+TWI_Counters TWI_counters;
+#endif
+
+static const XYZVector *twi_vector;
+
+unsigned char TWI_Transceiver_Busy(void) {  // {{{
+	return 0;
+}  // }}}
+
+void TWI_Start_Transceiver_With_Data(unsigned char *msg, unsigned char msgSize) {  // {{{
+	(void) msg;
+	(void) msgSize;
+}  // }}}
+
+unsigned char TWI_Enqueue_Job(TWI_Job *job) {  // {{{
+	// The job finishes right away.
+	// Same register order as the HMC5883L: X, Z, Y, MSB first
+	if (job->read_size == 6) {
+		job->read_data[0] = twi_vector->x >> 8;
+		job->read_data[1] = twi_vector->x;
+		job->read_data[2] = twi_vector->z >> 8;
+		job->read_data[3] = twi_vector->z;
+		job->read_data[4] = twi_vector->y >> 8;
+		job->read_data[5] = twi_vector->y;
+	}
+	job->status = TWI_JOB_DONE;
+	if (job->callback) {
+		job->callback(job);
+	}
+	return 1;
+}  // }}}
+
+// }}}
+
+////////////////////////////////////////////////////////////
+// Output through the UART                               {{{
+
+static int uart_putchar(char c, FILE *stream) {  // {{{
+	(void) stream;
+	loop_until_bit_is_set(UCSRA, UDRE);
+	UDR = c;
+	return 0;
+}  // }}}
+
+static FILE uart_stdout = FDEV_SETUP_STREAM(uart_putchar, NULL, _FDEV_SETUP_WRITE);
+
+static void uart_init(void) {  // {{{
+	UBRRH = UBRRH_VALUE;
+	UBRRL = UBRRL_VALUE;
+#if USE_2X
+	UCSRA |= (1 << U2X);
+#else
+	UCSRA &= ~(1 << U2X);
+#endif
+	UCSRB = (1 << TXEN);
+	// 8N1
+	UCSRC = (1 << URSEL) | (1 << UCSZ1) | (1 << UCSZ0);
+	stdout = &uart_stdout;
+}  // }}}
+
+// }}}
+
+////////////////////////////////////////////////////////////
+// Timing                                                {{{
+
+typedef struct CycleStats {
+	uint32_t min;
+	uint32_t max;
+	uint32_t total;
+	uint16_t calls;
+} CycleStats;
+
+static uint16_t timing_overhead;
+static uchar over_budget;
+
+
+static uint32_t run_timed(void (*func)(void)) {  // {{{
+	// Returns how many cycles func() took, including the timing overhead.
+	// Valid up to 131071 cycles (one Timer1 overflow).
+	uint16_t count;
+	uchar overflow;
+
+	TCNT1 = 0;
+	TIFR = 1 << TOV1;
+	func();
+	count = TCNT1;
+	overflow = TIFR & (1 << TOV1);
+
+	// If the overflow happened just after reading TCNT1, count is still
+	// close to 0xFFFF and must not be adjusted.
+	if (overflow && count < 0x8000) {
+		return count + 0x10000UL;
+	}
+	return count;
+}  // }}}
+
+static void do_nothing(void) {  // {{{
+}  // }}}
+
+static void timing_init(void) {  // {{{
+	// Timer1 at full speed (prescaler = 1)
+	TCCR1A = 0;
+	TCCR1B = 1 << CS10;
+
+	// Calling through the same path as the real measurements
+	timing_overhead = run_timed(do_nothing);
+}  // }}}
+
+static void measure(CycleStats *stats, void (*func)(void)) {  // {{{
+	uint32_t cycles = run_timed(func) - timing_overhead;
+
+	if (stats->calls == 0 || cycles < stats->min) stats->min = cycles;
+	if (cycles > stats->max) stats->max = cycles;
+	stats->total += cycles;
+	stats->calls++;
+}  // }}}
+
+static void print_stats(PGM_P name, const CycleStats *stats) {  // {{{
+	uchar over = stats->max > CYCLEBENCH_BUDGET;
+
+	printf_P(PSTR("%-32S %6lu %6lu %6lu%S\n"),
+		name,
+		stats->min,
+		stats->total / stats->calls,
+		stats->max,
+		over ? PSTR("  OVER BUDGET") : PSTR("")
+	);
+	over_budget |= over;
+}  // }}}
+
+// }}}
+
+////////////////////////////////////////////////////////////
+// Benchmarked calls                                     {{{
+
+// Each one is a non-inlined function without arguments, so that the
+// compiler can't move any work outside the timed region.
+
+static coord_t smoothing_input;
+
+static void __attribute__((noinline)) call_update_button_state_idle(void) {  // {{{
+	update_button_state(0);
+}  // }}}
+
+static void __attribute__((noinline)) call_update_button_state_tick(void) {  // {{{
+	update_button_state(1);
+}  // }}}
+
+static void __attribute__((noinline)) call_sensor_read_data_registers(void) {  // {{{
+	sensor_read_data_registers();
+}  // }}}
+
+static uchar mouse_report_updated;
+
+static void __attribute__((noinline)) call_mouse_prepare_next_report(void) {  // {{{
+	mouse_report_updated = mouse_prepare_next_report();
+}  // }}}
+
+static void __attribute__((noinline)) call_apply_smoothing(void) {  // {{{
+	apply_smoothing(0, &smoothing_input);
+}  // }}}
+
+#if ENABLE_DIRECTION_FILTER
+static const XYZVector *direction_input;
+static XYZVector direction_output;
+
+static void __attribute__((noinline)) call_mouse_filter_direction(void) {  // {{{
+	mouse_filter_direction(direction_input, &direction_output);
+}  // }}}
+#endif
+
+static void __attribute__((noinline)) call_send_next_char(void) {  // {{{
+	send_next_char();
+}  // }}}
+
+// }}}
+
+////////////////////////////////////////////////////////////
+// Main code                                             {{{
+
+static void load_calibration(void) {  // {{{
+	// What sensor_init_configuration() would read from the EEPROM
+	uchar i;
+
+	sensor_init_defaults();
+	sensor.e.zero_compensation = 1;
+	sensor.e.zero.x = 0;
+	sensor.e.zero.y = 0;
+	sensor.e.zero.z = 0;
+	for (i = 0; i < 4; i++) {
+		sensor.e.corners[i] = corners[i];
+	}
+	sensor.corners_changed = 1;
+}  // }}}
+
+void
+__attribute__ ((noreturn))
+main(void) {  // {{{
+	CycleStats button_idle = {0, 0, 0, 0};
+	CycleStats button_tick = {0, 0, 0, 0};
+	CycleStats sensor_read = {0, 0, 0, 0};
+	CycleStats mouse_basis = {0, 0, 0, 0};
+	CycleStats mouse_new_data = {0, 0, 0, 0};
+	CycleStats mouse_no_data = {0, 0, 0, 0};
+	CycleStats mouse_full_ring = {0, 0, 0, 0};
+	CycleStats smoothing = {0, 0, 0, 0};
+#if ENABLE_DIRECTION_FILTER
+	CycleStats direction = {0, 0, 0, 0};
+#endif
+	CycleStats typing = {0, 0, 0, 0};
+	uint32_t worst_iteration;
+	uchar wrong_output = 0;
+	uchar i;
+
+	cli();
+
+	// Buttons are read from PINC, with pull-ups (nothing pressed)
+	PORTC = 0xFF;
+	DDRC = 0;
+
+	uart_init();
+	timing_init();
+
+	init_keyboard_emulation();
+	init_mouse_emulation();
+	load_calibration();
+
+	printf_P(PSTR("F_CPU %lu, ENABLE_FIXED_POINT %d, ENABLE_HOMOGRAPHY %d, ENABLE_DIRECTION_FILTER %d\n"),
+		(uint32_t) F_CPU, ENABLE_FIXED_POINT, ENABLE_HOMOGRAPHY, ENABLE_DIRECTION_FILTER);
+	printf_P(PSTR("Timing overhead: %u cycles (already subtracted)\n"), timing_overhead);
+	printf_P(PSTR("%-32S %6S %6S %6S\n"), PSTR("function"), PSTR("min"), PSTR("avg"), PSTR("max"));
+
+	for (i = 0; i < 64; i++) {
+		measure(&button_idle, call_update_button_state_idle);
+		measure(&button_tick, call_update_button_state_tick);
+	}
+
+	// The sensor data goes through the same path as in the firmware:
+	// sensor_read_data_registers() and then mouse_prepare_next_report().
+	// With the identity correction and the zero at the origin, the valid
+	// vectors (all but the last two) must come out of the sensor code
+	// unchanged, and each one must update the report. Otherwise, the
+	// measured path is not the one the firmware runs.
+
+	// The first call also calculates the projection basis
+	twi_vector = &vectors[0];
+	sensor_read_data_registers();
+	measure(&mouse_basis, call_mouse_prepare_next_report);
+	if (!mouse_report_updated) {
+		wrong_output = 1;
+	}
+
+	// Then the ring is filled with valid vectors before each call, as when
+	// the main loop falls behind the sensor. This goes first, as the
+	// overflow vector below changes the gain.
+	for (i = 0; i + SENSOR_RING_SIZE <= VECTORS_COUNT - 2; i += SENSOR_RING_SIZE) {
+		uchar j;
+
+		for (j = 0; j < SENSOR_RING_SIZE; j++) {
+			twi_vector = &vectors[i + j];
+			sensor_read_data_registers();
+		}
+		if ((uchar) (sensor.ring.head - sensor.ring.tail) != SENSOR_RING_SIZE) {
+			wrong_output = 1;
+		}
+		measure(&mouse_full_ring, call_mouse_prepare_next_report);
+		if (!mouse_report_updated || sensor_ring_peek(&sensor.ring)) {
+			wrong_output = 1;
+		}
+	}
+
+	// And one sample at a time
+	for (i = 0; i < VECTORS_COUNT; i++) {
+		uchar valid = i < VECTORS_COUNT - 2;
+
+		twi_vector = &vectors[i];
+		measure(&sensor_read, call_sensor_read_data_registers);
+		if (valid && (
+			sensor.data.x != vectors[i].x
+			|| sensor.data.y != vectors[i].y
+			|| sensor.data.z != vectors[i].z
+		)) {
+			wrong_output = 1;
+		}
+
+		measure(&mouse_new_data, call_mouse_prepare_next_report);
+		if (valid && !mouse_report_updated) {
+			wrong_output = 1;
+		}
+		measure(&mouse_no_data, call_mouse_prepare_next_report);
+	}
+
+	for (i = 0; i <= 16; i++) {
+		smoothing_input = i * (COORD_ONE / 16);
+		measure(&smoothing, call_apply_smoothing);
+	}
+
+#if ENABLE_DIRECTION_FILTER
+	// Only the valid vectors, without the last two.
+	for (i = 0; i < VECTORS_COUNT - 2; i++) {
+		direction_input = &vectors[i];
+		measure(&direction, call_mouse_filter_direction);
+	}
+#endif
+
+	strcpy_P((char*) string_output_buffer, typed_string);
+	string_output_pointer = string_output_buffer;
+	while (string_output_pointer != NULL) {
+		measure(&typing, call_send_next_char);
+	}
+
+	print_stats(PSTR("update_button_state(0)"), &button_idle);
+	print_stats(PSTR("update_button_state(1)"), &button_tick);
+	print_stats(PSTR("sensor_read_data_registers"), &sensor_read);
+	print_stats(PSTR("mouse_prepare_next_report"), &mouse_new_data);
+	print_stats(PSTR("  without new data"), &mouse_no_data);
+	print_stats(PSTR("  with new corners"), &mouse_basis);
+	print_stats(PSTR("  with a full ring"), &mouse_full_ring);
+	print_stats(PSTR("apply_smoothing"), &smoothing);
+#if ENABLE_DIRECTION_FILTER
+	print_stats(PSTR("mouse_filter_direction"), &direction);
+#endif
+	print_stats(PSTR("send_next_char"), &typing);
+
+	// Worst main loop iteration, excluding usbPoll() and the occasional
+	// basis calculation. The mouse and the keyboard code never run in the
+	// same iteration.
+	worst_iteration = button_tick.max + sensor_read.max
+		+ (mouse_full_ring.max > typing.max ? mouse_full_ring.max : typing.max);
+	printf_P(PSTR("Worst main loop iteration: %lu cycles, budget %lu\n"),
+		worst_iteration, (uint32_t) CYCLEBENCH_BUDGET);
+	if (worst_iteration > CYCLEBENCH_BUDGET) {
+		over_budget = 1;
+	}
+
+	if (wrong_output) {
+		printf_P(PSTR("Wrong output: the vectors were not projected\n"));
+	}
+
+	printf_P(over_budget || wrong_output ? PSTR("RESULT: FAIL\n") : PSTR("RESULT: PASS\n"));
+	loop_until_bit_is_set(UCSRA, UDRE);
+
+	// Sleeping with interrupts disabled makes simavr exit.
+	for (;;) {
+		sleep_mode();
+	}
+}  // }}}
+
+// }}}
+
+// vim:noexpandtab tabstop=4 shiftwidth=4 foldmethod=marker foldmarker={{{,}}}
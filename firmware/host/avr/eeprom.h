@@ -0,0 +1,23 @@
+/* Name: eeprom.h
+ *
+ * Stand-in for <avr/eeprom.h>, used when building firmware modules on a PC.
+ * The EEPROM variables become ordinary variables, initialized with their
+ * default values.
+ */
+
+#ifndef __host_avr_eeprom_h_included__
+#define __host_avr_eeprom_h_included__
+
+#include <stdint.h>
+#include <string.h>
+
+
+#define EEMEM
+
+#define eeprom_read_block(dst, src, size) memcpy((dst), (src), (size))
+#define eeprom_read_byte(addr) (*(const uint8_t *) (addr))
+
+
+#endif  // __host_avr_eeprom_h_included__
+
+// vim:noexpandtab tabstop=4 shiftwidth=4 foldmethod=marker foldmarker={{{,}}}
@@ -0,0 +1,20 @@
+/* Name: interrupt.h
+ *
+ * Stand-in for <avr/interrupt.h>, used when building firmware modules on a
+ * PC. There are no interrupts: the ISRs become ordinary functions.
+ */
+
+#ifndef __host_avr_interrupt_h_included__
+#define __host_avr_interrupt_h_included__
+
+
+#define sei() do{ }while(0)
+#define cli() do{ }while(0)
+
+#define ISR(vector, ...) void vector(void)
+#define ISR_NOBLOCK
+
+
+#endif  // __host_avr_interrupt_h_included__
+
+// vim:noexpandtab tabstop=4 shiftwidth=4 foldmethod=marker foldmarker={{{,}}}
@@ -0,0 +1,46 @@
+/* Name: io.h
+ *
+ * Stand-in for <avr/io.h>, used when building firmware modules on a PC.
+ * Only the registers and bits used by the firmware are declared. They are
+ * plain variables, defined by whatever program links the firmware modules
+ * (see projection/firmware_sim.c), which also gives them a meaning.
+ */
+
+#ifndef __host_avr_io_h_included__
+#define __host_avr_io_h_included__
+
+
+extern volatile unsigned char PORTB, DDRB, PINB;
+extern volatile unsigned char PORTC, DDRC, PINC;
+extern volatile unsigned char PORTD, DDRD, PIND;
+
+// Timer0
+extern volatile unsigned char TCCR0, TCNT0, TIMSK, TIFR;
+#define TOIE0 0
+#define TOV0  0
+
+// Timer1
+extern volatile unsigned char TCCR1A, TCCR1B;
+extern volatile unsigned short TCNT1;
+
+// External interrupts
+extern volatile unsigned char MCUCR, GICR, GIFR;
+#define ISC10 2
+#define ISC11 3
+#define INT1  7
+#define INTF1 7
+
+// TWI (only used by avr315/TWI_Master.c, see projection/twi_test.c)
+extern volatile unsigned char TWBR, TWSR, TWDR, TWCR;
+#define TWIE  0
+#define TWEN  2
+#define TWWC  3
+#define TWSTO 4
+#define TWSTA 5
+#define TWEA  6
+#define TWINT 7
+
+
+#endif  // __host_avr_io_h_included__
+
+// vim:noexpandtab tabstop=4 shiftwidth=4 foldmethod=marker foldmarker={{{,}}}
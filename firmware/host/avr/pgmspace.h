@@ -0,0 +1,40 @@
+/* Name: pgmspace.h
+ *
+ * Stand-in for <avr/pgmspace.h>, used when building firmware modules on a
+ * PC, where there is a single address space.
+ */
+
+#ifndef __host_avr_pgmspace_h_included__
+#define __host_avr_pgmspace_h_included__
+
+#include <stdint.h>
+#include <string.h>
+
+
+#define PROGMEM
+
+#define PGM_P      const char *
+#define PGM_VOID_P const void *
+
+#define PSTR(s) (s)
+
+#define pgm_read_byte_near(addr) (*(const uint8_t *) (addr))
+
+// The firmware only uses this for reading pointers, which are 16 bits on AVR.
+static inline uintptr_t pgm_read_word_near(const void *addr) {
+	uintptr_t value;
+	memcpy(&value, addr, sizeof(value));
+	return value;
+}
+
+// For 16-bit data. Same as pgm_read_word_near() on AVR.
+#define pgm_read_word(addr) (*(const uint16_t *) (addr))
+
+#define memcpy_P(dst, src, size) memcpy((dst), (src), (size))
+#define strcpy_P(dst, src) strcpy((char *) (dst), (src))
+#define strcat_P(dst, src) strcat((char *) (dst), (src))
+
+
+#endif  // __host_avr_pgmspace_h_included__
+
+// vim:noexpandtab tabstop=4 shiftwidth=4 foldmethod=marker foldmarker={{{,}}}
@@ -0,0 +1,19 @@
+/* Name: wdt.h
+ *
+ * Stand-in for <avr/wdt.h>, used when building firmware modules on a PC.
+ * There is no watchdog.
+ */
+
+#ifndef __host_avr_wdt_h_included__
+#define __host_avr_wdt_h_included__
+
+
+#define WDTO_2S 7
+
+#define wdt_enable(timeout) do{ }while(0)
+#define wdt_reset() do{ }while(0)
+
+
+#endif  // __host_avr_wdt_h_included__
+
+// vim:noexpandtab tabstop=4 shiftwidth=4 foldmethod=marker foldmarker={{{,}}}
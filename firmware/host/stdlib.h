@@ -0,0 +1,24 @@
+/* Name: stdlib.h
+ *
+ * Adds the non-standard functions from avr-libc's <stdlib.h>, used when
+ * building firmware modules on a PC.
+ */
+
+#ifndef __host_stdlib_h_included__
+#define __host_stdlib_h_included__
+
+#include_next <stdlib.h>
+#include <stdio.h>
+
+
+static inline char *itoa(int value, char *s, int radix) {
+	// Only radix 10 is used by the firmware.
+	(void) radix;
+	sprintf(s, "%d", value);
+	return s;
+}
+
+
+#endif  // __host_stdlib_h_included__
+
+// vim:noexpandtab tabstop=4 shiftwidth=4 foldmethod=marker foldmarker={{{,}}}
@@ -0,0 +1,63 @@
+/* Name: usbdrv.h
+ *
+ * Stand-in for the V-USB driver header, used when building firmware modules
+ * on a PC. Declares only what main.c uses. The functions are implemented by
+ * whatever program links the firmware modules (see
+ * projection/firmware_sim.c), which also simulates the USB host.
+ */
+
+#ifndef __host_usbdrv_h_included__
+#define __host_usbdrv_h_included__
+
+#include "usbconfig.h"
+
+
+#ifndef uchar
+#define uchar  unsigned char
+#endif
+
+#define USB_PUBLIC
+
+#define USBMASK ((1<<USB_CFG_DPLUS_BIT) | (1<<USB_CFG_DMINUS_BIT))
+
+
+// Same as in usbdrv.h from V-USB
+typedef union usbWord{
+	unsigned short word;
+	uchar          bytes[2];
+}usbWord_t;
+
+typedef struct usbRequest{
+	uchar       bmRequestType;
+	uchar       bRequest;
+	usbWord_t   wValue;
+	usbWord_t   wIndex;
+	usbWord_t   wLength;
+}usbRequest_t;
+
+#define USBRQ_TYPE_MASK         0x60
+#define USBRQ_TYPE_STANDARD     (0<<5)
+#define USBRQ_TYPE_CLASS        (1<<5)
+#define USBRQ_TYPE_VENDOR       (2<<5)
+
+#define USBRQ_HID_GET_REPORT    0x01
+#define USBRQ_HID_GET_IDLE      0x02
+#define USBRQ_HID_GET_PROTOCOL  0x03
+#define USBRQ_HID_SET_REPORT    0x09
+#define USBRQ_HID_SET_IDLE      0x0a
+#define USBRQ_HID_SET_PROTOCOL  0x0b
+
+
+extern uchar *usbMsgPtr;
+
+USB_PUBLIC void usbInit(void);
+USB_PUBLIC void usbPoll(void);
+USB_PUBLIC void usbSetInterrupt(uchar *data, uchar len);
+USB_PUBLIC uchar usbInterruptIsReady(void);
+
+USB_PUBLIC uchar usbFunctionSetup(uchar data[8]);
+
+
+#endif  // __host_usbdrv_h_included__
+
+// vim:noexpandtab tabstop=4 shiftwidth=4 foldmethod=marker foldmarker={{{,}}}
@@ -0,0 +1,17 @@
+/* Name: atomic.h
+ *
+ * Stand-in for <util/atomic.h>, used when building firmware modules on a PC.
+ * There are no interrupts, so the block just runs once.
+ */
+
+#ifndef __host_util_atomic_h_included__
+#define __host_util_atomic_h_included__
+
+
+#define ATOMIC_BLOCK(type) for (unsigned char __atomic_todo = 1; __atomic_todo; __atomic_todo = 0)
+#define ATOMIC_RESTORESTATE
+
+
+#endif  // __host_util_atomic_h_included__
+
+// vim:noexpandtab tabstop=4 shiftwidth=4 foldmethod=marker foldmarker={{{,}}}
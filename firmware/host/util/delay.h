@@ -0,0 +1,17 @@
+/* Name: delay.h
+ *
+ * Stand-in for <util/delay.h>, used when building firmware modules on a PC.
+ * The delays are only used during initialization, and take no time here.
+ */
+
+#ifndef __host_util_delay_h_included__
+#define __host_util_delay_h_included__
+
+
+#define _delay_ms(ms) do{ }while(0)
+#define _delay_us(us) do{ }while(0)
+
+
+#endif  // __host_util_delay_h_included__
+
+// vim:noexpandtab tabstop=4 shiftwidth=4 foldmethod=marker foldmarker={{{,}}}
@@ -61,6 +61,11 @@ void int_eeprom_write_block(
 }  // }}}
 
 
+unsigned char int_eeprom_busy(void) {  // {{{
+	return eeprom_block_size != 0;
+}  // }}}
+
+
 ISR(EE_RDY_vect) {  // {{{
 	//if ( SPMCR & (1 << SPMEN) ) // Is Self-Programming Currently Active?
 	//	return;                   // Yes, Return to main()
@@ -24,6 +24,10 @@ void int_eeprom_write_block(
 		void* address,
 		unsigned char size);
 
+// Only one block can be written at a time. Returns non-zero while the
+// previous block is still being written.
+unsigned char int_eeprom_busy(void);
+
 
 #endif  // __int_eeprom_h_included____
 
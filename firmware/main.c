@@ -91,7 +91,7 @@
  * PD0: USB-
  * PD1: (not used - debug tx)
  * PD2: USB+ (int0)
- * PD3: (not used)
+ * PD3: HMC5883L DRDY (int1), only if ENABLE_SENSOR_DRDY
  * PD4: (not used)
  * PD5: red debug LED
  * PD6: yellow debug LED
@@ -306,6 +306,21 @@ static void hardware_init(void) {  // {{{
 	// I'm using Timer0 as a 1.365ms ticker. Every time it overflows, the TOV0
 	// flag in TIFR is set.
 
+	// Timer1 runs freely with prescaler = 64 (5.33us per count, wraps
+	// around every 349ms), for timestamping the sensor samples.
+	// See page 99 from ATmega8 datasheet.
+	TCCR1A = 0;
+	TCCR1B = 3;
+
+#if ENABLE_SENSOR_DRDY
+	// The sensor DRDY pin is open-drain with an internal pull-up, and goes
+	// low for 250us after each measurement. INT1 on the falling edge.
+	// See page 66 from ATmega8 datasheet.
+	MCUCR = (MCUCR & ~((1 << ISC11) | (1 << ISC10))) | (1 << ISC11);
+	GIFR = 1 << INTF1;
+	GICR |= 1 << INT1;
+#endif
+
 	// I'm not using serial-line debugging
 	//odDebugInit();
 
@@ -370,7 +385,9 @@ usbFunctionSetup(uchar data[8]) {  // {{{
 void
 __attribute__ ((noreturn))
 main(void) {  // {{{
+#if !ENABLE_SENSOR_DRDY
 	uchar sensor_probe_counter = 0;
+#endif
 	uchar timer_overflow = 0;
 
 #if ENABLE_IDLE_RATE
@@ -419,6 +436,13 @@ main(void) {  // {{{
 
 		update_button_state(timer_overflow);
 
+#if ENABLE_TWI_RECOVERY
+		// Clearing the I2C bus if it is stuck, or after a bus error
+		if (timer_overflow && TWI_Check_Bus()) {
+			sensor_bus_recovered();
+		}
+#endif
+
 		// Red LED lights up if there is any kind of error in I2C communication
 		if ( TWI_statusReg.lastTransOK ) {
 			LED_TURN_OFF(RED_LED);
@@ -439,15 +463,23 @@ main(void) {  // {{{
 			// Upon pressing the switch, start the continuous reading for
 			// mouse emulation code.
 			sensor_start_continuous_reading();
+#if ENABLE_ZERO_TRACKING
+			sensor_start_zero_tracking();
+#endif
 		}
 
 		// Continuous reading of sensor data
 		if (sensor.continuous_reading) {  // {{{
+#if ENABLE_SENSOR_DRDY
+			// Each read is started by the DRDY interrupt, as soon as the
+			// sensor has a new sample. This only collects the result.
+			sensor_read_data_registers();
+#else
 			// Timer is set to 1.365ms
 			if (timer_overflow) {
-				// The sensor is configured for 75Hz measurements.
-				// I'm using this timer to read the values twice that rate.
-				// 5 * 1.365ms = 6.827ms ~= 146Hz
+				// The waiting time depends on the acquisition profile.
+				// For the default one, the sensor is configured for 75Hz
+				// measurements, and this reads the values twice that rate.
 				if (sensor_probe_counter > 0){
 					// Waiting...
 					sensor_probe_counter--;
@@ -460,9 +492,10 @@ main(void) {  // {{{
 				return_code = sensor_read_data_registers();
 				if (return_code == SENSOR_FUNC_DONE || return_code == SENSOR_FUNC_ERROR) {
 					// Restart the counter+timer
-					sensor_probe_counter = 5;
+					sensor_probe_counter = sensor.probe_period;
 				}
 			}
+#endif
 		}  // }}}
 
 #if ENABLE_IDLE_RATE
@@ -60,6 +60,8 @@
 #define UI_SENSOR_XYZ_ONCE_WIDGET         0x1A
 #define UI_SENSOR_XYZ_CONT_WIDGET         0x1B
 #define UI_KEYBOARD_TEST_WIDGET           0x1C
+#define UI_SENSOR_PROFILE_WIDGET          0x1D
+#define UI_SENSOR_SELF_TEST_WIDGET        0x1E
 // }}}
 
 typedef struct MenuItem {  // {{{
@@ -171,18 +173,49 @@ static const PGM_P corners_names[4] PROGMEM = {
 // }}}
 
 // Sensor data menu  {{{
+// The last items depend on ENABLE_SENSOR_PROFILES and ENABLE_SELF_TEST.
 #if ENABLE_FULL_MENU
 static const char     sensor_menu_1[] PROGMEM = "3.1. Print sensor identification\n";
 static const char     sensor_menu_2[] PROGMEM = "3.2. Print X,Y,Z once\n";
 static const char     sensor_menu_3[] PROGMEM = "3.3. Print X,Y,Z continually\n";
-static const char     sensor_menu_4[] PROGMEM = "3.4. << back\n";
+#if ENABLE_SENSOR_PROFILES && ENABLE_SELF_TEST
+static const char     sensor_menu_4[] PROGMEM = "3.4. Next acquisition profile\n";
+static const char     sensor_menu_5[] PROGMEM = "3.5. Self-test axis scale calibration\n";
+static const char     sensor_menu_6[] PROGMEM = "3.6. << back\n";
+#define               sensor_menu_total_items 6
+#elif ENABLE_SENSOR_PROFILES
+static const char     sensor_menu_4[] PROGMEM = "3.4. Next acquisition profile\n";
+static const char     sensor_menu_6[] PROGMEM = "3.5. << back\n";
+#define               sensor_menu_total_items 5
+#elif ENABLE_SELF_TEST
+static const char     sensor_menu_5[] PROGMEM = "3.4. Self-test axis scale calibration\n";
+static const char     sensor_menu_6[] PROGMEM = "3.5. << back\n";
+#define               sensor_menu_total_items 5
+#else
+static const char     sensor_menu_6[] PROGMEM = "3.4. << back\n";
 #define               sensor_menu_total_items 4
+#endif
 #else
 static const char     sensor_menu_2[] PROGMEM = "3.1. Print X,Y,Z once\n";
 static const char     sensor_menu_3[] PROGMEM = "3.2. Print X,Y,Z continually\n";
-static const char     sensor_menu_4[] PROGMEM = "3.3. << back\n";
+#if ENABLE_SENSOR_PROFILES && ENABLE_SELF_TEST
+static const char     sensor_menu_4[] PROGMEM = "3.3. Next profile\n";
+static const char     sensor_menu_5[] PROGMEM = "3.4. Self-test\n";
+static const char     sensor_menu_6[] PROGMEM = "3.5. << back\n";
+#define               sensor_menu_total_items 5
+#elif ENABLE_SENSOR_PROFILES
+static const char     sensor_menu_4[] PROGMEM = "3.3. Next profile\n";
+static const char     sensor_menu_6[] PROGMEM = "3.4. << back\n";
+#define               sensor_menu_total_items 4
+#elif ENABLE_SELF_TEST
+static const char     sensor_menu_5[] PROGMEM = "3.3. Self-test\n";
+static const char     sensor_menu_6[] PROGMEM = "3.4. << back\n";
+#define               sensor_menu_total_items 4
+#else
+static const char     sensor_menu_6[] PROGMEM = "3.3. << back\n";
 #define               sensor_menu_total_items 3
 #endif
+#endif
 
 static const MenuItem sensor_menu_items[] PROGMEM = {
 #if ENABLE_FULL_MENU
@@ -190,11 +223,32 @@ static const MenuItem sensor_menu_items[] PROGMEM = {
 #endif
 	{sensor_menu_2, UI_SENSOR_XYZ_ONCE_WIDGET},
 	{sensor_menu_3, UI_SENSOR_XYZ_CONT_WIDGET},
-	{sensor_menu_4, 0}
+#if ENABLE_SENSOR_PROFILES
+	{sensor_menu_4, UI_SENSOR_PROFILE_WIDGET},
+#endif
+#if ENABLE_SELF_TEST
+	{sensor_menu_5, UI_SENSOR_SELF_TEST_WIDGET},
+#endif
+	{sensor_menu_6, 0}
 };
 
 // Error message:
 static const char  error_sensor_string[] PROGMEM = "Sensor reading error\n";
+#if ENABLE_SELF_TEST
+static const char  self_test_skipped_string[] PROGMEM = "Not replacing the ellipsoid fit\n";
+#endif
+
+#if ENABLE_SENSOR_PROFILES
+// Acquisition profile names, in the same order as SENSOR_PROFILE_*
+static const char profile_name_low_noise[]   PROGMEM = "Low noise\n";
+static const char profile_name_low_latency[] PROGMEM = "Low latency\n";
+static const char profile_name_single_shot[] PROGMEM = "Single-shot\n";
+static const PGM_P profile_names[SENSOR_TOTAL_PROFILES] PROGMEM = {
+	profile_name_low_noise,
+	profile_name_low_latency,
+	profile_name_single_shot
+};
+#endif
 // }}}
 
 #if ENABLE_FULL_MENU
@@ -384,7 +438,9 @@ void ui_main_code() {  // {{{
 	//
 	// This function handles the actions of all UI widgets.
 
+#if ENABLE_FULL_MENU || ENABLE_SELF_TEST || ENABLE_ELLIPSOID_FIT
 	uchar return_code;
+#endif
 
 	SensorData *sens = &sensor;
 	FIX_POINTER(sens);
@@ -430,36 +486,30 @@ void ui_main_code() {  // {{{
 					// Must disable zero compensation before calibration
 					sens->e.zero_compensation = 0;
 
+					sensor_calibration_start();
 					sensor_start_continuous_reading();
 					ui.menu_item = 1;
-				} else if(ui.menu_item == 1) {
-					// The first reading
-					if (sens->new_data_available) {
-						sens->new_data_available = 0;
-
-						if (!sens->overflow) {
-							sens->zero_min = sens->data;
-							sens->zero_max = sens->data;
-							// Using memcpy costs a few more bytes than simple attribution
-							//memcpy(&sens->zero_min, &sens->data, sizeof(sens->data));
-							//memcpy(&sens->zero_max, &sens->data, sizeof(sens->data));
+#if ENABLE_ELLIPSOID_FIT
+				} else if (ui.menu_item == 2) {
+					// Saving the fitted correction matrix, after the previous
+					// EEPROM block has been written.
+					if (!int_eeprom_busy()) {
+						int_eeprom_write_block(
+							&sens->correction,
+							&eeprom_sensor_correction,
+							sizeof(sens->correction)
+						);
 
-							ui.menu_item = 2;
-						}
+						ui_pop_state();
+						ui_enter_widget(UI_ZERO_PRINT_WIDGET);
 					}
+#endif
 				} else {
 					if (sens->new_data_available) {
 						sens->new_data_available = 0;
 
 						if (!sens->overflow) {
-							// The following 6 if statements cost 96 bytes
-							if (sens->data.x < sens->zero_min.x) sens->zero_min.x = sens->data.x;
-							if (sens->data.y < sens->zero_min.y) sens->zero_min.y = sens->data.y;
-							if (sens->data.z < sens->zero_min.z) sens->zero_min.z = sens->data.z;
-
-							if (sens->data.x > sens->zero_max.x) sens->zero_max.x = sens->data.x;
-							if (sens->data.y > sens->zero_max.y) sens->zero_max.y = sens->data.y;
-							if (sens->data.z > sens->zero_max.z) sens->zero_max.z = sens->data.z;
+							sensor_calibration_add_sample();
 
 							if (string_output_pointer == NULL) {
 								XYZVector_to_string(&sens->data, string_output_buffer);
@@ -471,9 +521,12 @@ void ui_main_code() {  // {{{
 					if (ON_KEY_DOWN(BUTTON_CONFIRM)) {
 						sensor_stop_continuous_reading();
 
-						sens->e.zero.x = (sens->zero_min.x + sens->zero_max.x) / 2;
-						sens->e.zero.y = (sens->zero_min.y + sens->zero_max.y) / 2;
-						sens->e.zero.z = (sens->zero_min.z + sens->zero_max.z) / 2;
+						// Zero (hard-iron) and soft-iron correction
+#if ENABLE_ELLIPSOID_FIT
+						return_code = sensor_calibration_finish();
+#else
+						sensor_calibration_finish();
+#endif
 
 						sens->e.zero_compensation = 1;
 
@@ -486,7 +539,13 @@ void ui_main_code() {  // {{{
 							&eeprom_sensor.zero_compensation,
 							(1 + sizeof(XYZVector))
 						);
-
+#if ENABLE_ELLIPSOID_FIT
+						// The correction only changes with the ellipsoid fit
+						if (return_code) {
+							ui.menu_item = 2;
+							break;
+						}
+#endif
 						ui_pop_state();
 						ui_enter_widget(UI_ZERO_PRINT_WIDGET);
 					}
@@ -561,6 +620,7 @@ void ui_main_code() {  // {{{
 
 					// Saving
 					sens->e.corners[ui.menu_item] = sens->data;
+					sens->corners_changed = 1;
 					int_eeprom_write_block(
 						&sens->e.corners[ui.menu_item],
 						&eeprom_sensor.corners[ui.menu_item],
@@ -640,6 +700,90 @@ void ui_main_code() {  // {{{
 				}
 				break;  // }}}
 
+#if ENABLE_SENSOR_PROFILES
+			////////////////////
+			case UI_SENSOR_PROFILE_WIDGET:  // {{{
+				if (string_output_pointer != NULL) {
+					// Do nothing, let's wait the previous output...
+					break;
+				}
+				if (int_eeprom_busy()) {
+					// And the previous EEPROM block (e.g. from a key
+					// repeat), which would be cut short.
+					break;
+				}
+
+				// Cycling through the profiles
+				sensor_set_profile((sens->profile + 1) % SENSOR_TOTAL_PROFILES);
+
+				// Saving to EEPROM
+				int_eeprom_write_block(
+					&sens->profile,
+					&eeprom_sensor_profile,
+					1
+				);
+
+				output_pgm_string(
+					(PGM_VOID_P) pgm_read_word_near(
+						&profile_names[sens->profile]
+					)
+				);
+				ui_pop_state();
+				break;  // }}}
+#endif
+
+#if ENABLE_SELF_TEST
+			////////////////////
+			case UI_SENSOR_SELF_TEST_WIDGET:  // {{{
+				if (string_output_pointer != NULL) {
+					// Do nothing, let's wait the previous output...
+					break;
+				}
+				if (ui.menu_item == 0) {
+					// The ellipsoid fit already evens out the axis scales, and
+					// its cross-axis terms would be lost.
+					if (!sensor_correction_is_diagonal()) {
+						output_pgm_string(self_test_skipped_string);
+						ui_pop_state();
+						break;
+					}
+					sens->func_step = 0;
+					sens->self_test_step = 0;
+					ui.menu_item = 1;
+				} else if (ui.menu_item == 2) {
+					// Saving the correction matrix, after the previous
+					// EEPROM block has been written.
+					if (!int_eeprom_busy()) {
+						XYZVector scale;
+
+						int_eeprom_write_block(
+							&sens->correction,
+							&eeprom_sensor_correction,
+							sizeof(sens->correction)
+						);
+
+						// Printing the new scales
+						scale.x = sens->correction[0].x;
+						scale.y = sens->correction[1].y;
+						scale.z = sens->correction[2].z;
+						XYZVector_to_string(&scale, string_output_buffer);
+						string_output_pointer = string_output_buffer;
+						ui_pop_state();
+					}
+					break;
+				}
+
+				return_code = sensor_self_test();
+
+				if (return_code == SENSOR_FUNC_DONE) {
+					ui.menu_item = 2;
+				} else if (return_code == SENSOR_FUNC_ERROR) {
+					output_pgm_string(error_sensor_string);
+					ui_pop_state();
+				}
+				break;  // }}}
+#endif
+
 #if ENABLE_FULL_MENU
 			////////////////////
 			case UI_KEYBOARD_TEST_WIDGET:  // {{{
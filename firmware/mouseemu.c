@@ -7,47 +7,706 @@
  */
 
 
+#include <avr/pgmspace.h>
 #include <math.h>
+#include <stdint.h>
 
 #include "buttons.h"
 #include "common.h"
 #include "mouseemu.h"
+#include "usbconfig.h"
+
+
+// ENABLE_FIXED_POINT selects between two implementations of the coordinate
+// conversion and smoothing code:
+//
+// 0: Floating point. Simple and easy to read, but pulls the soft-float
+//    routines from avr-libc into the firmware.
+// 1: Fixed point. Uses only 16-bit and 32-bit integers. Smaller and faster
+//    on AVR, at the cost of a tiny rounding difference (a few units out of
+//    32767) in the final coordinates.
+//
+// Both are supposed to give the same results. Use
+// projection/mouseemu_replay.c to compare them.
+#ifndef ENABLE_FIXED_POINT
+#define ENABLE_FIXED_POINT 0
+#endif
+
+// ENABLE_HOMOGRAPHY selects how the calibration corners are used:
+//
+// 0: Only topleft, topright and bottomleft are used, and the screen is
+//    mapped as a parallelogram (affine mapping).
+// 1: All four corners are used, and the screen is mapped as an arbitrary
+//    quadrilateral (projective mapping, or homography). This is better for
+//    large screens, where the parallelogram distorts the bottomright area.
+//
+// Both have the same runtime cost, only the basis calculation differs.
+#ifndef ENABLE_HOMOGRAPHY
+#define ENABLE_HOMOGRAPHY 0
+#endif
+
+// ENABLE_ONE_EURO selects the filter used by apply_smoothing():
+//
+// 0: Brown's double exponential smoothing, with a fixed factor. Either
+//    jittery at rest or laggy during fast movements, depending on the factor.
+// 1: One Euro filter (Casiez, Roussel and Vogel, CHI 2012). A single
+//    exponential smoothing, whose cutoff frequency rises with the speed of
+//    the pointer: steady at rest, and with little lag when moving fast.
+//
+// Use projection/smoothing_bench.c to compare them on recorded data.
+#ifndef ENABLE_ONE_EURO
+#define ENABLE_ONE_EURO 0
+#endif
+
+// ENABLE_KALMAN selects yet another filter for apply_smoothing(): a
+// constant-velocity Kalman filter on each axis, with the noise parameters
+// MOUSE_KALMAN_MEASUREMENT_NOISE and MOUSE_KALMAN_PROCESS_NOISE. The
+// filter assumes a fixed sample rate (MOUSE_SAMPLE_RATE, the low-noise
+// profile), so that the Kalman gains converge to constants, which are
+// calculated once by init_mouse_emulation(). Each sample then costs the
+// same as an alpha-beta filter, which follows constant-velocity movements
+// without lag. The estimated velocity is available from mouse_get_velocity().
+#ifndef ENABLE_KALMAN
+#define ENABLE_KALMAN 0
+#endif
+
+#if ENABLE_ONE_EURO && ENABLE_KALMAN
+#error "ENABLE_ONE_EURO and ENABLE_KALMAN can't be used together"
+#endif
+
+// ENABLE_PREDICTION makes Brown's double exponential smoothing (the default
+// filter) return the extrapolated position, instead of the lagging smoothed
+// one. The horizon is the time between reading a sample and the host
+// receiving the report, see MOUSE_PREDICTION_LATENCY_MS.
+#ifndef ENABLE_PREDICTION
+#define ENABLE_PREDICTION 0
+#endif
+
+#if ENABLE_PREDICTION && (ENABLE_ONE_EURO || ENABLE_KALMAN)
+#error "ENABLE_PREDICTION only works with the default smoothing filter"
+#endif
+
+// ENABLE_OUTLIER_REJECTION replaces single spiky samples (e.g. from a relay
+// switching nearby) before the coordinate conversion, see
+// mouse_reject_outlier(). The counters are in mouse_outliers.
+#ifndef ENABLE_OUTLIER_REJECTION
+#define ENABLE_OUTLIER_REJECTION 0
+#endif
+
+// ENABLE_DIRECTION_FILTER moves the smoothing before the projection: the
+// direction of the field (the sample normalized to a unit vector) is
+// smoothed in 3D by mouse_filter_direction(), with the same double
+// exponential smoothing, and apply_smoothing() is not used. The projection
+// amplifies the noise more near the screen edges, and drops the noisy
+// samples that fall out of bounds; smoothing the direction avoids both.
+#ifndef ENABLE_DIRECTION_FILTER
+#define ENABLE_DIRECTION_FILTER 0
+#endif
+
+#if ENABLE_DIRECTION_FILTER && (ENABLE_ONE_EURO || ENABLE_KALMAN || ENABLE_PREDICTION)
+#error "ENABLE_DIRECTION_FILTER replaces apply_smoothing(), and can't be used with its options"
+#endif
+
+// Smoothing factor used by apply_smoothing(). Smaller values give a steadier
+// pointer, but add more lag. This value was choosen empirically.
+// In fixed point, it must be a power of two, given as the shift amount
+// (3 means 2**-3 == 0.125).
+//
+// The replay tools from projection/ override these with variables.
+#ifndef MOUSE_SMOOTHING_ALPHA
+#define MOUSE_SMOOTHING_ALPHA 0.125
+#endif
+#ifndef MOUSE_SMOOTHING_SHIFT
+#define MOUSE_SMOOTHING_SHIFT 3
+#endif
+
+// Nominal samples per second, at the sensor rate (see sensor_profiles[] in
+// sensor.c). The actual rate depends on the acquisition profile (and in
+// polling mode, every read is a sample), thus the filters that depend on it
+// (ENABLE_ONE_EURO and ENABLE_PREDICTION) measure the interval between the
+// sample timestamps instead, see mouse_track_sample_interval(). This is
+// only the initial value.
+#define MOUSE_SAMPLE_RATE 75.0
+
+// Timer1 counts per second (F_CPU / 64 at 12MHz), the unit of the sample
+// timestamps
+#define MOUSE_TIMER1_HZ 187500.0
+// Longer intervals (pauses, dropped samples, or the ring flushed after a
+// click) are not measured. In Timer1 ticks, about 40ms, 3 samples at 75Hz.
+#define MOUSE_SAMPLE_MAX_INTERVAL_TICKS 7500
+// The measured interval is smoothed by 2**-MOUSE_SAMPLE_INTERVAL_SHIFT.
+#define MOUSE_SAMPLE_INTERVAL_SHIFT 3
+
+// Prediction horizon for ENABLE_PREDICTION, in milliseconds. The time from
+// the sample being read until the report is queued was measured with
+// projection/firmware_sim.c (mean of "sample -> queued"), and then the host
+// takes up to USB_CFG_INTR_POLL_INTERVAL to fetch it (measured as 9.5ms on
+// average, thus the whole interval is used).
+#if ENABLE_SENSOR_DRDY
+#define MOUSE_PREDICTION_QUEUE_MS 0.6
+#else
+#define MOUSE_PREDICTION_QUEUE_MS 8.8
+#endif
+#define MOUSE_PREDICTION_LATENCY_MS \
+	(MOUSE_PREDICTION_QUEUE_MS + USB_CFG_INTR_POLL_INTERVAL)
+// Same horizon, in Timer1 ticks. Divided by the sample interval, it gives
+// the horizon in samples.
+#define MOUSE_PREDICTION_LATENCY_TICKS \
+	(MOUSE_PREDICTION_LATENCY_MS * MOUSE_TIMER1_HZ / 1000)
+// The factor of the trend term is alpha / (1 - alpha) * horizon. The fixed
+// point code (where alpha == 2**-MOUSE_SMOOTHING_SHIFT) uses it as Q8, and
+// this is that factor multiplied by the sample interval.
+#define MOUSE_PREDICTION_TREND_TICKS_Q8 \
+	((uint32_t) (256.0 * MOUSE_PREDICTION_LATENCY_TICKS / ((1 << MOUSE_SMOOTHING_SHIFT) - 1) + 0.5))
+
+// A sample is rejected by mouse_reject_outlier() if any axis is farther
+// than MOUSE_OUTLIER_THRESHOLD from the median of that axis over the last 3
+// samples (this one included). In the units of the default gain, where the
+// earth field is about 220. In the 2011-10-24 capture, only 2 samples from
+// the fastest movements go beyond it, and their replacements don't change
+// the reports. Lower values also catch smaller spikes, but start replacing
+// real samples (5 of them at 64, moving the pointer by up to 1.3%).
+#define MOUSE_OUTLIER_THRESHOLD 96
+// After a gap longer than this, in Timer1 ticks (about 53ms, 4 samples at
+// 75Hz), the previous samples are forgotten.
+#define MOUSE_OUTLIER_MAX_GAP_TICKS 10000
+
+// Length of the unit vectors from mouse_filter_direction(). Shorter than
+// the sensor values, which reach 9675 with automatic gain ranging, so
+// mouse_project() has even more headroom. The fixed point code assumes
+// 2**12.
+#define MOUSE_DIRECTION_ONE 4096
+
+// One Euro filter parameters. The cutoff frequency (in Hz) is:
+//   MOUSE_ONE_EURO_MIN_CUTOFF + MOUSE_ONE_EURO_BETA * speed
+// where the speed (in screens per second) is the distance between each
+// sample and the previous output, smoothed by 2**-MOUSE_ONE_EURO_SPEED_SHIFT.
+// Faster speeds than MOUSE_ONE_EURO_MAX_SPEED are limited to it.
+#define MOUSE_ONE_EURO_MIN_CUTOFF  1.0
+#define MOUSE_ONE_EURO_BETA        4.0
+#define MOUSE_ONE_EURO_SPEED_SHIFT 2
+#define MOUSE_ONE_EURO_MAX_SPEED   4.5
+
+// Kalman filter noise parameters (ENABLE_KALMAN), as standard deviations in
+// units of the 0..32767 range: of the projected samples, and of the change
+// in velocity between samples. Only their ratio matters.
+//
+// The process noise is per sample, at MOUSE_SAMPLE_RATE. The sample
+// timestamps are not used: with a faster profile (or ENABLE_SENSOR_DRDY),
+// the same noise per sample means a stronger smoothing in time, and the
+// velocity from mouse_get_velocity() is still per sample. Retune it (with
+// projection/smoothing_bench.c) for builds that don't use the low-noise
+// profile.
+#define MOUSE_KALMAN_MEASUREMENT_NOISE 100
+#define MOUSE_KALMAN_PROCESS_NOISE     20
+
+#if ENABLE_FIXED_POINT
+// Screen coordinates in Q15 format: 0.0 is 0, 1.0 is 32768.
+// Stored in 32 bits because the valid range goes beyond 1.0.
+typedef int32_t coord_t;
+#define COORD_ONE 32768L
+#else
+typedef float coord_t;
+#define COORD_ONE 1.0
+#endif
 
 
 // HID report
 MouseReport mouse_report;
 
 typedef struct SmoothingVars {
+#if ENABLE_KALMAN
+#if ENABLE_FIXED_POINT
+	// Q23 format (i.e. coord_t with 8 extra fractional bits)
+	int32_t position;
+	// Per sample
+	int32_t velocity;
+#else
+	float position;
+	float velocity;
+#endif
+	// Set by the first sample, which initializes the position.
+	uchar started;
+#elif ENABLE_ONE_EURO
+#if ENABLE_FIXED_POINT
+	// Q23 format (i.e. coord_t with 8 extra fractional bits)
+	int32_t value;
+	// Per sample
+	int32_t speed;
+#else
+	float value;
+	float speed;
+#endif
+#else
+#if ENABLE_FIXED_POINT
+	// Q23 format (i.e. coord_t with 8 extra fractional bits)
+	int32_t first;
+	int32_t second;
+#else
 	float first;
 	float second;
+#endif
+#endif
 } SmoothingVars;
 
 SmoothingVars mouse_smooth[2];
 
+#if ENABLE_DIRECTION_FILTER
+typedef struct DirectionVars {
+	// Brown's double exponential smoothing of each axis, see
+	// apply_smoothing(). Units of MOUSE_DIRECTION_ONE, with 8 extra
+	// fractional bits in fixed point.
+#if ENABLE_FIXED_POINT
+	int32_t first[3];
+	int32_t second[3];
+#else
+	float first[3];
+	float second[3];
+#endif
+	// Set by the first sample, which initializes the averages.
+	uchar started;
+} DirectionVars;
+
+static DirectionVars mouse_direction;
+#endif
+
+#if ENABLE_OUTLIER_REJECTION
+MouseOutlierCounters mouse_outliers;
+
+// The last 2 samples, and how many of them are valid.
+static XYZVector mouse_outlier_history[2];
+static uchar mouse_outlier_history_len;
+static uint16_t mouse_outlier_last_timestamp;
+// Whether the last sample was rejected, and what replaced it
+static uchar mouse_outlier_last_rejected;
+static XYZVector mouse_outlier_replacement;
+#endif
+
+#if ENABLE_ONE_EURO || ENABLE_PREDICTION
+// Mean interval between the samples, in Timer1 ticks, see
+// mouse_track_sample_interval().
+static uint16_t mouse_sample_interval;
+static uint16_t mouse_sample_last_timestamp;
+// Set by the first sample, as there is no interval before it.
+static uchar mouse_sample_started;
+
+#if ENABLE_FIXED_POINT && ENABLE_ONE_EURO
+// The smoothing factor is k / (1 + k), with k = 2 * pi * cutoff * interval,
+// see apply_smoothing(). These are the lowest and highest values of k for
+// the current interval, in Q12.
+static uint16_t mouse_one_euro_k_min;
+static uint16_t mouse_one_euro_k_max;
+#endif
+#if ENABLE_FIXED_POINT && ENABLE_PREDICTION
+// MOUSE_PREDICTION_TREND_TICKS_Q8 for the current interval
+static int16_t mouse_prediction_trend_q8;
+#endif
+#endif
+
+
+#if ENABLE_FIXED_POINT && (ENABLE_KALMAN || ENABLE_DIRECTION_FILTER)
+static uint16_t mouse_isqrt(uint32_t x) {  // {{{
+	// Integer square root, rounded down.
+	uint32_t root = 0;
+	uint32_t bit = 1UL << 30;
+
+	while (bit > x) {
+		bit >>= 2;
+	}
+	while (bit) {
+		if (x >= root + bit) {
+			x -= root + bit;
+			root = (root >> 1) + bit;
+		} else {
+			root >>= 1;
+		}
+		bit >>= 2;
+	}
+	return root;
+}  // }}}
+#endif
+
+
+#if ENABLE_KALMAN
+// Steady-state Kalman gains for the position and the velocity, see
+// mouse_kalman_init(). Q12 in fixed point (4096 means 1.0).
+#if ENABLE_FIXED_POINT
+static uint16_t mouse_kalman_alpha;
+static uint16_t mouse_kalman_beta;
+#else
+static float mouse_kalman_alpha;
+static float mouse_kalman_beta;
+#endif
+
+static void mouse_kalman_init() {  // {{{
+	// Calculates the steady-state gains of the constant-velocity Kalman
+	// filter, from the standard deviations of the measurement noise and of
+	// the acceleration (the process noise), using the sample interval as
+	// the time unit. The ratio between them is the tracking index lambda,
+	// and then (Kalata, 1984):
+	//   r = (4 + lambda - sqrt(8 * lambda + lambda**2)) / 4
+	//   alpha = 1 - r**2
+	//   beta = 2 * (1 - r)**2
+
+#if ENABLE_FIXED_POINT
+	uint32_t lambda;
+	uint16_t r;
+
+	// Q12, up to 8.0 (alpha is already 0.97 there)
+	lambda = ((uint32_t) MOUSE_KALMAN_PROCESS_NOISE << 12) / MOUSE_KALMAN_MEASUREMENT_NOISE;
+	if (lambda > 8UL << 12) {
+		lambda = 8UL << 12;
+	}
+	r = ((4UL << 12) + lambda - mouse_isqrt((8 * lambda + ((lambda * lambda) >> 12)) << 12)) / 4;
+
+	mouse_kalman_alpha = (1UL << 12) - (((uint32_t) r * r) >> 12);
+	mouse_kalman_beta = (2 * (uint32_t) ((1 << 12) - r) * ((1 << 12) - r)) >> 12;
+#else
+	float lambda, r;
+
+	lambda = (float) MOUSE_KALMAN_PROCESS_NOISE / MOUSE_KALMAN_MEASUREMENT_NOISE;
+	if (lambda > 8.0) {
+		lambda = 8.0;
+	}
+	r = (4 + lambda - sqrt(8 * lambda + lambda * lambda)) / 4;
+
+	mouse_kalman_alpha = 1 - r * r;
+	mouse_kalman_beta = 2 * (1 - r) * (1 - r);
+#endif
+}  // }}}
+
+int apply_smoothing(uchar index, coord_t *value_ptr) {  // {{{
+	// Steady-state constant-velocity Kalman filter (alpha-beta filter)
+	// http://en.wikipedia.org/wiki/Alpha_beta_filter
+
+#define POSITION (mouse_smooth[index].position)
+#define VELOCITY (mouse_smooth[index].velocity)
+
+#if ENABLE_FIXED_POINT
+	int32_t residual;
+
+	if (!mouse_smooth[index].started) {
+		mouse_smooth[index].started = 1;
+		POSITION = *value_ptr * 256;
+	}
+
+	// Prediction, and the difference from the measurement
+	POSITION += VELOCITY;
+	residual = *value_ptr * 256 - POSITION;
+
+	// Correction, as 16x16-bit multiplications: the residual is rounded to
+	// Q14, and limited to 2 screens (more than that is a jump anyway). Q14
+	// times Q12 is Q26, shifted back to Q23.
+	residual = (residual + (1 << 8)) >> 9;
+	if      (residual < -32767) residual = -32767;
+	else if (residual >  32767) residual =  32767;
+	POSITION += ((int32_t) (int16_t) residual * mouse_kalman_alpha) >> 3;
+	VELOCITY += ((int32_t) (int16_t) residual * mouse_kalman_beta) >> 3;
+
+	// round(POSITION * 32767), with POSITION being Q23:
+	// POSITION * 32767 == POSITION * 32768 - POSITION
+	residual = POSITION;
+	if      (residual < 0)              residual = 0;
+	else if (residual > COORD_ONE << 8) residual = COORD_ONE << 8;
+	return (residual - (residual >> 15) + (1 << 7)) >> 8;
+#else
+	float residual;
+
+	if (!mouse_smooth[index].started) {
+		mouse_smooth[index].started = 1;
+		POSITION = *value_ptr;
+	}
+
+	POSITION += VELOCITY;
+	residual = *value_ptr - POSITION;
+
+	// Same limit as the fixed point code
+	if      (residual < -2.0) residual = -2.0;
+	else if (residual >  2.0) residual =  2.0;
+	POSITION += residual * mouse_kalman_alpha;
+	VELOCITY += residual * mouse_kalman_beta;
+
+	if      (POSITION < 0.0)  return 0;
+	else if (POSITION > 1.0)  return 32767;
+
+	return (int) round(POSITION * 32767);
+#endif
+
+#undef POSITION
+#undef VELOCITY
+}  // }}}
+
+int mouse_get_velocity(uchar index) {  // {{{
+	// Velocity estimated by the Kalman filter, for the X (index 0) or Y
+	// (index 1) axis, in units of the 0..32767 range per sample.
+#if ENABLE_FIXED_POINT
+	int32_t v = mouse_smooth[index].velocity;
+	return (v - (v >> 15) + (1 << 7)) >> 8;
+#else
+	return (int) round(mouse_smooth[index].velocity * 32767);
+#endif
+}  // }}}
+#elif ENABLE_ONE_EURO
+// Exponential smoothing factor for a cutoff frequency: 1 / (1 + tau / Te),
+// with tau = 1 / (2 * pi * cutoff) and Te = the sample interval in seconds.
+#define ONE_EURO_ALPHA(interval, cutoff) (1.0 / (1.0 + 1.0 / (2 * 3.14159265 * (cutoff) * (interval))))
+
+#if ENABLE_FIXED_POINT
+// With k = 2 * pi * cutoff * Te, the factor is k / (1 + k). In Q12, k is
+// the sum of these terms:
+//   ONE_EURO_K_MIN_Q24 * interval (in ticks) >> 12
+//   ONE_EURO_K_BETA_Q8 * speed (Q15 per sample) >> 8
+// The speed term doesn't depend on the interval, as the speed is measured
+// per sample. ONE_EURO_K_MAX_Q24 is ONE_EURO_K_MIN_Q24 for the highest
+// cutoff, at MOUSE_ONE_EURO_MAX_SPEED.
+#define ONE_EURO_K_MIN_Q24 \
+	((uint32_t) (2 * 3.14159265 * MOUSE_ONE_EURO_MIN_CUTOFF / MOUSE_TIMER1_HZ * (1L << 24) + 0.5))
+#define ONE_EURO_K_MAX_Q24 \
+	((uint32_t) (2 * 3.14159265 * (MOUSE_ONE_EURO_MIN_CUTOFF + MOUSE_ONE_EURO_BETA * MOUSE_ONE_EURO_MAX_SPEED) \
+		/ MOUSE_TIMER1_HZ * (1L << 24) + 0.5))
+#define ONE_EURO_K_BETA_Q8 \
+	((uint32_t) (2 * 3.14159265 * MOUSE_ONE_EURO_BETA * (1 << 12) / COORD_ONE * 256 + 0.5))
+
+// k / (1 + k) in Q8, for k in steps of 1/16 (k in Q12 >> 8), so that
+// apply_smoothing() doesn't divide. Between the steps, it is interpolated,
+// within about one Q8 unit of the exact value. The last step is above the
+// highest k, 4.78, at MOUSE_SAMPLE_MAX_INTERVAL_TICKS and
+// MOUSE_ONE_EURO_MAX_SPEED.
+#define ONE_EURO_K_STEPS 78
+#define ONE_EURO_ENTRY(i) ((uchar) (256.0 * (i) / ((i) + 16) + 0.5))
+static const uchar mouse_one_euro_alpha[ONE_EURO_K_STEPS] PROGMEM = {
+	ONE_EURO_ENTRY( 0), ONE_EURO_ENTRY( 1), ONE_EURO_ENTRY( 2), ONE_EURO_ENTRY( 3),
+	ONE_EURO_ENTRY( 4), ONE_EURO_ENTRY( 5), ONE_EURO_ENTRY( 6), ONE_EURO_ENTRY( 7),
+	ONE_EURO_ENTRY( 8), ONE_EURO_ENTRY( 9), ONE_EURO_ENTRY(10), ONE_EURO_ENTRY(11),
+	ONE_EURO_ENTRY(12), ONE_EURO_ENTRY(13), ONE_EURO_ENTRY(14), ONE_EURO_ENTRY(15),
+	ONE_EURO_ENTRY(16), ONE_EURO_ENTRY(17), ONE_EURO_ENTRY(18), ONE_EURO_ENTRY(19),
+	ONE_EURO_ENTRY(20), ONE_EURO_ENTRY(21), ONE_EURO_ENTRY(22), ONE_EURO_ENTRY(23),
+	ONE_EURO_ENTRY(24), ONE_EURO_ENTRY(25), ONE_EURO_ENTRY(26), ONE_EURO_ENTRY(27),
+	ONE_EURO_ENTRY(28), ONE_EURO_ENTRY(29), ONE_EURO_ENTRY(30), ONE_EURO_ENTRY(31),
+	ONE_EURO_ENTRY(32), ONE_EURO_ENTRY(33), ONE_EURO_ENTRY(34), ONE_EURO_ENTRY(35),
+	ONE_EURO_ENTRY(36), ONE_EURO_ENTRY(37), ONE_EURO_ENTRY(38), ONE_EURO_ENTRY(39),
+	ONE_EURO_ENTRY(40), ONE_EURO_ENTRY(41), ONE_EURO_ENTRY(42), ONE_EURO_ENTRY(43),
+	ONE_EURO_ENTRY(44), ONE_EURO_ENTRY(45), ONE_EURO_ENTRY(46), ONE_EURO_ENTRY(47),
+	ONE_EURO_ENTRY(48), ONE_EURO_ENTRY(49), ONE_EURO_ENTRY(50), ONE_EURO_ENTRY(51),
+	ONE_EURO_ENTRY(52), ONE_EURO_ENTRY(53), ONE_EURO_ENTRY(54), ONE_EURO_ENTRY(55),
+	ONE_EURO_ENTRY(56), ONE_EURO_ENTRY(57), ONE_EURO_ENTRY(58), ONE_EURO_ENTRY(59),
+	ONE_EURO_ENTRY(60), ONE_EURO_ENTRY(61), ONE_EURO_ENTRY(62), ONE_EURO_ENTRY(63),
+	ONE_EURO_ENTRY(64), ONE_EURO_ENTRY(65), ONE_EURO_ENTRY(66), ONE_EURO_ENTRY(67),
+	ONE_EURO_ENTRY(68), ONE_EURO_ENTRY(69), ONE_EURO_ENTRY(70), ONE_EURO_ENTRY(71),
+	ONE_EURO_ENTRY(72), ONE_EURO_ENTRY(73), ONE_EURO_ENTRY(74), ONE_EURO_ENTRY(75),
+	ONE_EURO_ENTRY(76), ONE_EURO_ENTRY(77)
+};
+#undef ONE_EURO_ENTRY
+#endif
+
+int apply_smoothing(uchar index, coord_t *value_ptr) {  // {{{
+	// One Euro filter
+	// http://cristal.univ-lille.fr/~casiez/1euro/
+
+#define VALUE (mouse_smooth[index].value)
+#define SPEED (mouse_smooth[index].speed)
+
+#if ENABLE_FIXED_POINT
+	int32_t delta;
+	uint32_t k;
+	uchar alpha;
+
+	// The speed is estimated from the previous output, as in the paper.
+	delta = *value_ptr * 256 - VALUE;
+	SPEED += (delta - SPEED) >> MOUSE_ONE_EURO_SPEED_SHIFT;
+
+	// Q23 speed, rounded to Q15
+	k = ((uint32_t) (SPEED < 0 ? -SPEED : SPEED) + (1 << 7)) >> 8;
+	k = (k * ONE_EURO_K_BETA_Q8 + (1 << 7)) >> 8;
+	k += mouse_one_euro_k_min;
+	if (k > mouse_one_euro_k_max) {
+		k = mouse_one_euro_k_max;
+	}
+	// k / (1 + k) in Q8, interpolated between the table steps
+	alpha = pgm_read_byte_near(&mouse_one_euro_alpha[k >> 8]);
+	alpha += ((pgm_read_byte_near(&mouse_one_euro_alpha[(k >> 8) + 1]) - alpha) * (uchar) k + (1 << 7)) >> 8;
+
+	// VALUE += delta * alpha, as a 16x8-bit multiplication: delta is rounded
+	// to Q14, which fits the whole valid range (see mouse_project()) into 16
+	// bits, and the Q22 product is doubled back to Q23.
+	delta = (delta + (1 << 8)) >> 9;
+	VALUE += ((int32_t) (int16_t) delta * alpha) << 1;
+
+	// round(VALUE * 32767), with VALUE being Q23:
+	// VALUE * 32767 == VALUE * 32768 - VALUE
+	delta = VALUE;
+	if      (delta < 0)              delta = 0;
+	else if (delta > COORD_ONE << 8) delta = COORD_ONE << 8;
+	return (delta - (delta >> 15) + (1 << 7)) >> 8;
+#else
+	float interval, speed, alpha;
+
+	SPEED += (*value_ptr - VALUE - SPEED) * (1.0 / (1 << MOUSE_ONE_EURO_SPEED_SHIFT));
+
+	interval = mouse_sample_interval * (1.0 / MOUSE_TIMER1_HZ);
+	speed = fabs(SPEED) / interval;
+	if (speed > MOUSE_ONE_EURO_MAX_SPEED) {
+		speed = MOUSE_ONE_EURO_MAX_SPEED;
+	}
+	alpha = ONE_EURO_ALPHA(interval, MOUSE_ONE_EURO_MIN_CUTOFF + MOUSE_ONE_EURO_BETA * speed);
 
-int apply_smoothing(uchar index, float *value_ptr) {
+	VALUE += (*value_ptr - VALUE) * alpha;
+
+	if      (VALUE < 0.0)  return 0;
+	else if (VALUE > 1.0)  return 32767;
+
+	return (int) round(VALUE * 32767);
+#endif
+
+#undef VALUE
+#undef SPEED
+}  // }}}
+#else
+int apply_smoothing(uchar index, coord_t *value_ptr) {  // {{{
 	// Brown's double exponential smoothing
 	// http://en.wikipedia.org/wiki/Exponential_smoothing
+	//
+	// With ENABLE_PREDICTION, the result is the forecast MOUSE_PREDICTION_LATENCY_MS
+	// ahead, that is horizon = MOUSE_PREDICTION_LATENCY_TICKS / interval samples:
+	//   level = 2 * FIRST - SECOND
+	//   trend = alpha / (1 - alpha) * (FIRST - SECOND)
+	//   forecast = level + horizon * trend
+	// When the movement stops, the forecast overshoots the sample. Thus, it
+	// is limited to the range between SECOND and the sample, extended by the
+	// trend term in the direction of the movement.
 
 #define FIRST  (mouse_smooth[index].first)
 #define SECOND (mouse_smooth[index].second)
 
-	// This value was choosen empirically.
-#define ALPHA  0.125
+#if ENABLE_FIXED_POINT
+	// ALPHA == 2**-ALPHA_SHIFT
+	// The multiplication by ALPHA becomes a right shift.
+#define ALPHA_SHIFT MOUSE_SMOOTHING_SHIFT
+#define GAMMA_SHIFT ALPHA_SHIFT
+
+	// FIRST = FIRST * (1 - ALPHA) + value * ALPHA
+	FIRST  += (*value_ptr * 256 - FIRST) >> ALPHA_SHIFT;
+	SECOND += (FIRST - SECOND) >> GAMMA_SHIFT;
+
+#if ENABLE_PREDICTION
+	int32_t forecast, trend, low, high;
+
+	// The difference is rounded to Q15 before the multiplication, which
+	// gives back Q23.
+	trend = ((FIRST - SECOND + (1 << 7)) >> 8) * mouse_prediction_trend_q8;
+	forecast = 2 * FIRST - SECOND + trend;
+
+	low = *value_ptr * 256;
+	high = SECOND;
+	if (low > high) {
+		high = low;
+		low = SECOND;
+	}
+	if (trend < 0) low  += trend;
+	else           high += trend;
+
+	if      (forecast < low)  forecast = low;
+	else if (forecast > high) forecast = high;
+
+	if      (forecast < 0)              forecast = 0;
+	else if (forecast > COORD_ONE << 8) forecast = COORD_ONE << 8;
+
+	return (forecast - (forecast >> 15) + (1 << 7)) >> 8;
+#else
+	if      (SECOND < 0)              SECOND = 0;
+	else if (SECOND > COORD_ONE << 8) SECOND = COORD_ONE << 8;
+
+	// round(SECOND * 32767), with SECOND being Q23:
+	// SECOND * 32767 == SECOND * 32768 - SECOND
+	return (SECOND - (SECOND >> 15) + (1 << 7)) >> 8;
+#endif
+
+#undef ALPHA_SHIFT
+#undef GAMMA_SHIFT
+#else
+#define ALPHA  MOUSE_SMOOTHING_ALPHA
 #define GAMMA  ALPHA
 
 	FIRST  = FIRST  * (1 - ALPHA) + (*value_ptr) * ALPHA;
 	SECOND = SECOND * (1 - GAMMA) +   FIRST      * GAMMA;
 
+#if ENABLE_PREDICTION
+	float forecast, trend, low, high;
+
+	trend = (FIRST - SECOND) * (ALPHA / (1 - ALPHA) * MOUSE_PREDICTION_LATENCY_TICKS / mouse_sample_interval);
+	forecast = 2 * FIRST - SECOND + trend;
+
+	low = *value_ptr;
+	high = SECOND;
+	if (low > high) {
+		high = low;
+		low = SECOND;
+	}
+	if (trend < 0) low  += trend;
+	else           high += trend;
+
+	if      (forecast < low)  forecast = low;
+	else if (forecast > high) forecast = high;
+
+	if      (forecast < 0.0)  return 0;
+	else if (forecast > 1.0)  return 32767;
+
+	return (int) round(forecast * 32767);
+#else
 	if      (SECOND < 0.0)  SECOND = 0.0;
 	else if (SECOND > 1.0)  SECOND = 1.0;
 
 	return (int) round(SECOND * 32767);
+#endif
 
 #undef ALPHA
+#undef GAMMA
+#endif
+
 #undef FIRST
 #undef SECOND
-}
+}  // }}}
+#endif
+
+
+#if ENABLE_ONE_EURO || ENABLE_PREDICTION
+static void mouse_set_sample_interval(uint16_t interval) {  // {{{
+	mouse_sample_interval = interval;
+
+#if ENABLE_FIXED_POINT && ENABLE_ONE_EURO
+	mouse_one_euro_k_min = (interval * ONE_EURO_K_MIN_Q24 + (1 << 11)) >> 12;
+	mouse_one_euro_k_max = (interval * ONE_EURO_K_MAX_Q24 + (1 << 11)) >> 12;
+	// The table has one more step after it
+	if (mouse_one_euro_k_max >= (ONE_EURO_K_STEPS - 1) << 8) {
+		mouse_one_euro_k_max = ((ONE_EURO_K_STEPS - 1) << 8) - 1;
+	}
+#endif
+#if ENABLE_FIXED_POINT && ENABLE_PREDICTION
+	mouse_prediction_trend_q8 = (MOUSE_PREDICTION_TREND_TICKS_Q8 + interval / 2) / interval;
+#endif
+}  // }}}
+
+static void mouse_track_sample_interval(uint16_t timestamp) {  // {{{
+	// Called with the timestamp of each sample, before it is converted.
+	// The rate of the samples depends on the acquisition profile, and on
+	// ENABLE_SENSOR_DRDY, so it is measured here for the filters that depend
+	// on it. Repeated timestamps (the replay tools don't have them) and long
+	// gaps are ignored.
+	uint16_t interval = timestamp - mouse_sample_last_timestamp;
+
+	mouse_sample_last_timestamp = timestamp;
+	if (!mouse_sample_started) {
+		mouse_sample_started = 1;
+		return;
+	}
+	if (interval == 0 || interval > MOUSE_SAMPLE_MAX_INTERVAL_TICKS) {
+		return;
+	}
+
+	mouse_set_sample_interval(mouse_sample_interval
+		+ ((int16_t) (interval - mouse_sample_interval) >> MOUSE_SAMPLE_INTERVAL_SHIFT));
+}  // }}}
+#endif
 
 
 void init_mouse_emulation() {  // {{{
@@ -57,6 +716,13 @@ void init_mouse_emulation() {  // {{{
 	mouse_report.x = -1;
 	mouse_report.y = -1;
 	//mouse_report.buttons = 0;
+
+#if ENABLE_KALMAN
+	mouse_kalman_init();
+#endif
+#if ENABLE_ONE_EURO || ENABLE_PREDICTION
+	mouse_set_sample_interval(MOUSE_TIMER1_HZ / MOUSE_SAMPLE_RATE + 0.5);
+#endif
 }  // }}}
 
 
@@ -75,25 +741,184 @@ static uchar mouse_update_buttons() {  // {{{
 }  // }}}
 
 
-static uchar mouse_axes_no_conversion() {  // {{{
+static uchar mouse_axes_no_conversion(const XYZVector *p) {  // {{{
 	// Get X, Y, Z data from the sensor, discard the Z component and
 	// directly use X, Y as the mouse position.
 	// Only useful for debugging.
 
-	SensorData *sens = &sensor;
-	FIX_POINTER(sens);
-
-	mouse_report.x = sens->data.x * 8 + 16384;
-	mouse_report.y = sens->data.y * 8 + 16384;
+	mouse_report.x = p->x * 8 + 16384;
+	mouse_report.y = p->y * 8 + 16384;
 
 	return 1;
 }  // }}}
 
 
-static void fill_matrix_from_sensor(float m[3][4]) {  // {{{
+// Cached projection basis  {{{
+
+// The three rows of the projection matrix, derived from the calibration
+// corners. See mouse_update_projection_basis() for the math.
+#define BASIS_U 0
+#define BASIS_V 1
+#define BASIS_W 2
+
+#if ENABLE_FIXED_POINT
+// Integer math is enough for calculating the basis, as the corners are
+// integers. The final values are scaled down to 16 bits.
+typedef int32_t basis_calc_t;
+static int16_t basis[3][3];
+#else
+typedef float basis_calc_t;
+static float basis[3][3];
+#endif
+
+
+static void cross_product(basis_calc_t out[3], const basis_calc_t a[3], const basis_calc_t b[3]) {  // {{{
+	out[0] = a[1] * b[2] - a[2] * b[1];
+	out[1] = a[2] * b[0] - a[0] * b[2];
+	out[2] = a[0] * b[1] - a[1] * b[0];
+}  // }}}
+
+#if ENABLE_FIXED_POINT
+static void scale_to_fit(int32_t *values, uchar count, int32_t limit) {  // {{{
+	// Shifts all values right by the same amount, until all of them fit
+	// between -limit and +limit.
+	int32_t max = 0;
+	uchar i, shift = 0;
+
+	for (i = 0; i < count; i++) {
+		int32_t tmp = values[i];
+		if (tmp < 0) tmp = -tmp;
+		if (tmp > max) max = tmp;
+	}
+	while (max > limit) {
+		max >>= 1;
+		shift++;
+	}
+	for (i = 0; i < count; i++) {
+		values[i] >>= shift;
+	}
+}  // }}}
+#else
+// Floating point has enough range for everything.
+#define scale_to_fit(values, count, limit) do{ }while(0)
+#endif
+
+static void store_projection_basis(basis_calc_t rows[3][3]) {  // {{{
+	uchar i, j;
+
+	// In fixed point, each element of the rows can have up to 31 bits.
+	// They are scaled down to fit into 16 bits, so that the dot products
+	// at runtime fit into 32 bits.
+	//
+	// Scaling all rows by the same factor doesn't change the solution, as
+	// both "u" and "v" are ratios between dot products.
+	scale_to_fit(&rows[0][0], 9, 0x7FFF);
+
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < 3; j++) {
+			basis[i][j] = rows[i][j];
+		}
+	}
+}  // }}}
+
+#if ENABLE_HOMOGRAPHY
+static basis_calc_t dot_product(const basis_calc_t a[3], const basis_calc_t b[3]) {  // {{{
+	return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}  // }}}
+
+static void mouse_update_projection_basis() {  // {{{
+	// Must be called whenever the calibration corners change.
+	//
+	// Projective mapping (homography) using all four corners:
+	//   A = topleft      -> (0,0)
+	//   B = topright     -> (1,0)
+	//   C = bottomleft   -> (0,1)
+	//   D = bottomright  -> (1,1)
+	//
+	// The sensor vectors are treated as rays (homogeneous coordinates), and
+	// we look for the 3x3 matrix H such that H*P = w*(u,v,1) for the
+	// current point P. Again, u = P.H[0] / P.H[2] and v = P.H[1] / P.H[2].
+	//
+	// Let R be the matrix with columns (a*A, b*B, c*C), where
+	// a*A + b*B + c*C = D. By Cramer's rule, multiplying everything by
+	// det(A,B,C):
+	//   a = D.(B x C)
+	//   b = D.(C x A)
+	//   c = D.(A x B)
+	// R maps (1,0,0), (0,1,0), (0,0,1), (1,1,1) to the four corners, and
+	// its inverse has these rows (also multiplied by a*b*c):
+	//   r0 = b*c*(B x C)
+	//   r1 = a*c*(C x A)
+	//   r2 = a*b*(A x B)
+	// Another matrix S maps (1,0,0), (0,1,0), (0,0,1), (1,1,1) to the
+	// screen corners, and has rows (0,1,0), (0,0,1), (-1,1,1). Thus:
+	//   H = S * inverse(R) = (r1, r2, r1 + r2 - r0)
+	//
+	// No division is needed, as any scaling factor cancels out in the
+	// final ratios. In fixed point, the intermediate values are scaled
+	// down before each multiplication in order to fit into 32 bits.
+	//
+	// If D = B + C - A (a perfect parallelogram), this gives the same
+	// result as the three-corner version.
+
 	SensorData *sens = &sensor;
 	FIX_POINTER(sens);
 
+	basis_calc_t corners[4][3];
+	basis_calc_t crosses[3][3];
+	basis_calc_t k[3], products[3];
+	basis_calc_t rows[3][3];
+	uchar i, j;
+
+	for (i = 0; i < 4; i++) {
+		corners[i][0] = sens->e.corners[i].x;
+		corners[i][1] = sens->e.corners[i].y;
+		corners[i][2] = sens->e.corners[i].z;
+	}
+
+	#define A corners[0]
+	#define B corners[1]
+	#define C corners[2]
+	#define D corners[3]
+	cross_product(crosses[0], B, C);
+	cross_product(crosses[1], C, A);
+	cross_product(crosses[2], A, B);
+	scale_to_fit(&crosses[0][0], 9, 0x7FFF);
+
+	for (i = 0; i < 3; i++) {
+		k[i] = dot_product(D, crosses[i]);
+	}
+	#undef A
+	#undef B
+	#undef C
+	#undef D
+	scale_to_fit(k, 3, 0x7FFF);
+
+	products[0] = k[1] * k[2];
+	products[1] = k[0] * k[2];
+	products[2] = k[0] * k[1];
+	scale_to_fit(products, 3, 0x7FFF);
+
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < 3; j++) {
+			crosses[i][j] *= products[i];
+		}
+	}
+	// Making room for the sum of three values.
+	scale_to_fit(&crosses[0][0], 9, 0x1FFFFFFF);
+
+	for (j = 0; j < 3; j++) {
+		rows[BASIS_U][j] = crosses[1][j];
+		rows[BASIS_V][j] = crosses[2][j];
+		rows[BASIS_W][j] = crosses[1][j] + crosses[2][j] - crosses[0][j];
+	}
+
+	store_projection_basis(rows);
+}  // }}}
+#else
+static void mouse_update_projection_basis() {  // {{{
+	// Must be called whenever the calibration corners change.
+	//
 	// The linear system:
 	// -t*P + u*(B-A) + v*(C-A) = -A
 	// Where:
@@ -109,121 +934,283 @@ static void fill_matrix_from_sensor(float m[3][4]) {  // {{{
 	// "u" times in the topleft/topright direction, plus "v" times in the
 	// topleft/bottomleft direction. "u" and "v" are between 0.0 and 1.0.
 	//
+	// Only P changes between samples, so this system used to be solved by
+	// Gauss-Jordan elimination for every single sample. Instead, let:
+	//   E1 = B-A
+	//   E2 = C-A
+	// By Cramer's rule, the solution is:
+	//   u = P.(E2 x A)  / P.(E1 x E2)
+	//   v = P.(A  x E1) / P.(E1 x E2)
+	// The three cross products depend only on the corners, and are
+	// calculated here. At runtime, we only need three dot products and one
+	// division.
+	//
 	// It would have been better to normalize each vector before doing any
 	// math on them, in order to reduce deformations. However, I know
 	// (empirically) that all values from the sensor have about the same
 	// magnitude, and thus I don't need to normalize them.
 
-	// First column: - current_point
-	m[0][0] = -sens->data.x;
-	m[1][0] = -sens->data.y;
-	m[2][0] = -sens->data.z;
-
-	// Note: the values below are constant, and could have been
-	// pre-converted to float only once (either at boot, or after updating
-	// those values). It would save some cycles during this runtime.
-
-	// Second column: topright - topleft
-	m[0][1] = sens->e.corners[1].x - sens->e.corners[0].x;
-	m[1][1] = sens->e.corners[1].y - sens->e.corners[0].y;
-	m[2][1] = sens->e.corners[1].z - sens->e.corners[0].z;
-
-	// Third column: bottomleft - topleft
-	m[0][2] = sens->e.corners[2].x - sens->e.corners[0].x;
-	m[1][2] = sens->e.corners[2].y - sens->e.corners[0].y;
-	m[2][2] = sens->e.corners[2].z - sens->e.corners[0].z;
-
-	// Fourth column: - topleft
-	m[0][3] = -sens->e.corners[0].x;
-	m[1][3] = -sens->e.corners[0].y;
-	m[2][3] = -sens->e.corners[0].z;
+	SensorData *sens = &sensor;
+	FIX_POINTER(sens);
+
+	basis_calc_t a[3], e1[3], e2[3];
+	basis_calc_t rows[3][3];
+
+	a[0] = sens->e.corners[0].x;
+	a[1] = sens->e.corners[0].y;
+	a[2] = sens->e.corners[0].z;
+
+	// topright - topleft
+	e1[0] = sens->e.corners[1].x - sens->e.corners[0].x;
+	e1[1] = sens->e.corners[1].y - sens->e.corners[0].y;
+	e1[2] = sens->e.corners[1].z - sens->e.corners[0].z;
+
+	// bottomleft - topleft
+	e2[0] = sens->e.corners[2].x - sens->e.corners[0].x;
+	e2[1] = sens->e.corners[2].y - sens->e.corners[0].y;
+	e2[2] = sens->e.corners[2].z - sens->e.corners[0].z;
+
+	cross_product(rows[BASIS_U], e2, a);
+	cross_product(rows[BASIS_V], a, e1);
+	cross_product(rows[BASIS_W], e1, e2);
+
+	store_projection_basis(rows);
 }  // }}}
 
-static void swap_rows(float a[4], float b[4]) {  // {{{
-	float tmp;
-	uchar i;
+#endif
+
+// }}}
 
-	for (i=0; i<4; i++) {
-		tmp = a[i];
-		a[i] = b[i];
-		b[i] = tmp;
+static uchar mouse_project(const XYZVector *sample, coord_t *u_ptr, coord_t *v_ptr) {  // {{{
+	// Converts a sensor sample into (u,v) screen coordinates.
+	// Returns 0 if the point can't be converted or is out-of-bounds.
+
+#if ENABLE_FIXED_POINT
+	int32_t u, v, w;
+
+	// Sensor values are within +-9675 with automatic gain ranging (14 bits
+	// and sign), and the basis has 16 bits (15 and sign). Thus each product
+	// is below 2**29, and the sum of three fits into 31 bits and sign.
+	#define DOT(row) ( \
+		  (int32_t) sample->x * basis[row][0] \
+		+ (int32_t) sample->y * basis[row][1] \
+		+ (int32_t) sample->z * basis[row][2])
+
+	w = DOT(BASIS_W);
+	u = DOT(BASIS_U);
+	v = DOT(BASIS_V);
+	#undef DOT
+
+	if (w == 0) {
+		// Singular
+		return 0;
+	}
+	if (w < 0) {
+		u = -u;
+		v = -v;
+		w = -w;
+	}
+
+	// Checking the bounds before dividing, as this also guarantees the
+	// division below will not overflow.
+	if (   u < -(w >> 2)
+		|| u >  w + (w >> 2)
+		|| v < -(w >> 2)
+		|| v >  w + (w >> 2)
+	) {
+		// Out-of-bounds
+		return 0;
 	}
+
+	// Reducing the precision to 15 bits, so that (u * COORD_ONE) still
+	// fits into 32 bits.
+	while (w > 0x7FFF) {
+		u >>= 1;
+		v >>= 1;
+		w >>= 1;
+	}
+
+	// Rounding to the nearest value.
+	*u_ptr = (u * COORD_ONE + (w >> 1)) / w;
+	*v_ptr = (v * COORD_ONE + (w >> 1)) / w;
+#else
+	float p[3];
+	float u, v, w;
+
+	p[0] = sample->x;
+	p[1] = sample->y;
+	p[2] = sample->z;
+
+	#define DOT(row) (p[0] * basis[row][0] + p[1] * basis[row][1] + p[2] * basis[row][2])
+	w = DOT(BASIS_W);
+
+	// The corners and the current point are integers, and so are the
+	// elements of the basis. Thus, anything below 1.0 is actually zero.
+	if (fabs(w) < 1.0) {
+		// Singular
+		return 0;
+	}
+
+	w = 1.0 / w;
+	u = DOT(BASIS_U) * w;
+	v = DOT(BASIS_V) * w;
+	#undef DOT
+
+	if (   u < -0.25
+		|| u >  1.25
+		|| v < -0.25
+		|| v >  1.25
+	) {
+		// Out-of-bounds
+		return 0;
+	}
+
+	*u_ptr = u;
+	*v_ptr = v;
+#endif
+
+	return 1;
 }  // }}}
 
-static uchar mouse_axes_linear_equation_system() {  // {{{
-#define W 4
-#define H 3
-	// Matrix of 3 lines and 4 columns
-	float m[H][W];
-	// The solution of this system
-	float sol[H];
+#if ENABLE_DIRECTION_FILTER
+static uchar mouse_filter_direction(const XYZVector *sample, XYZVector *out) {  // {{{
+	// Normalizes the sample to a unit vector (MOUSE_DIRECTION_ONE long), and
+	// smooths it. The result is not normalized again: only its direction
+	// matters to mouse_project().
+	// Returns 0 if the sample has no direction (all zeros).
+	DirectionVars *d = &mouse_direction;
+	uchar i;
 
-	uchar y;
+#if ENABLE_FIXED_POINT
+	int32_t p[3];
+	uint32_t squared;
+	uint32_t inverse;
 
-	int final_x, final_y;
+	p[0] = sample->x;
+	p[1] = sample->y;
+	p[2] = sample->z;
 
-	fill_matrix_from_sensor(m);
-
-	// Gauss-Jordan elimination, based on:
-	// http://elonen.iki.fi/code/misc-notes/python-gaussj/index.html
-
-	for(y = 0; y < H; y++) {
-		uchar maxrow;
-		uchar y2;
-		float pivot;
-
-		// Finding the row with the maximum value at this column
-		maxrow = y;
-		pivot = fabs(m[maxrow][y]);
-		for(y2 = y+1; y2 < H; y2++) {
-			float newpivot;
-			newpivot = fabs(m[y2][y]);
-			if (newpivot > pivot) {
-				pivot = newpivot;
-				maxrow = y2;
-			}
-		}
-		// If the maximum value in this column is zero
-		if (pivot < 0.0009765625) {  // 2**-10 == 0.0009765625
-			// Singular
-			return 0;
-		}
-		if (maxrow != y) {
-			swap_rows(m[y], m[maxrow]);
+	// Sensor values are within +-9675, so squared is below 2**29, and its
+	// root fits into 15 bits.
+	squared = p[0] * p[0] + p[1] * p[1] + p[2] * p[2];
+	if (squared == 0) {
+		return 0;
+	}
+
+	// A single division, and then one multiplication per axis. As each
+	// axis is at most as long as the vector, p * inverse fits into 26 bits.
+	// Then, from 2**24 to MOUSE_DIRECTION_ONE with 8 extra fractional bits.
+	inverse = (1UL << 24) / mouse_isqrt(squared);
+	for (i = 0; i < 3; i++) {
+		p[i] = (p[i] * (int32_t) inverse + (1 << 3)) >> 4;
+	}
+
+	if (!d->started) {
+		d->started = 1;
+		for (i = 0; i < 3; i++) {
+			d->first[i] = p[i];
+			d->second[i] = p[i];
 		}
+	}
+
+	for (i = 0; i < 3; i++) {
+		d->first[i]  += (p[i] - d->first[i])  >> MOUSE_SMOOTHING_SHIFT;
+		d->second[i] += (d->first[i] - d->second[i]) >> MOUSE_SMOOTHING_SHIFT;
+	}
+
+	out->x = (d->second[0] + (1 << 7)) >> 8;
+	out->y = (d->second[1] + (1 << 7)) >> 8;
+	out->z = (d->second[2] + (1 << 7)) >> 8;
+#else
+	float p[3];
+	float length;
 
-		// Now we are ready to eliminate the column y, using m[y][y]
-		for(y2 = y+1; y2 < H; y2++) {
-			uchar x;
-			float c;
-			c = m[y2][y] / m[y][y];
+	p[0] = sample->x;
+	p[1] = sample->y;
+	p[2] = sample->z;
 
-			// Subtracting from every element in row y2
-			for(x = y; x < W; x++) {
-				m[y2][x] -= m[y][x] * c;
-			}
+	length = sqrt(p[0] * p[0] + p[1] * p[1] + p[2] * p[2]);
+	if (length == 0.0) {
+		return 0;
+	}
+
+	for (i = 0; i < 3; i++) {
+		p[i] *= MOUSE_DIRECTION_ONE / length;
+	}
+
+	if (!d->started) {
+		d->started = 1;
+		for (i = 0; i < 3; i++) {
+			d->first[i] = p[i];
+			d->second[i] = p[i];
 		}
 	}
 
-	// The matrix is now in "row echelon form" (it is a triangular matrix).
-	// Instead of using a loop for back-substituting all 3 elements from
-	// sol[], I'm calculating only 2 of them, as only those are needed.
+	for (i = 0; i < 3; i++) {
+		d->first[i]  = d->first[i]  * (1 - MOUSE_SMOOTHING_ALPHA) + p[i]          * MOUSE_SMOOTHING_ALPHA;
+		d->second[i] = d->second[i] * (1 - MOUSE_SMOOTHING_ALPHA) + d->first[i]   * MOUSE_SMOOTHING_ALPHA;
+	}
 
-	sol[2] = m[2][3] / m[2][2];
-	sol[1] = m[1][3] / m[1][1] - m[1][2] * sol[2] / m[1][1];
-	// sol[0] is discarded
+	out->x = (int) round(d->second[0]);
+	out->y = (int) round(d->second[1]);
+	out->z = (int) round(d->second[2]);
+#endif
 
-	if (   sol[1] < -0.25
-		|| sol[1] >  1.25
-		|| sol[2] < -0.25
-		|| sol[2] >  1.25
-	) {
-		// Out-of-bounds
+	return 1;
+}  // }}}
+
+static int mouse_coord_to_report(coord_t value) {  // {{{
+	// Same conversion as in apply_smoothing(), without the smoothing.
+#if ENABLE_FIXED_POINT
+	if      (value < 0)         value = 0;
+	else if (value > COORD_ONE) value = COORD_ONE;
+
+	// round(value * 32767), with value being Q15
+	return value - (value >> 15);
+#else
+	if      (value < 0.0)  return 0;
+	else if (value > 1.0)  return 32767;
+
+	return (int) round(value * 32767);
+#endif
+}  // }}}
+#endif
+
+static uchar mouse_axes_linear_equation_system(const XYZVector *sample) {  // {{{
+	coord_t u, v;
+
+	int final_x, final_y;
+
+	SensorData *sens = &sensor;
+	FIX_POINTER(sens);
+
+	if (sens->corners_changed) {
+		sens->corners_changed = 0;
+		mouse_update_projection_basis();
+	}
+
+#if ENABLE_DIRECTION_FILTER
+	XYZVector direction;
+
+	// Smoothing before the projection, thus also the samples that end up
+	// out-of-bounds.
+	if (!mouse_filter_direction(sample, &direction)) {
+		return 0;
+	}
+	sample = &direction;
+#endif
+
+	if (!mouse_project(sample, &u, &v)) {
 		return 0;
 	}
 
-	final_x = apply_smoothing(0, &sol[1]);
-	final_y = apply_smoothing(1, &sol[2]);
+#if ENABLE_DIRECTION_FILTER
+	final_x = mouse_coord_to_report(u);
+	final_y = mouse_coord_to_report(v);
+#else
+	final_x = apply_smoothing(0, &u);
+	final_y = apply_smoothing(1, &v);
+#endif
 
 	/*
 	if (   final_x < 0
@@ -240,50 +1227,144 @@ static uchar mouse_axes_linear_equation_system() {  // {{{
 	mouse_report.y = final_y;
 
 	return 1;
-#undef W
-#undef H
 }  // }}}
 
 
-static uchar mouse_update_axes() {  // {{{
-	// Update the report descriptor for the axes if new data is available from
-	// the sensor.
+#if ENABLE_OUTLIER_REJECTION
+static int mouse_median3(int a, int b, int c) {  // {{{
+	if (a > b) {
+		int t = a;
+		a = b;
+		b = t;
+	}
+	// Now a <= b
+	if (c <= a) return a;
+	if (c >= b) return b;
+	return c;
+}  // }}}
 
-	SensorData *sens = &sensor;
-	FIX_POINTER(sens);
+static uchar mouse_axis_is_outlier(int value, int prev1, int prev2) {  // {{{
+	int deviation = value - mouse_median3(value, prev1, prev2);
+	return deviation > MOUSE_OUTLIER_THRESHOLD || deviation < -MOUSE_OUTLIER_THRESHOLD;
+}  // }}}
 
-	if (sens->new_data_available && !sens->overflow) {
-		// Marking the data as "used"
-		sens->new_data_available = 0;
+static void mouse_reject_outlier(SensorSample *s) {  // {{{
+	// Replaces the sample in-place if it is an outlier.
+	//
+	// Running 3-tap median gate on each axis: the sample is compared with the
+	// median of itself and the previous 2 samples. A single spike is far from
+	// the median, and is rejected. A real jump is rejected only once, as the
+	// next sample agrees with it. Unlike replacing each sample by the median,
+	// this doesn't add one sample of lag to every movement.
+	//
+	// A rejected sample is replaced by the linear extrapolation of the
+	// previous 2, instead of being dropped. Dropping samples (or holding the
+	// previous one) disturbs the smoothing during fast movements, which are
+	// exactly when real samples may be rejected.
+	//
+	// Every sample (rejected or not) goes into the history. Except when the
+	// same measurement is read twice (when the data registers are read
+	// faster than the sensor rate): the duplicate gets the same result, and
+	// is not counted again. Otherwise, a duplicated spike would become the
+	// median.
+	XYZVector *h = mouse_outlier_history;
+	uchar outlier = 0;
+
+	if ((uint16_t) (s->timestamp - mouse_outlier_last_timestamp) > MOUSE_OUTLIER_MAX_GAP_TICKS) {
+		mouse_outlier_history_len = 0;
+	}
+	mouse_outlier_last_timestamp = s->timestamp;
+
+	if (mouse_outlier_history_len
+		&& s->v.x == h[0].x && s->v.y == h[0].y && s->v.z == h[0].z
+	) {
+		if (mouse_outlier_last_rejected) {
+			s->v = mouse_outlier_replacement;
+		}
+		return;
+	}
+
+	if (mouse_outlier_history_len == 2) {
+		mouse_outliers.checked++;
+		outlier = mouse_axis_is_outlier(s->v.x, h[0].x, h[1].x)
+			|| mouse_axis_is_outlier(s->v.y, h[0].y, h[1].y)
+			|| mouse_axis_is_outlier(s->v.z, h[0].z, h[1].z);
+	} else {
+		mouse_outlier_history_len++;
+	}
+
+	if (outlier) {
+		XYZVector *r = &mouse_outlier_replacement;
+
+		mouse_outliers.rejected++;
+		if (mouse_outlier_last_rejected) {
+			// h[0] was an outlier too, the median is safer.
+			r->x = mouse_median3(s->v.x, h[0].x, h[1].x);
+			r->y = mouse_median3(s->v.y, h[0].y, h[1].y);
+			r->z = mouse_median3(s->v.z, h[0].z, h[1].z);
+		} else {
+			r->x = 2 * h[0].x - h[1].x;
+			r->y = 2 * h[0].y - h[1].y;
+			r->z = 2 * h[0].z - h[1].z;
+		}
+	}
+
+	h[1] = h[0];
+	h[0] = s->v;
+	mouse_outlier_last_rejected = outlier;
+
+	if (outlier) {
+		s->v = mouse_outlier_replacement;
+	}
+}  // }}}
+#endif
+
+static uchar mouse_update_axes() {  // {{{
+	// Update the report descriptor for the axes if new data is available from
+	// the sensor. Every sample waiting in the ring goes through the
+	// conversion (and thus the smoothing), and the report gets the last one.
+
+	SensorRing *ring = &sensor.ring;
+	SensorSample *s;
+	uchar updated = 0;
+
+	while ((s = sensor_ring_peek(ring)) != 0) {
+#if ENABLE_ONE_EURO || ENABLE_PREDICTION
+		mouse_track_sample_interval(s->timestamp);
+#endif
+
+#if ENABLE_OUTLIER_REJECTION
+		// Overflows break the sequence of samples.
+		if (s->overflow) {
+			mouse_outlier_history_len = 0;
+		} else {
+			mouse_reject_outlier(s);
+		}
+#endif
 
 		// Trying to convert the coordinates
-		if (
-			//mouse_axes_no_conversion()
-			mouse_axes_linear_equation_system()
+		// But sometimes it will fail (out-of-bounds, or sensor overflow)
+		if (!s->overflow
+			//&& mouse_axes_no_conversion(&s->v)
+			&& mouse_axes_linear_equation_system(&s->v)
 		) {
-			return 1;
-		} else {
-			// But sometimes it will fail
-			return 0;
+			updated = 1;
 		}
-	} else {
-		// Clearing the x, y to invalid values.
-		// Invalid values should be ignored by USB host.
-		//mouse_report.x = -1;
-		//mouse_report.y = -1;
-
-		// Well... Actually, Linux 2.6.38 does not behave that way.
-		// Instead, Linux moves the mouse pointer even if the supplied X,Y
-		// values are outside the LOGICAL_MINIMUM..LOGICAL_MAXIMUM range.
-		//
-		// As a workaround:
-		// If no data is available, I just leave the previous data in there.
-		//
-		// Note: Windows correctly ignores the invalid values.
-		return 0;
+
+		// Marking the data as "used"
+		sensor_ring_pop(ring);
 	}
 
-	return 0;
+	// If no data is available, or none could be converted, the previous
+	// x, y are left in the report.
+	//
+	// Clearing the x, y to invalid values (which should be ignored by the
+	// USB host) would be better, but Linux 2.6.38 does not behave that way.
+	// Instead, Linux moves the mouse pointer even if the supplied X,Y
+	// values are outside the LOGICAL_MINIMUM..LOGICAL_MAXIMUM range.
+	//
+	// Note: Windows correctly ignores the invalid values.
+	return updated;
 }  // }}}
 
 
@@ -293,6 +1374,12 @@ uchar mouse_prepare_next_report() {  // {{{
 
 	if (button.recent_state_change) {
 		// Don't try to update the pointer coordinates after a click.
+		// The samples from this period are not used at all.
+		sensor_ring_flush(&sensor.ring);
+#if ENABLE_ONE_EURO || ENABLE_PREDICTION
+		// Nor their timestamps, thus the next interval is not measured.
+		mouse_sample_started = 0;
+#endif
 		return mouse_update_buttons();
 	} else {
 		// I'm using a bitwise OR here because a boolean OR would short-circuit
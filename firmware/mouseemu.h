@@ -19,10 +19,25 @@ typedef struct MouseReport {
 
 extern MouseReport mouse_report;
 
+#if ENABLE_OUTLIER_REJECTION
+typedef struct MouseOutlierCounters {
+	// Samples compared with the previous ones
+	unsigned int checked;
+	// Samples dropped as outliers
+	unsigned int rejected;
+} MouseOutlierCounters;
+
+extern MouseOutlierCounters mouse_outliers;
+#endif
+
 
 void init_mouse_emulation();
 uchar mouse_prepare_next_report();
 
+#if ENABLE_KALMAN
+int mouse_get_velocity(uchar index);
+#endif
+
 
 #endif  // __mouseemu_h_included____
 
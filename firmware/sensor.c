@@ -12,8 +12,16 @@
 
 
 #include <avr/eeprom.h>
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+#include <util/atomic.h>
 
 #include "avr315/TWI_Master.h"
+#include "int_eeprom.h"
 #include "sensor.h"
 
 
@@ -37,6 +45,12 @@ SensorEepromData X_EEMEM eeprom_sensor = {
 		{-44, 190, 160} // bottomright
 	}
 };
+uchar X_EEMEM eeprom_sensor_profile = SENSOR_PROFILE_LOW_NOISE;
+XYZVector X_EEMEM eeprom_sensor_correction[3] = {
+	{SENSOR_CORRECTION_ONE, 0, 0},
+	{0, SENSOR_CORRECTION_ONE, 0},
+	{0, 0, SENSOR_CORRECTION_ONE}
+};
 
 
 ////////////////////////////////////////////////////////////
@@ -120,6 +134,7 @@ SensorEepromData X_EEMEM eeprom_sensor = {
 #define SENSOR_CONF_B_GAIN_5_6  0xC0
 #define SENSOR_CONF_B_GAIN_8_1  0xE0
 #define SENSOR_CONF_B_GAIN_MASK 0xE0
+#define SENSOR_CONF_B_GAIN_SHIFT 5
 
 // Digital resolution (mG/LSb) for each gain
 #define SENSOR_GAIN_SCALE_0_88  0.73
@@ -136,17 +151,325 @@ SensorEepromData X_EEMEM eeprom_sensor = {
 // }}}
 
 
-static void sensor_set_address_pointer(uchar reg) {  // {{{
-	// Sets the sensor internal register pointer.
-	// This is required before reading registers.
-	//
-	// This function is non-blocking (except if TWI is already busy).
+////////////////////////////////////////////////////////////
+// Automatic gain ranging                                {{{
+
+// The calibration is done at the default gain, and all data is rescaled to
+// its units. On overflow, the gain goes one step up. When all axes would
+// fit comfortably at the previous gain, for a number of consecutive
+// samples, it goes one step back down (but never below the default gain).
+//
+// Only with ENABLE_AUTO_GAIN. Otherwise, the gain is always the default.
+
+#define SENSOR_GAIN_DEFAULT (SENSOR_CONF_B_GAIN_1_3 >> SENSOR_CONF_B_GAIN_SHIFT)
+
+#if ENABLE_AUTO_GAIN
+#define SENSOR_GAIN_MAX     (SENSOR_CONF_B_GAIN_8_1 >> SENSOR_CONF_B_GAIN_SHIFT)
+
+// Consecutive samples with headroom before stepping down
+#define SENSOR_GAIN_HEADROOM_SAMPLES 16
+
+// The datasheet says a new gain is only used from the second measurement
+// on, so samples read up to two 75Hz periods after a change may have been
+// measured with either gain. They are discarded (marked as overflow).
+// 2 * 13.33ms / 5.33us (Timer1 counts)
+#define SENSOR_GAIN_SETTLING_TICKS 5000
+
+// Multiplies the data into the default gain units. At the highest gain,
+// the rescaled values reach 2048 * 1210 / 256 = 9675 (14 bits and sign).
+#define SENSOR_GAIN_FACTOR(scale) \
+	((uint16_t) (256 * (scale) / SENSOR_GAIN_SCALE_1_3 + 0.5))
+static const uint16_t sensor_gain_factor[SENSOR_GAIN_MAX + 1] PROGMEM = {
+	SENSOR_GAIN_FACTOR(SENSOR_GAIN_SCALE_0_88),
+	SENSOR_GAIN_FACTOR(SENSOR_GAIN_SCALE_1_3),
+	SENSOR_GAIN_FACTOR(SENSOR_GAIN_SCALE_1_9),
+	SENSOR_GAIN_FACTOR(SENSOR_GAIN_SCALE_2_5),
+	SENSOR_GAIN_FACTOR(SENSOR_GAIN_SCALE_4_0),
+	SENSOR_GAIN_FACTOR(SENSOR_GAIN_SCALE_4_7),
+	SENSOR_GAIN_FACTOR(SENSOR_GAIN_SCALE_5_6),
+	SENSOR_GAIN_FACTOR(SENSOR_GAIN_SCALE_8_1)
+};
+#undef SENSOR_GAIN_FACTOR
+
+// Largest absolute value (at this gain) that stays below 1536 (3/4 of the
+// range) at the previous gain. Rounded down.
+#define SENSOR_GAIN_HEADROOM(previous, scale) \
+	((uint16_t) (1536 * (previous) / (scale)))
+static const uint16_t sensor_gain_headroom[SENSOR_GAIN_MAX + 1] PROGMEM = {
+	0,
+	SENSOR_GAIN_HEADROOM(SENSOR_GAIN_SCALE_0_88, SENSOR_GAIN_SCALE_1_3),
+	SENSOR_GAIN_HEADROOM(SENSOR_GAIN_SCALE_1_3,  SENSOR_GAIN_SCALE_1_9),
+	SENSOR_GAIN_HEADROOM(SENSOR_GAIN_SCALE_1_9,  SENSOR_GAIN_SCALE_2_5),
+	SENSOR_GAIN_HEADROOM(SENSOR_GAIN_SCALE_2_5,  SENSOR_GAIN_SCALE_4_0),
+	SENSOR_GAIN_HEADROOM(SENSOR_GAIN_SCALE_4_0,  SENSOR_GAIN_SCALE_4_7),
+	SENSOR_GAIN_HEADROOM(SENSOR_GAIN_SCALE_4_7,  SENSOR_GAIN_SCALE_5_6),
+	SENSOR_GAIN_HEADROOM(SENSOR_GAIN_SCALE_5_6,  SENSOR_GAIN_SCALE_8_1)
+};
+#undef SENSOR_GAIN_HEADROOM
+#endif
+
+// }}}
+
+
+////////////////////////////////////////////////////////////
+// Fault recovery                                        {{{
+
+#if ENABLE_TWI_RECOVERY
+// A failed read is queued again up to SENSOR_READ_RETRIES times, waiting
+// SENSOR_RETRY_BACKOFF_TICKS before the first retry, and twice as long
+// before each next one (1, 2 and 4ms, 7ms in total, about half of a 75Hz
+// period). Only then sensor_read_registers() returns SENSOR_FUNC_ERROR.
+#define SENSOR_READ_RETRIES 3
+// 1ms / 5.33us (Timer1 counts)
+#define SENSOR_RETRY_BACKOFF_TICKS 188
+#endif
+
+#if ENABLE_SENSOR_PROFILES
+// With ENABLE_SENSOR_DRDY, in single-shot mode, only the trigger starts a
+// new measurement, and only a measurement produces a DRDY pulse. If the
+// trigger is lost (TWI queue full, or dropped by a bus clear), it is queued
+// again after this long without a sample, 4 periods of 8.2ms.
+// 4 * 8.2ms / 5.33us (Timer1 counts)
+#define SENSOR_TRIGGER_TIMEOUT_TICKS 6150
+#endif
+
+// }}}
+
+
+////////////////////////////////////////////////////////////
+// Acquisition profiles                                  {{{
+
+typedef struct SensorProfile {
+	// Configuration Register A (the bias is always normal)
+	uchar conf_a;
+	// Mode Register
+	uchar mode;
+	// Value for SensorData.probe_period
+	uchar probe_period;
+} SensorProfile;
+
+static const SensorProfile sensor_profiles[SENSOR_TOTAL_PROFILES] PROGMEM = {
+	// SENSOR_PROFILE_LOW_NOISE
+	// 8 samples averaged, at 75Hz. Polled at twice that rate:
+	// 5 * 1.365ms = 6.827ms ~= 146Hz
+	{
+		SENSOR_CONF_A_SAMPLES_8 | SENSOR_CONF_A_RATE_75,
+		SENSOR_MODE_CONTINUOUS,
+		5
+	},
+#if ENABLE_SENSOR_PROFILES
+	// SENSOR_PROFILE_LOW_LATENCY
+	// No averaging, at 75Hz. Polled more often, so that each sample waits
+	// at most 3 * 1.365ms = 4.1ms before being read.
+	{
+		SENSOR_CONF_A_SAMPLES_1 | SENSOR_CONF_A_RATE_75,
+		SENSOR_MODE_CONTINUOUS,
+		3
+	},
+	// SENSOR_PROFILE_SINGLE_SHOT
+	// No averaging, and each measurement is started right after reading the
+	// previous one (see sensor_trigger_measurement()). The datasheet allows
+	// up to 160Hz this way, as each measurement takes about 6ms. Between 5
+	// and 6 overflows pass before the next read, so 6 * 1.365ms = 8.2ms
+	// (122Hz to 146Hz).
+	{
+		SENSOR_CONF_A_SAMPLES_1,
+		SENSOR_MODE_SINGLE,
+		6
+	}
+#endif
+};
+
+// }}}
+
+
+////////////////////////////////////////////////////////////
+// Self-test                                             {{{
+// See page 19 of HMC5883L.pdf
+
+#if ENABLE_SELF_TEST
+// The bias current produces about 1.16Ga on X and Y, and 1.08Ga on Z.
+// The self-test runs at gain 4.7Ga (390 LSb/Ga), where these are:
+#define SENSOR_SELF_TEST_GAIN       SENSOR_CONF_B_GAIN_4_7
+#define SENSOR_SELF_TEST_EXPECTED_XY 452
+#define SENSOR_SELF_TEST_EXPECTED_Z  421
+
+// Limits from the datasheet, for the same gain
+#define SENSOR_SELF_TEST_LOW_LIMIT  243
+#define SENSOR_SELF_TEST_HIGH_LIMIT 575
+
+// The self-test measures at 15Hz. Waiting 3 periods after each change
+// guarantees a complete measurement with the new configuration (the first
+// one after a gain change still uses the previous gain).
+// 3 * 66.7ms / 5.33us (Timer1 counts)
+#define SENSOR_SELF_TEST_WAIT_TICKS 37500
+#endif
+
+// }}}
+
+
+////////////////////////////////////////////////////////////
+// Ellipsoid calibration                                 {{{
+
+// Without interference, the readings lie on a sphere around the zero.
+// Hard-iron (offset) and soft-iron (scale and cross-axis) errors turn it
+// into an ellipsoid. The calibration fits the quadric
+//   a*x*x + b*y*y + c*z*z + 2*d*x*y + 2*e*x*z + 2*f*y*z
+//   + 2*g*x + 2*h*y + 2*i*z = 1
+// to all samples, by linear least squares. Only the normal equations are
+// accumulated, in packed lower-triangular form.
+//
+// Only with ENABLE_ELLIPSOID_FIT, as the float math and the 216 bytes of
+// sums don't fit into the ATmega8 with everything else. Otherwise, the zero
+// is the min/max midpoint of each axis, as if the fit had failed.
+#if ENABLE_ELLIPSOID_FIT
+#define SENSOR_FIT_PARAMS 9
+#define SENSOR_FIT_PACKED (SENSOR_FIT_PARAMS * (SENSOR_FIT_PARAMS + 1) / 2)
+
+// Index of element (i,j), with i >= j, in packed lower-triangular storage
+#define PACKED(i, j) ((i) * ((i) + 1) / 2 + (j))
+
+// Samples are divided by this before accumulating, to keep the sums of
+// 4th powers within float precision.
+#define SENSOR_FIT_UNIT 256.0
+
+// Fewer samples than this only give the min/max midpoint.
+#define SENSOR_FIT_MIN_SAMPLES 32
+#endif
+
+// }}}
+
+
+////////////////////////////////////////////////////////////
+// Zero tracking                                         {{{
+
+#if ENABLE_ZERO_TRACKING
+// The corrected samples should all have the same magnitude as the corners.
+// A sample that is too long (or too short) votes for moving the zero
+// towards (or away from) it, on each axis, by the sign of that axis. Only
+// the axes that collect this many votes in one direction move, by one
+// unit. At 75Hz, this is at most one unit every 3.4 seconds.
+#define SENSOR_ZERO_TRACK_VOTES 256
+
+// Samples whose squared magnitude is within 1/64 of the expected one (about
+// 0.8% of the magnitude, the noise level) don't vote.
+#define SENSOR_ZERO_TRACK_DEAD_ZONE_SHIFT 6
+
+// Saving the zero to EEPROM, if it has changed, every this many samples
+// (14.4 minutes at 75Hz), and when the tracking stops.
+#define SENSOR_ZERO_TRACK_SAVE_SAMPLES 65000
+#endif
+
+// }}}
+
+
+static void sensor_job_finished(TWI_Job *job);
+
+// TWI job used for reading registers, see sensor_read_registers().
+// Writes the register pointer, and then reads up to 6 registers.
+static uchar sensor_job_register;
+static uchar sensor_job_buffer[6];
+static TWI_Job sensor_job = {
+	SENSOR_I2C_WRITE_ADDRESS,  // address
+	1,  // write_size
+	0,  // read_size
+	TWI_JOB_IDLE,  // status
+	&sensor_job_register,  // write_data
+	sensor_job_buffer,  // read_data
+	sensor_job_finished  // callback
+};
+
+#if ENABLE_SENSOR_PROFILES
+// TWI job that starts a single measurement, see
+// sensor_trigger_measurement().
+static uchar sensor_trigger_data[2] = {SENSOR_REG_MODE, SENSOR_MODE_SINGLE};
+static TWI_Job sensor_trigger_job = {
+	SENSOR_I2C_WRITE_ADDRESS,  // address
+	2,  // write_size
+	0,  // read_size
+	TWI_JOB_IDLE,  // status
+	sensor_trigger_data,  // write_data
+	NULL,  // read_data
+	NULL  // callback
+};
+#endif
+
+#if ENABLE_AUTO_GAIN
+// TWI job that changes the gain, see sensor_change_gain().
+static uchar sensor_gain_data[2] = {SENSOR_REG_CONF_B, 0};
+static TWI_Job sensor_gain_job = {
+	SENSOR_I2C_WRITE_ADDRESS,  // address
+	2,  // write_size
+	0,  // read_size
+	TWI_JOB_IDLE,  // status
+	sensor_gain_data,  // write_data
+	NULL,  // read_data
+	NULL  // callback
+};
+
+// Set while the samples are discarded after a gain change, since
+// sensor_gain_changed_at.
+static uchar sensor_gain_settling;
+static uint16_t sensor_gain_changed_at;
+static uchar sensor_gain_headroom_count;
+#endif
+
+#if ENABLE_SELF_TEST
+// Self-test state, see sensor_self_test()
+static uint16_t sensor_self_test_started_at;
+static XYZVector sensor_self_test_positive;
+#endif
+
+#if ENABLE_ZERO_TRACKING
+// Zero tracking state, see sensor_track_zero()
+static long sensor_zero_track_radius2;
+static int sensor_zero_track_votes[3];
+static uint16_t sensor_zero_track_samples;
+static uchar sensor_zero_track_dirty;
+#endif
+
+// Ellipsoid calibration state, see sensor_calibration_add_sample()
+#if ENABLE_ELLIPSOID_FIT
+static float sensor_fit_normal[SENSOR_FIT_PACKED];
+static float sensor_fit_rhs[SENSOR_FIT_PARAMS];
+#endif
+static uint16_t sensor_fit_samples;
+
+// Timer1 value at the end of the last job, set by sensor_job_finished().
+static uint16_t sensor_job_timestamp;
+
+#if ENABLE_TWI_RECOVERY
+// Retry state, see sensor_read_registers()
+static uchar sensor_retries;
+static uint16_t sensor_retry_at;
+
+// Set when the sensor may have been reset (after a bus clear, or after
+// running out of retries), so that sensor_read_data_registers() checks the
+// configuration registers before reading the data.
+static uchar sensor_config_unknown;
+#endif
+
+// In continuous measurement mode, after reading the last data register, the
+// HMC5883L moves its register pointer back to the first one (see the
+// register access section of HMC5883L.pdf). Thus, after a successful read of all 6 data registers,
+// the next read can skip writing the pointer, and becomes a single 7-byte
+// transfer (address + 6 bytes). Any other access, and any error, means the
+// pointer position is unknown.
+static uchar sensor_continuous_mode;
+static uchar sensor_pointer_at_data;
+
+#if ENABLE_SENSOR_DRDY
+// Set by the main code when it is ready for a new sample, cleared by the
+// DRDY interrupt after queuing the read. See sensor_read_registers().
+static volatile uchar sensor_drdy_armed;
+#endif
+
+#if ENABLE_SENSOR_PROFILES
+// Timer1 value when the last single measurement was triggered, see
+// SENSOR_TRIGGER_TIMEOUT_TICKS.
+static uint16_t sensor_trigger_at;
+#endif
 
-	uchar msg[2];
-	msg[0] = SENSOR_I2C_WRITE_ADDRESS;
-	msg[1] = reg;
-	TWI_Start_Transceiver_With_Data(msg, 2);
-}  // }}}
 
 static void sensor_set_register_value(uchar reg, uchar value) {  // {{{
 	// Sets one of those 3 writable registers to a value.
@@ -159,8 +482,377 @@ static void sensor_set_register_value(uchar reg, uchar value) {  // {{{
 	msg[1] = reg;
 	msg[2] = value;
 	TWI_Start_Transceiver_With_Data(msg, 3);
+
+	if (reg == SENSOR_REG_MODE) {
+		sensor_continuous_mode = ((value & SENSOR_MODE_MASK) == SENSOR_MODE_CONTINUOUS);
+	}
+	sensor_pointer_at_data = 0;
+}  // }}}
+
+
+#if ENABLE_SENSOR_PROFILES || ENABLE_SELF_TEST || ENABLE_TWI_RECOVERY
+static uint16_t sensor_timer1_now() {  // {{{
+	// Reads Timer1 from the main code. Like all 16-bit registers, TCNT1 is
+	// read through the shared TEMP register, and sensor_job_finished() reads
+	// it from the TWI interrupt, which would corrupt a read in progress.
+	uint16_t now;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		now = TCNT1;
+	}
+	return now;
+}  // }}}
+#endif
+
+static void sensor_job_finished(TWI_Job *job) {  // {{{
+	// Called from the TWI interrupt, right after the last byte.
+	(void) job;
+	sensor_job_timestamp = TCNT1;
+}  // }}}
+
+static uchar sensor_queue_read(uchar reg, uchar size) {  // {{{
+	// Queues the TWI job that reads "size" registers starting at "reg".
+	// Returns 0 if the job couldn't be queued (either the previous one is
+	// still running, or the TWI queue is full).
+
+	// The previous job may still be running, if func_step has been reset
+	// in the middle of it.
+	if (sensor_job.status == TWI_JOB_PENDING) return 0;
+
+	sensor_job_register = reg;
+	sensor_job.read_size = size;
+	sensor_job.write_size = !(reg == SENSOR_REG_DATA_START && sensor_pointer_at_data);
+	return TWI_Enqueue_Job(&sensor_job);
+}  // }}}
+
+#if ENABLE_SENSOR_PROFILES
+static void sensor_trigger_measurement() {  // {{{
+	// In single measurement mode, the sensor goes idle after each
+	// measurement. This queues the job that starts the next one, right after
+	// any pending read, without waiting for it.
+	//
+	// If the TWI queue is full, the measurement is not started, and the next
+	// read returns the previous sample again.
+	if (sensor.profile != SENSOR_PROFILE_SINGLE_SHOT) return;
+
+	sensor_trigger_at = sensor_timer1_now();
+	if (sensor_trigger_job.status == TWI_JOB_PENDING) return;
+
+	TWI_Enqueue_Job(&sensor_trigger_job);
+}  // }}}
+#endif
+
+#if ENABLE_AUTO_GAIN
+static void sensor_change_gain(uchar gain) {  // {{{
+	// Queues the job that changes the gain, right after any pending read.
+	// If the TWI queue is full, nothing changes (and the next sample will
+	// try again).
+
+	if (sensor_gain_job.status == TWI_JOB_PENDING) return;
+
+	sensor_gain_data[1] = gain << SENSOR_CONF_B_GAIN_SHIFT;
+	if (!TWI_Enqueue_Job(&sensor_gain_job)) return;
+
+	// Writing a register moves the register pointer
+	sensor_pointer_at_data = 0;
+
+	sensor.gain = gain;
+	sensor_gain_headroom_count = 0;
+	sensor_gain_changed_at = sensor_job_timestamp;
+	sensor_gain_settling = 1;
+}  // }}}
+#endif
+
+#if ENABLE_SELF_TEST || ENABLE_TWI_RECOVERY
+static void sensor_restore_configuration() {  // {{{
+	// Writes the current gain and profile to the sensor.
+	//
+	// This function blocks while TWI is busy.
+	sensor_set_register_value(
+		SENSOR_REG_CONF_B,
+		sensor.gain << SENSOR_CONF_B_GAIN_SHIFT
+	);
+	sensor_set_profile(sensor.profile);
+
+#if ENABLE_AUTO_GAIN
+	// Like after an automatic gain change
+	sensor_gain_changed_at = sensor_timer1_now();
+	sensor_gain_settling = 1;
+#endif
 }  // }}}
+#endif
+
+#if ENABLE_AUTO_GAIN
+static void sensor_auto_range(const XYZVector *raw, uchar overflow) {  // {{{
+	// Called for each sample, with the raw values (at sensor.gain).
+	uchar gain = sensor.gain;
+	int max;
+
+	if (overflow) {
+		if (gain < SENSOR_GAIN_MAX) {
+			sensor_change_gain(gain + 1);
+		}
+		return;
+	}
+	if (gain <= SENSOR_GAIN_DEFAULT) return;
+
+	max = raw->x < 0 ? -raw->x : raw->x;
+	if (raw->y > max) max = raw->y;
+	if (-raw->y > max) max = -raw->y;
+	if (raw->z > max) max = raw->z;
+	if (-raw->z > max) max = -raw->z;
+
+	if (max >= (int) pgm_read_word(&sensor_gain_headroom[gain])) {
+		sensor_gain_headroom_count = 0;
+	} else if (++sensor_gain_headroom_count >= SENSOR_GAIN_HEADROOM_SAMPLES) {
+		sensor_change_gain(gain - 1);
+	}
+}  // }}}
+
+static int sensor_rescale(int value, uint16_t factor) {  // {{{
+	return ((long) value * factor + 128) >> 8;
+}  // }}}
+#endif
+
+#if ENABLE_SELF_TEST || ENABLE_ELLIPSOID_FIT
+static int sensor_apply_correction_row(const XYZVector *row, const XYZVector *v) {  // {{{
+	return (
+		(long) row->x * v->x
+		+ (long) row->y * v->y
+		+ (long) row->z * v->z
+		+ SENSOR_CORRECTION_ONE / 2
+	) >> SENSOR_CORRECTION_SHIFT;
+}  // }}}
+#endif
+
+#if ENABLE_SENSOR_DRDY
+ISR(INT1_vect, ISR_NOBLOCK) {  // {{{
+	// DRDY goes low whenever the sensor has put a new sample into the data
+	// registers. Starting the read right here (instead of waiting for the
+	// main loop) means the sample is fetched as soon as it exists.
+	// Non-blocking, so that the USB interrupt is never delayed.
+	if (sensor_drdy_armed && sensor_queue_read(SENSOR_REG_DATA_START, 6)) {
+		sensor_drdy_armed = 0;
+	}
+}  // }}}
+#endif
+
+static uchar sensor_read_registers(uchar reg, uchar size) {  // {{{
+	// Reads "size" consecutive registers, starting at "reg", into
+	// sensor_job_buffer. The register pointer is set and the registers are
+	// read in a single TWI job (with a repeated START in between), which is
+	// completed by the TWI interrupt, without waiting for the main loop.
+	// The pointer is not written if it is already at the data registers
+	// (see sensor_pointer_at_data).
+	//
+	// Call it once to queue the job, and then again until it returns
+	// SENSOR_FUNC_DONE or SENSOR_FUNC_ERROR. Uses sensor.func_step.
+	//
+	// With ENABLE_SENSOR_DRDY, reading the data registers is queued by the
+	// DRDY interrupt instead, and this function only waits for it.
+	//
+	// With ENABLE_TWI_RECOVERY, a failed job is queued again, after a
+	// backoff, up to SENSOR_READ_RETRIES times. Retries don't wait for DRDY,
+	// the data is already there.
+	//
+	// This function is non-blocking.
 
+	switch(sensor.func_step) {
+		case 0:  // Queue the job
+#if ENABLE_TWI_RECOVERY
+			sensor_retries = 0;
+#endif
+#if ENABLE_SENSOR_DRDY
+			if (reg == SENSOR_REG_DATA_START) {
+				if (sensor_job.status == TWI_JOB_PENDING) return SENSOR_FUNC_STILL_WORKING;
+
+				sensor_drdy_armed = 1;
+				sensor.func_step = 1;
+				return SENSOR_FUNC_STILL_WORKING;
+			}
+#endif
+			if (!sensor_queue_read(reg, size)) return SENSOR_FUNC_STILL_WORKING;
+
+			sensor.func_step = 1;
+		case 1:  // Wait for the job
+#if ENABLE_SENSOR_DRDY
+			// Still waiting for DRDY
+			if (sensor_drdy_armed) {
+#if ENABLE_SENSOR_PROFILES
+				if (sensor.continuous_reading
+					&& (uint16_t) (sensor_timer1_now() - sensor_trigger_at) > SENSOR_TRIGGER_TIMEOUT_TICKS
+				) {
+					sensor_trigger_measurement();
+				}
+#endif
+				return SENSOR_FUNC_STILL_WORKING;
+			}
+#endif
+			if (sensor_job.status == TWI_JOB_PENDING) return SENSOR_FUNC_STILL_WORKING;
+
+			sensor.func_step = 0;
+
+			if (sensor_job.status == TWI_JOB_DONE) {
+				sensor_pointer_at_data = sensor_continuous_mode
+					&& sensor_job_register == SENSOR_REG_DATA_START
+					&& sensor_job.read_size == 6;
+				sensor.error_while_reading = 0;
+				return SENSOR_FUNC_DONE;
+			}
+
+#if ENABLE_TWI_RECOVERY
+			sensor_pointer_at_data = 0;
+			if (sensor_retries < SENSOR_READ_RETRIES) {
+				sensor_retry_at = sensor_timer1_now();
+				sensor.func_step = 2;
+				return SENSOR_FUNC_STILL_WORKING;
+			}
+#endif
+			break;
+#if ENABLE_TWI_RECOVERY
+		case 2:  // Backoff, then queue the job again
+			if ((uint16_t) (sensor_timer1_now() - sensor_retry_at) < (SENSOR_RETRY_BACKOFF_TICKS << sensor_retries)) {
+				return SENSOR_FUNC_STILL_WORKING;
+			}
+			if (!sensor_queue_read(reg, size)) return SENSOR_FUNC_STILL_WORKING;
+
+			sensor_retries++;
+			TWI_counters.retries++;
+			sensor.func_step = 1;
+			return SENSOR_FUNC_STILL_WORKING;
+#endif
+	}
+
+	sensor.func_step = 0;
+	sensor_pointer_at_data = 0;
+	sensor.error_while_reading = 1;
+#if ENABLE_TWI_RECOVERY
+	sensor_config_unknown = 1;
+#endif
+	return SENSOR_FUNC_ERROR;
+}  // }}}
+
+
+#if ENABLE_ZERO_TRACKING
+static void sensor_zero_track_save() {  // {{{
+	// Saves the zero to EEPROM if it has changed, and if nothing else is
+	// being written.
+	if (sensor_zero_track_dirty && !int_eeprom_busy()) {
+		int_eeprom_write_block(
+			&sensor.e.zero,
+			&eeprom_sensor.zero,
+			sizeof(XYZVector)
+		);
+		sensor_zero_track_dirty = 0;
+	}
+}  // }}}
+
+static void sensor_zero_track_axis(int value, signed char sign, uchar axis, int *zero) {  // {{{
+	int votes = sensor_zero_track_votes[axis];
+
+	if (value > 0) {
+		votes += sign;
+	} else if (value < 0) {
+		votes -= sign;
+	}
+
+	if (votes >= SENSOR_ZERO_TRACK_VOTES) {
+		(*zero)++;
+		votes = 0;
+		sensor_zero_track_dirty = 1;
+	} else if (votes <= -SENSOR_ZERO_TRACK_VOTES) {
+		(*zero)--;
+		votes = 0;
+		sensor_zero_track_dirty = 1;
+	}
+	sensor_zero_track_votes[axis] = votes;
+}  // }}}
+
+static void sensor_track_zero(const XYZVector *v, const XYZVector *corrected) {  // {{{
+	// Called for each sample, with both the zero-compensated vector (before
+	// the correction) and the corrected one. The magnitude is only meaningful
+	// after the correction, which maps the ellipsoid into a sphere, but the
+	// zero is in raw sensor space. Voting with the signs of the corrected
+	// vector would only work for a diagonal correction, not after an
+	// ellipsoid fit with cross terms.
+	long error;
+	long dead_zone = sensor_zero_track_radius2 >> SENSOR_ZERO_TRACK_DEAD_ZONE_SHIFT;
+	signed char sign;
+
+	SensorData *sens = &sensor;
+	FIX_POINTER(sens);
+
+	error = (long) corrected->x * corrected->x
+		+ (long) corrected->y * corrected->y
+		+ (long) corrected->z * corrected->z
+		- sensor_zero_track_radius2;
+
+	if (error > dead_zone) {
+		sign = 1;
+	} else if (error < -dead_zone) {
+		sign = -1;
+	} else {
+		sign = 0;
+	}
+
+	if (sign) {
+		sensor_zero_track_axis(v->x, sign, 0, &sens->e.zero.x);
+		sensor_zero_track_axis(v->y, sign, 1, &sens->e.zero.y);
+		sensor_zero_track_axis(v->z, sign, 2, &sens->e.zero.z);
+	}
+
+	if (++sensor_zero_track_samples >= SENSOR_ZERO_TRACK_SAVE_SAMPLES) {
+		sensor_zero_track_samples = 0;
+		sensor_zero_track_save();
+	}
+}  // }}}
+#endif
+
+static uchar sensor_decode_data(XYZVector *v) {  // {{{
+	// Copies the data registers, from sensor_job_buffer, into *v.
+	// Returns 1 if any axis has overflowed.
+	uchar *buf = sensor_job_buffer;
+
+	#define OFFSET(suffix) (SENSOR_REG_DATA_##suffix - SENSOR_REG_DATA_START)
+	v->x = (int16_t) ((buf[OFFSET(X_MSB)] << 8) | buf[OFFSET(X_LSB)]);
+	v->y = (int16_t) ((buf[OFFSET(Y_MSB)] << 8) | buf[OFFSET(Y_LSB)]);
+	v->z = (int16_t) ((buf[OFFSET(Z_MSB)] << 8) | buf[OFFSET(Z_LSB)]);
+	#undef OFFSET
+
+	return
+		(v->x == SENSOR_DATA_OVERFLOW)
+		|| (v->y == SENSOR_DATA_OVERFLOW)
+		|| (v->z == SENSOR_DATA_OVERFLOW);
+}  // }}}
+
+#if ENABLE_TWI_RECOVERY
+static uchar sensor_check_configuration() {  // {{{
+	// Reads the configuration registers back, and writes them again if they
+	// don't match (the sensor has been reset, or a configuration job has been
+	// aborted by a bus clear). In single-shot mode, the mode register is not
+	// checked, it changes by itself after each measurement.
+	//
+	// Same usage as sensor_read_registers(). Blocks while writing.
+
+	uchar return_code;
+	const SensorProfile *p = &sensor_profiles[sensor.profile];
+
+	return_code = sensor_read_registers(SENSOR_REG_CONF_A, 3);
+	if (return_code != SENSOR_FUNC_DONE) {
+		return return_code;
+	}
+
+	sensor_config_unknown = 0;
+	if (sensor_job_buffer[0] != (pgm_read_byte_near(&p->conf_a) | SENSOR_CONF_A_BIAS_NORMAL)
+		|| sensor_job_buffer[1] != (sensor.gain << SENSOR_CONF_B_GAIN_SHIFT)
+		|| (sensor.profile != SENSOR_PROFILE_SINGLE_SHOT
+			&& (sensor_job_buffer[2] & SENSOR_MODE_MASK) != pgm_read_byte_near(&p->mode))
+	) {
+		sensor_restore_configuration();
+	}
+	return SENSOR_FUNC_DONE;
+}  // }}}
+#endif
 
 uchar sensor_read_data_registers() {  // {{{
 	// Reads the X,Y,Z data registers and store them at global vars.
@@ -168,67 +860,111 @@ uchar sensor_read_data_registers() {  // {{{
 	//
 	// This function is non-blocking.
 
-	// 1 address byte + 6 data bytes = 7 bytes
-	uchar msg[7];
-
-	uchar lastTransOK;
+	uchar return_code;
 
 	SensorData *sens = &sensor;
 	FIX_POINTER(sens);
 
-	switch(sens->func_step) {
-		case 0:  // Set address pointer
-			if (TWI_Transceiver_Busy()) return SENSOR_FUNC_STILL_WORKING;
-
-			sensor_set_address_pointer(SENSOR_REG_DATA_START);
-			sens->func_step = 1;
-		case 1:  // Start reading operation
-			if (TWI_Transceiver_Busy()) return SENSOR_FUNC_STILL_WORKING;
-
-			msg[0] = SENSOR_I2C_READ_ADDRESS;
-			TWI_Start_Transceiver_With_Data(msg, 7);
-
-			sens->func_step = 2;
-		case 2:  // Finished reading operation
-			if (TWI_Transceiver_Busy()) return SENSOR_FUNC_STILL_WORKING;
-
-			lastTransOK = TWI_Get_Data_From_Transceiver(msg, 7);
-			sens->func_step = 0;
-
-			if (lastTransOK) {
-				// Copying data to sensor->data struct
-				#define OFFSET(suffix) (1 + SENSOR_REG_DATA_##suffix - SENSOR_REG_DATA_START)
-				sens->data.x = (msg[OFFSET(X_MSB)] << 8) | (msg[OFFSET(X_LSB)]);
-				sens->data.y = (msg[OFFSET(Y_MSB)] << 8) | (msg[OFFSET(Y_LSB)]);
-				sens->data.z = (msg[OFFSET(Z_MSB)] << 8) | (msg[OFFSET(Z_LSB)]);
-				#undef OFFSET
-
-				// Detecting overflow
-				sens->overflow =
-					(sens->data.x == SENSOR_DATA_OVERFLOW)
-					|| (sens->data.y == SENSOR_DATA_OVERFLOW)
-					|| (sens->data.z == SENSOR_DATA_OVERFLOW);
-
-				// Applying zero compensation
-				if (sens->e.zero_compensation && !sens->overflow) {
-					sens->data.x -= sens->e.zero.x;
-					sens->data.y -= sens->e.zero.y;
-					sens->data.z -= sens->e.zero.z;
-				}
+#if ENABLE_TWI_RECOVERY
+	if (sensor_config_unknown) {
+		return_code = sensor_check_configuration();
+		if (return_code != SENSOR_FUNC_DONE) {
+			return return_code;
+		}
+	}
+#endif
 
-				sens->new_data_available = 1;
-				sens->error_while_reading = 0;
-				return SENSOR_FUNC_DONE;
+	return_code = sensor_read_registers(SENSOR_REG_DATA_START, 6);
+
+#if ENABLE_SENSOR_PROFILES
+	if (return_code != SENSOR_FUNC_STILL_WORKING) {
+		sensor_trigger_measurement();
+	}
+#endif
+
+	if (return_code == SENSOR_FUNC_DONE) {
+		// Copying data to sensor->data struct, and detecting overflow
+		sens->overflow = sensor_decode_data(&sens->data);
+
+#if ENABLE_AUTO_GAIN
+		// Automatic gain ranging
+		if (sensor_gain_settling) {
+			if ((uint16_t) (sensor_job_timestamp - sensor_gain_changed_at) < SENSOR_GAIN_SETTLING_TICKS) {
+				sens->overflow = 1;
 			} else {
-				sens->error_while_reading = 1;
-				return SENSOR_FUNC_ERROR;
+				sensor_gain_settling = 0;
+			}
+		}
+		if (!sensor_gain_settling) {
+			uint16_t factor = pgm_read_word(&sensor_gain_factor[sens->gain]);
+
+			sensor_auto_range(&sens->data, sens->overflow);
+
+			// Converting to the units of the default gain
+			if (!sens->overflow) {
+				sens->data.x = sensor_rescale(sens->data.x, factor);
+				sens->data.y = sensor_rescale(sens->data.y, factor);
+				sens->data.z = sensor_rescale(sens->data.z, factor);
+			}
+		}
+#endif
+
+		// Applying zero compensation, and the soft-iron correction
+		if (sens->e.zero_compensation && !sens->overflow) {
+			XYZVector v;
+			v.x = sens->data.x - sens->e.zero.x;
+			v.y = sens->data.y - sens->e.zero.y;
+			v.z = sens->data.z - sens->e.zero.z;
+#if ENABLE_SELF_TEST || ENABLE_ELLIPSOID_FIT
+			sens->data.x = sensor_apply_correction_row(&sens->correction[0], &v);
+			sens->data.y = sensor_apply_correction_row(&sens->correction[1], &v);
+			sens->data.z = sensor_apply_correction_row(&sens->correction[2], &v);
+#else
+			sens->data = v;
+#endif
+
+#if ENABLE_ZERO_TRACKING
+			if (sens->zero_tracking) {
+				sensor_track_zero(&v, &sens->data);
 			}
-		default:
-			sens->error_while_reading = 1;
-			return SENSOR_FUNC_ERROR;
+#endif
+		}
+
+		sens->new_data_available = 1;
+		sensor_ring_push(&sens->ring, &sens->data, sensor_job_timestamp, sens->overflow);
 	}
+
+	return return_code;
 }  // }}}
 
+#if ENABLE_TWI_RECOVERY
+void sensor_bus_recovered() {  // {{{
+	// Called after TWI_Check_Bus() has cleared the bus. Any pending job has
+	// failed, and the sensor may have been reset (by the same glitch), so its
+	// configuration is checked before the next data read.
+	SensorData *sens = &sensor;
+	FIX_POINTER(sens);
+
+#if ENABLE_SENSOR_DRDY
+	// A read waiting for DRDY must not be queued by the interrupt now, it
+	// would be taken for the configuration.
+	sensor_drdy_armed = 0;
+#endif
+	// The interrupted read is started again from the beginning, after the
+	// configuration check (the failed job must not be taken for the check).
+	sens->func_step = 0;
+	sensor_pointer_at_data = 0;
+	sensor_config_unknown = 1;
+
+#if ENABLE_SENSOR_PROFILES
+	// A pending trigger has been dropped too
+	if (sens->continuous_reading) {
+		sensor_trigger_measurement();
+	}
+#endif
+}  // }}}
+#endif
+
 void sensor_start_continuous_reading() {  // {{{
 	SensorData *sens = &sensor;
 	FIX_POINTER(sens);
@@ -237,6 +973,15 @@ void sensor_start_continuous_reading() {  // {{{
 	sens->new_data_available = 0;
 	sens->error_while_reading = 0;
 	sens->continuous_reading = 1;
+	sensor_ring_clear(&sens->ring);
+#if ENABLE_SENSOR_DRDY
+	sensor_drdy_armed = 0;
+#endif
+
+#if ENABLE_SENSOR_PROFILES
+	// The sensor may have been idle for a while
+	sensor_trigger_measurement();
+#endif
 }  // }}}
 
 void sensor_stop_continuous_reading() {  // {{{
@@ -247,7 +992,47 @@ void sensor_stop_continuous_reading() {  // {{{
 	//sens->new_data_available = 0;
 	//sens->error_while_reading = 0;
 	sens->continuous_reading = 0;
+#if ENABLE_SENSOR_DRDY
+	sensor_drdy_armed = 0;
+#endif
+
+#if ENABLE_ZERO_TRACKING
+	if (sens->zero_tracking) {
+		sens->zero_tracking = 0;
+		sensor_zero_track_save();
+	}
+#endif
+}  // }}}
+
+#if ENABLE_ZERO_TRACKING
+void sensor_start_zero_tracking() {  // {{{
+	// Enables the zero tracking, until sensor_stop_continuous_reading().
+	// Must be called after sensor_start_continuous_reading(), and only when
+	// nothing else will write the EEPROM until the reading stops (that is,
+	// in mouse mode).
+	//
+	// The expected magnitude comes from the corners, which have been
+	// recorded with the same zero compensation and correction.
+	uchar i;
+	long sum = 0;
+
+	SensorData *sens = &sensor;
+	FIX_POINTER(sens);
+
+	if (!sens->e.zero_compensation) return;
+
+	for (i = 0; i < 4; i++) {
+		const XYZVector *c = &sens->e.corners[i];
+		sum += (long) c->x * c->x + (long) c->y * c->y + (long) c->z * c->z;
+	}
+	sensor_zero_track_radius2 = sum / 4;
+	sensor_zero_track_votes[0] = 0;
+	sensor_zero_track_votes[1] = 0;
+	sensor_zero_track_votes[2] = 0;
+	sensor_zero_track_samples = 0;
+	sens->zero_tracking = 1;
 }  // }}}
+#endif
 
 
 uchar sensor_read_identification_string(uchar *s) {  // {{{
@@ -260,47 +1045,376 @@ uchar sensor_read_identification_string(uchar *s) {  // {{{
 	//
 	// This function is non-blocking.
 
-	// 1 address byte + 3 chars
-	uchar msg[4];
+	uchar return_code;
 
-	uchar lastTransOK;
+	return_code = sensor_read_registers(SENSOR_REG_ID_A, 3);
 
-	switch(sensor.func_step) {
-		case 0:  // Set address pointer
-			if (TWI_Transceiver_Busy()) return SENSOR_FUNC_STILL_WORKING;
+	if (return_code == SENSOR_FUNC_DONE) {
+		s[0] = sensor_job_buffer[0];
+		s[1] = sensor_job_buffer[1];
+		s[2] = sensor_job_buffer[2];
+		s[3] = '\0';
+	}
 
-			sensor_set_address_pointer(SENSOR_REG_ID_A);
-			sensor.func_step = 1;
-		case 1:  // Start reading operation
-			if (TWI_Transceiver_Busy()) return SENSOR_FUNC_STILL_WORKING;
+	return return_code;
+}  // }}}
 
-			msg[0] = SENSOR_I2C_READ_ADDRESS;
-			TWI_Start_Transceiver_With_Data(msg, 4);
 
-			sensor.func_step = 2;
-		case 2:  // Finished reading operation
-			if (TWI_Transceiver_Busy()) return SENSOR_FUNC_STILL_WORKING;
+#if ENABLE_SELF_TEST || ENABLE_ELLIPSOID_FIT
+static void sensor_set_identity_correction() {  // {{{
+	memset(sensor.correction, 0, sizeof(sensor.correction));
+	sensor.correction[0].x = SENSOR_CORRECTION_ONE;
+	sensor.correction[1].y = SENSOR_CORRECTION_ONE;
+	sensor.correction[2].z = SENSOR_CORRECTION_ONE;
+}  // }}}
+#endif
 
-			lastTransOK = TWI_Get_Data_From_Transceiver(msg, 4);
-			sensor.func_step = 0;
+#if ENABLE_SELF_TEST
+static void sensor_self_test_configure(uchar bias) {  // {{{
+	sensor_set_register_value(
+		SENSOR_REG_CONF_A,
+		SENSOR_CONF_A_SAMPLES_8
+		| SENSOR_CONF_A_RATE_15
+		| bias
+	);
+	sensor_self_test_started_at = sensor_timer1_now();
+}  // }}}
 
-			if (lastTransOK) {
-				s[0] = msg[1];
-				s[1] = msg[2];
-				s[2] = msg[3];
-				s[3] = '\0';
-				sensor.error_while_reading = 0;
-				return SENSOR_FUNC_DONE;
-			} else {
-				sensor.error_while_reading = 1;
+static void sensor_self_test_finish() {  // {{{
+	sensor.self_test_step = 0;
+	sensor_restore_configuration();
+}  // }}}
+
+static uchar sensor_self_test_axis(int positive, int negative, int expected, int *scale) {  // {{{
+	// Calculates the scale for one axis. The ambient field is the same in
+	// both readings, so half of the difference is the bias field alone.
+	// Returns 0 if the axis is outside the datasheet limits.
+	int response = (positive - negative) / 2;
+
+	if (response < SENSOR_SELF_TEST_LOW_LIMIT || response > SENSOR_SELF_TEST_HIGH_LIMIT) {
+		return 0;
+	}
+	*scale = ((long) expected * SENSOR_CORRECTION_ONE + response / 2) / response;
+	return 1;
+}  // }}}
+
+uchar sensor_correction_is_diagonal() {  // {{{
+	// Returns 0 if sensor.correction has any cross-axis term, that is, if it
+	// comes from the ellipsoid fit.
+	const XYZVector *c = sensor.correction;
+
+	return !(c[0].y || c[0].z || c[1].x || c[1].z || c[2].x || c[2].y);
+}  // }}}
+
+uchar sensor_self_test() {  // {{{
+	// Measures the field produced by the internal bias current, in both
+	// directions, and sets sensor.correction to a diagonal matrix, so that
+	// all axes have the same sensitivity. Nothing is changed unless all axes
+	// are within the datasheet limits. The caller should save it to EEPROM.
+	//
+	// The new matrix replaces the previous one, so this should only be
+	// called while sensor_correction_is_diagonal(). See SensorData.correction.
+	//
+	// sensor.self_test_step and sensor.func_step must be set to zero before
+	// the first call, and continuous reading must be stopped. Call it again
+	// until it returns SENSOR_FUNC_DONE or SENSOR_FUNC_ERROR, which takes
+	// about half a second. The sensor configuration is restored afterwards.
+	//
+	// This function is non-blocking (except if TWI is already busy).
+
+	uchar return_code;
+	XYZVector v;
+	XYZVector scale;
+
+	SensorData *sens = &sensor;
+	FIX_POINTER(sens);
+
+	switch (sens->self_test_step) {
+		case 0:  // Positive bias
+			sensor_set_register_value(SENSOR_REG_CONF_B, SENSOR_SELF_TEST_GAIN);
+			sensor_set_register_value(SENSOR_REG_MODE, SENSOR_MODE_CONTINUOUS);
+			sensor_self_test_configure(SENSOR_CONF_A_BIAS_POSITIVE);
+			sens->self_test_step = 1;
+			return SENSOR_FUNC_STILL_WORKING;
+
+		case 1:  // Reading with positive bias
+		case 2:  // Reading with negative bias
+			if ((uint16_t) (sensor_timer1_now() - sensor_self_test_started_at) < SENSOR_SELF_TEST_WAIT_TICKS) {
+				return SENSOR_FUNC_STILL_WORKING;
+			}
+
+			return_code = sensor_read_registers(SENSOR_REG_DATA_START, 6);
+			if (return_code == SENSOR_FUNC_STILL_WORKING) {
+				return return_code;
+			}
+			if (return_code == SENSOR_FUNC_ERROR || sensor_decode_data(&v)) {
+				break;
+			}
+
+			if (sens->self_test_step == 1) {
+				sensor_self_test_positive = v;
+				sensor_self_test_configure(SENSOR_CONF_A_BIAS_NEGATIVE);
+				sens->self_test_step = 2;
+				return SENSOR_FUNC_STILL_WORKING;
+			}
+
+			sensor_self_test_finish();
+
+			if (!sensor_self_test_axis(sensor_self_test_positive.x, v.x, SENSOR_SELF_TEST_EXPECTED_XY, &scale.x)
+				|| !sensor_self_test_axis(sensor_self_test_positive.y, v.y, SENSOR_SELF_TEST_EXPECTED_XY, &scale.y)
+				|| !sensor_self_test_axis(sensor_self_test_positive.z, v.z, SENSOR_SELF_TEST_EXPECTED_Z, &scale.z)
+			) {
+				sens->error_while_reading = 1;
 				return SENSOR_FUNC_ERROR;
 			}
-		default:
-			sensor.error_while_reading = 1;
-			return SENSOR_FUNC_ERROR;
+			sensor_set_identity_correction();
+			sens->correction[0].x = scale.x;
+			sens->correction[1].y = scale.y;
+			sens->correction[2].z = scale.z;
+			return SENSOR_FUNC_DONE;
+	}
+
+	sensor_self_test_finish();
+	sens->error_while_reading = 1;
+	return SENSOR_FUNC_ERROR;
+}  // }}}
+#endif
+
+
+void sensor_calibration_start() {  // {{{
+	// Starts a new zero (and soft-iron) calibration. Zero compensation must
+	// be disabled, so that sensor.data has the uncorrected values.
+	sensor_fit_samples = 0;
+#if ENABLE_ELLIPSOID_FIT
+	memset(sensor_fit_normal, 0, sizeof(sensor_fit_normal));
+	memset(sensor_fit_rhs, 0, sizeof(sensor_fit_rhs));
+#endif
+}  // }}}
+
+void sensor_calibration_add_sample() {  // {{{
+	// Adds sensor.data to the calibration. The caller should only call this
+	// for new samples without overflow.
+	//
+	// Costs a few thousand cycles (with ENABLE_ELLIPSOID_FIT), only during
+	// calibration.
+
+#if ENABLE_ELLIPSOID_FIT
+	float row[SENSOR_FIT_PARAMS];
+	float x, y, z;
+	uchar i, j;
+#endif
+
+	SensorData *sens = &sensor;
+	FIX_POINTER(sens);
+
+	// Min/max, for the fallback
+	if (sensor_fit_samples == 0) {
+		sens->zero_min = sens->data;
+		sens->zero_max = sens->data;
+	}
+	if (sens->data.x < sens->zero_min.x) sens->zero_min.x = sens->data.x;
+	if (sens->data.y < sens->zero_min.y) sens->zero_min.y = sens->data.y;
+	if (sens->data.z < sens->zero_min.z) sens->zero_min.z = sens->data.z;
+
+	if (sens->data.x > sens->zero_max.x) sens->zero_max.x = sens->data.x;
+	if (sens->data.y > sens->zero_max.y) sens->zero_max.y = sens->data.y;
+	if (sens->data.z > sens->zero_max.z) sens->zero_max.z = sens->data.z;
+
+	if (sensor_fit_samples < 0xFFFF) {
+		sensor_fit_samples++;
+	}
+
+#if ENABLE_ELLIPSOID_FIT
+	x = sens->data.x / SENSOR_FIT_UNIT;
+	y = sens->data.y / SENSOR_FIT_UNIT;
+	z = sens->data.z / SENSOR_FIT_UNIT;
+	row[0] = x * x;
+	row[1] = y * y;
+	row[2] = z * z;
+	row[3] = 2 * x * y;
+	row[4] = 2 * x * z;
+	row[5] = 2 * y * z;
+	row[6] = 2 * x;
+	row[7] = 2 * y;
+	row[8] = 2 * z;
+
+	for (i = 0; i < SENSOR_FIT_PARAMS; i++) {
+		for (j = 0; j <= i; j++) {
+			sensor_fit_normal[PACKED(i, j)] += row[i] * row[j];
+		}
+		sensor_fit_rhs[i] += row[i];
+	}
+#endif
+}  // }}}
+
+#if ENABLE_ELLIPSOID_FIT
+
+static uchar sensor_cholesky(float *m, uchar n) {  // {{{
+	// In-place Cholesky decomposition of the symmetric matrix m (packed
+	// lower-triangular), into L (also packed), such that m = L * L^T.
+	// Returns 0 if m is not positive definite.
+	uchar i, j, k;
+
+	for (i = 0; i < n; i++) {
+		for (j = 0; j <= i; j++) {
+			float sum = m[PACKED(i, j)];
+			for (k = 0; k < j; k++) {
+				sum -= m[PACKED(i, k)] * m[PACKED(j, k)];
+			}
+			if (i == j) {
+				if (!(sum > 0)) return 0;
+				m[PACKED(i, i)] = sqrt(sum);
+			} else {
+				m[PACKED(i, j)] = sum / m[PACKED(j, j)];
+			}
+		}
+	}
+	return 1;
+}  // }}}
+
+static void sensor_cholesky_solve(const float *l, uchar n, float *b) {  // {{{
+	// Solves L * L^T * x = b, in place, for L from sensor_cholesky().
+	signed char i;
+	uchar k;
+
+	for (i = 0; i < n; i++) {
+		for (k = 0; k < i; k++) {
+			b[i] -= l[PACKED(i, k)] * b[k];
+		}
+		b[i] /= l[PACKED(i, i)];
+	}
+	for (i = n - 1; i >= 0; i--) {
+		for (k = i + 1; k < n; k++) {
+			b[i] -= l[PACKED(k, i)] * b[k];
+		}
+		b[i] /= l[PACKED(i, i)];
 	}
 }  // }}}
 
+static uchar sensor_fit_ellipsoid() {  // {{{
+	// Solves the accumulated least squares problem, and sets e.zero and the
+	// correction matrix. Returns 0 if the samples don't define an ellipsoid
+	// (too few of them, or not spread enough), without changing anything.
+
+	float *p = sensor_fit_rhs;
+	float q[6];
+	float center[3];
+	float norm;
+	uchar i;
+
+	SensorData *sens = &sensor;
+	FIX_POINTER(sens);
+
+	if (sensor_fit_samples < SENSOR_FIT_MIN_SAMPLES) return 0;
+
+	if (!sensor_cholesky(sensor_fit_normal, SENSOR_FIT_PARAMS)) return 0;
+	sensor_cholesky_solve(sensor_fit_normal, SENSOR_FIT_PARAMS, p);
+
+	// The quadric is v^T Q v + 2 (g,h,i) v = 1, where Q is symmetric
+	// (packed: a, d, b, e, f, c). It is an ellipsoid only if Q is positive
+	// definite.
+	q[PACKED(0, 0)] = p[0];
+	q[PACKED(1, 0)] = p[3];
+	q[PACKED(1, 1)] = p[1];
+	q[PACKED(2, 0)] = p[4];
+	q[PACKED(2, 1)] = p[5];
+	q[PACKED(2, 2)] = p[2];
+	if (!sensor_cholesky(q, 3)) return 0;
+
+	// Center: Q * center = -(g,h,i)
+	center[0] = -p[6];
+	center[1] = -p[7];
+	center[2] = -p[8];
+	sensor_cholesky_solve(q, 3, center);
+
+	// With Q = L * L^T, the correction L^T maps the ellipsoid (around its
+	// center) into a sphere. Any rotation of it would do as well, as the
+	// corners are recorded after this calibration. It is normalized to
+	// determinant 1, so that the sphere has the mean radius of the
+	// ellipsoid, and the units stay about the same.
+	norm = SENSOR_CORRECTION_ONE / pow(q[PACKED(0, 0)] * q[PACKED(1, 1)] * q[PACKED(2, 2)], 1.0 / 3);
+
+	memset(sens->correction, 0, sizeof(sens->correction));
+	sens->correction[0].x = lround(q[PACKED(0, 0)] * norm);
+	sens->correction[0].y = lround(q[PACKED(1, 0)] * norm);
+	sens->correction[0].z = lround(q[PACKED(2, 0)] * norm);
+	sens->correction[1].y = lround(q[PACKED(1, 1)] * norm);
+	sens->correction[1].z = lround(q[PACKED(2, 1)] * norm);
+	sens->correction[2].z = lround(q[PACKED(2, 2)] * norm);
+
+	for (i = 0; i < 3; i++) {
+		center[i] *= SENSOR_FIT_UNIT;
+	}
+	sens->e.zero.x = lround(center[0]);
+	sens->e.zero.y = lround(center[1]);
+	sens->e.zero.z = lround(center[2]);
+
+	return 1;
+}  // }}}
+#endif
+
+uchar sensor_calibration_finish() {  // {{{
+	// Sets e.zero and the correction matrix from the samples. If they don't
+	// define an ellipsoid (or without ENABLE_ELLIPSOID_FIT), falls back to
+	// the midpoint of each axis, and keeps the current correction (such as
+	// the scales from the self-test). Returns 1 if the ellipsoid fit has been
+	// used, and only then the caller should save the correction.
+	//
+	// Blocks for a few tens of milliseconds, solving the fit.
+
+	SensorData *sens = &sensor;
+	FIX_POINTER(sens);
+
+#if ENABLE_ELLIPSOID_FIT
+	if (sensor_fit_ellipsoid()) return 1;
+#endif
+
+	sens->e.zero.x = (sens->zero_min.x + sens->zero_max.x) / 2;
+	sens->e.zero.y = (sens->zero_min.y + sens->zero_max.y) / 2;
+	sens->e.zero.z = (sens->zero_min.z + sens->zero_max.z) / 2;
+	return 0;
+}  // }}}
+
+
+void sensor_set_profile(uchar profile) {  // {{{
+	// Switches to one of the SENSOR_PROFILE_* acquisition profiles, by
+	// reconfiguring the sensor. Invalid values (such as an erased EEPROM)
+	// select the first profile.
+	//
+	// This function blocks while TWI is busy.
+
+	const SensorProfile *p;
+
+	if (profile >= SENSOR_TOTAL_PROFILES) {
+		profile = SENSOR_PROFILE_LOW_NOISE;
+	}
+	p = &sensor_profiles[profile];
+
+	sensor.profile = profile;
+	sensor.probe_period = pgm_read_byte_near(&p->probe_period);
+
+	sensor_set_register_value(
+		SENSOR_REG_CONF_A,
+		pgm_read_byte_near(&p->conf_a)
+		| SENSOR_CONF_A_BIAS_NORMAL
+	);
+	// Writing SENSOR_MODE_SINGLE also starts the first measurement.
+	sensor_set_register_value(
+		SENSOR_REG_MODE,
+		pgm_read_byte_near(&p->mode)
+	);
+}  // }}}
+
+
+void sensor_init_defaults() {  // {{{
+	// Sets the state that doesn't come from the EEPROM: the identity
+	// correction (until a valid one is read) and the default gain.
+	// Also used by cyclebench.c, which has neither the sensor nor the EEPROM.
+#if ENABLE_SELF_TEST || ENABLE_ELLIPSOID_FIT
+	sensor_set_identity_correction();
+#endif
+	sensor.gain = SENSOR_GAIN_DEFAULT;
+}  // }}}
 
 void sensor_init_configuration() {  // {{{
 	// This must be called AFTER interrupts were enabled and AFTER
@@ -311,24 +1425,25 @@ void sensor_init_configuration() {  // {{{
 	//sensor.func_step = 0;
 	//sensor.new_data_available = 0;
 	//sensor.error_while_reading = 0;
+	sensor_init_defaults();
 
 	// Reading from the EEPROM:
 	eeprom_read_block(&sensor.e, &eeprom_sensor, sizeof(SensorEepromData));
+	sensor.corners_changed = 1;
+
+#if ENABLE_SELF_TEST || ENABLE_ELLIPSOID_FIT
+	eeprom_read_block(&sensor.correction, &eeprom_sensor_correction, sizeof(sensor.correction));
+	// Erased EEPROM
+	if (sensor.correction[0].x <= 0 || sensor.correction[1].y <= 0 || sensor.correction[2].z <= 0) {
+		sensor_set_identity_correction();
+	}
+#endif
 
-	sensor_set_register_value(
-		SENSOR_REG_CONF_A,
-		SENSOR_CONF_A_SAMPLES_8
-		| SENSOR_CONF_A_RATE_75
-		| SENSOR_CONF_A_BIAS_NORMAL
-	);
 	sensor_set_register_value(
 		SENSOR_REG_CONF_B,
-		SENSOR_CONF_B_GAIN_1_3
-	);
-	sensor_set_register_value(
-		SENSOR_REG_MODE,
-		SENSOR_MODE_CONTINUOUS
+		sensor.gain << SENSOR_CONF_B_GAIN_SHIFT
 	);
+	sensor_set_profile(eeprom_read_byte(&eeprom_sensor_profile));
 }  // }}}
 
 
@@ -7,6 +7,7 @@
 #define __sensor_h_included__
 
 #include <avr/eeprom.h>
+#include <stdint.h>
 #include "common.h"
 
 
@@ -18,6 +19,21 @@
 // Value that means "overflow"
 #define SENSOR_DATA_OVERFLOW -4096
 
+// Acquisition profiles, see sensor_profiles[] in sensor.c
+// Without ENABLE_SENSOR_PROFILES, only the first one exists.
+#define SENSOR_PROFILE_LOW_NOISE   0
+#define SENSOR_PROFILE_LOW_LATENCY 1
+#define SENSOR_PROFILE_SINGLE_SHOT 2
+#if ENABLE_SENSOR_PROFILES
+#define SENSOR_TOTAL_PROFILES      3
+#else
+#define SENSOR_TOTAL_PROFILES      1
+#endif
+
+// Fixed-point 1.0 for SensorData.correction
+#define SENSOR_CORRECTION_SHIFT 12
+#define SENSOR_CORRECTION_ONE   (1 << SENSOR_CORRECTION_SHIFT)
+
 
 // Definitions
 typedef struct XYZVector {
@@ -37,6 +53,32 @@ typedef struct SensorEepromData {
 	XYZVector corners[4];
 } SensorEepromData;
 
+// Ring of samples, from sensor_read_data_registers() to the mouse emulation.
+// There is a single producer and a single consumer, so it needs no locking:
+// only the producer writes "head", only the consumer writes "tail", and each
+// one publishes its index after touching the sample. Both indexes run freely
+// (mod 256), the slot is the index mod SENSOR_RING_SIZE.
+//
+// Must be a power of 2.
+#define SENSOR_RING_SIZE 4
+
+typedef struct SensorSample {
+	// Same as SensorData.data
+	XYZVector v;
+	// Timer1 (F_CPU/64, 5.33us at 12MHz) when the sample was read. Wraps
+	// around, only differences are meaningful.
+	uint16_t timestamp;
+	uchar overflow;
+} SensorSample;
+
+typedef struct SensorRing {
+	SensorSample samples[SENSOR_RING_SIZE];
+	volatile uchar head;
+	volatile uchar tail;
+	// Samples dropped because the ring was full (the newest one is dropped).
+	uint16_t overruns;
+} SensorRing;
+
 typedef struct SensorData {
 	union {
 		uchar flags;
@@ -60,7 +102,16 @@ typedef struct SensorData {
 			// should be called.
 			uchar continuous_reading:1;
 
-			uchar unused_bits:4;
+			// Set to 1 whenever e.corners is modified (either at boot or by
+			// the menu). The mouse emulation code uses this to know when it
+			// should recalculate its cached projection basis.
+			uchar corners_changed:1;
+
+			// Enables the zero tracking, see sensor_start_zero_tracking().
+			// Only with ENABLE_ZERO_TRACKING.
+			uchar zero_tracking:1;
+
+			uchar unused_bits:2;
 		};
 	};
 
@@ -69,6 +120,25 @@ typedef struct SensorData {
 
 	SensorEepromData e;
 
+	// Every sample read, for the mouse emulation
+	SensorRing ring;
+
+#if ENABLE_SELF_TEST || ENABLE_ELLIPSOID_FIT
+	// Soft-iron correction matrix (one XYZVector per row), applied together
+	// with the zero compensation. Fixed-point, SENSOR_CORRECTION_ONE means
+	// 1.0. Only with ENABLE_SELF_TEST or ENABLE_ELLIPSOID_FIT, as nothing
+	// else sets it.
+	//
+	// The ellipsoid fit (sensor_calibration_finish() returning 1) replaces
+	// it with a matrix that has cross-axis terms, and also evens out the axis
+	// scales. The self-test replaces it with a diagonal one (the axis scales
+	// only), so it is only run while the correction is diagonal (see
+	// sensor_correction_is_diagonal()): after a fit, it would throw the
+	// cross-axis terms away. The min/max zero calibration keeps it. The
+	// corners should be recorded again after it changes.
+	XYZVector correction[3];
+#endif
+
 	// Zero calibration temporary values
 	XYZVector zero_min;
 	XYZVector zero_max;
@@ -77,6 +147,24 @@ typedef struct SensorData {
 	// Must be set to zero to ensure each function starts from the beginning.
 	uchar func_step;
 
+#if ENABLE_SELF_TEST
+	// Same as func_step, for sensor_self_test(), which also uses func_step.
+	uchar self_test_step;
+#endif
+
+	// Current acquisition profile, set by sensor_set_profile()
+	uchar profile;
+
+	// How many Timer0 overflows (1.365ms) the main loop waits between two
+	// calls to sensor_read_data_registers(), for the current profile.
+	uchar probe_period;
+
+	// Current gain (0 to 7, as in Configuration Register B), changed
+	// automatically by sensor_read_data_registers() (only with
+	// ENABLE_AUTO_GAIN). The data is always rescaled to the units of the
+	// default gain (1.3Ga), which are the units of the calibration.
+	uchar gain;
+
 } SensorData;
 
 
@@ -87,16 +175,83 @@ extern SensorData sensor;
 // EEPROM addresses
 extern uchar EEMEM eeprom_sensor_unused;
 extern SensorEepromData EEMEM eeprom_sensor;
+extern uchar EEMEM eeprom_sensor_profile;
+extern XYZVector EEMEM eeprom_sensor_correction[3];
 
 
 // Functions
 uchar sensor_read_data_registers();
 
+// Ring functions, inline so that the projection/ tools (which don't link
+// sensor.c) can also use them.
+static inline void sensor_ring_push(SensorRing *r, const XYZVector *v, uint16_t timestamp, uchar overflow) {  // {{{
+	// Producer side.
+	uchar head = r->head;
+	SensorSample *s;
+
+	if ((uchar) (head - r->tail) == SENSOR_RING_SIZE) {
+		r->overruns++;
+		return;
+	}
+	s = &r->samples[head & (SENSOR_RING_SIZE - 1)];
+	s->v = *v;
+	s->timestamp = timestamp;
+	s->overflow = overflow;
+	r->head = head + 1;
+}  // }}}
+
+static inline SensorSample* sensor_ring_peek(SensorRing *r) {  // {{{
+	// Consumer side. Returns the oldest sample, or NULL if the ring is empty.
+	// The sample stays valid until sensor_ring_pop().
+	uchar tail = r->tail;
+
+	if (tail == r->head) {
+		return 0;
+	}
+	return &r->samples[tail & (SENSOR_RING_SIZE - 1)];
+}  // }}}
+
+static inline void sensor_ring_pop(SensorRing *r) {  // {{{
+	// Consumer side. Only after sensor_ring_peek() returned a sample.
+	r->tail++;
+}  // }}}
+
+static inline void sensor_ring_flush(SensorRing *r) {  // {{{
+	// Consumer side. Discards all samples.
+	r->tail = r->head;
+}  // }}}
+
+static inline void sensor_ring_clear(SensorRing *r) {  // {{{
+	// Only while neither side is running.
+	r->tail = r->head;
+	r->overruns = 0;
+}  // }}}
+
+#if ENABLE_TWI_RECOVERY
+void sensor_bus_recovered();
+#endif
+
 void sensor_start_continuous_reading();
 void sensor_stop_continuous_reading();
 
+#if ENABLE_ZERO_TRACKING
+void sensor_start_zero_tracking();
+#endif
+
 uchar sensor_read_identification_string(uchar *s);
 
+#if ENABLE_SELF_TEST
+uchar sensor_correction_is_diagonal();
+uchar sensor_self_test();
+#endif
+
+void sensor_calibration_start();
+void sensor_calibration_add_sample();
+uchar sensor_calibration_finish();
+
+void sensor_set_profile(uchar profile);
+
+void sensor_init_defaults();
 void sensor_init_configuration();
 
 
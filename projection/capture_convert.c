@@ -0,0 +1,124 @@
+/* Name: capture_convert.c
+ * Project: atmega8-magnetometer-usb-mouse
+ * Tabsize: 4
+ * License: GNU GPL v2 or GNU GPL v3
+ *
+ * Converts captures between the text format (as used by
+ * linear_eq_conversion and 2011-10-24_values.txt) and the binary format
+ * from capture_format.h.
+ *
+ * Usage:
+ *   capture_convert [-r rate_hz] input.txt output.mcap
+ *   capture_convert -t input.mcap > output.txt
+ *
+ * Text files have no timestamps, so they are calculated from the sample rate
+ * (default: 75Hz, the sensor output rate).
+ *
+ * Several text files can be concatenated by using "-" as input:
+ *   cat 2011-10-24_calibration.txt 2011-10-24_values.txt | capture_convert - values.mcap
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "capture_format.h"
+
+
+static const char *corner_names[4] = {
+	"topleft",
+	"topright",
+	"bottomleft",
+	"bottomright"
+};
+
+
+static int write_text(const CaptureFile *cap, FILE *f) {  // {{{
+	const CaptureHeader *h = cap->header;
+	uint64_t i;
+	int corner;
+
+	for (corner = 0; corner < 4; corner++) {
+		if (h->calibration_flags & (1 << corner)) {
+			fprintf(f, "%s\n%d %d %d\n",
+				corner_names[corner],
+				h->calibration.corners[corner][0],
+				h->calibration.corners[corner][1],
+				h->calibration.corners[corner][2]
+			);
+		}
+	}
+
+	for (i = 0; i < cap->count; i++) {
+		const CaptureRecord *r = &cap->records[i];
+		corner = capture_record_corner(r);
+		if (corner >= 0) {
+			fprintf(f, "%s\n", corner_names[corner]);
+		}
+		fprintf(f, "%d %d %d\n", r->x, r->y, r->z);
+	}
+
+	return fflush(f) == 0;
+}  // }}}
+
+static void usage(const char *argv0) {  // {{{
+	fprintf(stderr,
+		"Usage: %s [-r rate_hz] input.txt output.mcap\n"
+		"       %s -t input.mcap > output.txt\n",
+		argv0, argv0
+	);
+}  // }}}
+
+int main(int argc, char *argv[]) {  // {{{
+	CaptureFile cap;
+	double rate = 1e6 / CAPTURE_DEFAULT_INTERVAL_US;
+	int to_text = 0;
+	int i = 1;
+	int ok;
+
+	if (i < argc && strcmp(argv[i], "-t") == 0) {
+		to_text = 1;
+		i++;
+	} else if (i + 1 < argc && strcmp(argv[i], "-r") == 0) {
+		rate = atof(argv[i + 1]);
+		i += 2;
+	}
+
+	if (argc - i != (to_text ? 1 : 2) || rate <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (to_text) {
+		if (!capture_open(&cap, argv[i])) {
+			return 1;
+		}
+		ok = write_text(&cap, stdout);
+	} else {
+		FILE *in, *out;
+
+		in = strcmp(argv[i], "-") == 0 ? stdin : fopen(argv[i], "r");
+		if (in == NULL) {
+			perror(argv[i]);
+			return 1;
+		}
+		if (!capture_read_text(&cap, in, argv[i], (uint32_t) (1e6 / rate + 0.5))) {
+			return 1;
+		}
+
+		out = fopen(argv[i + 1], "wb");
+		if (out == NULL) {
+			perror(argv[i + 1]);
+			return 1;
+		}
+		ok = capture_write(&cap, out, argv[i + 1]);
+		if (fclose(out) != 0) {
+			ok = 0;
+		}
+	}
+
+	capture_close(&cap);
+	return ok ? 0 : 1;
+}  // }}}
+
+// vim:noexpandtab tabstop=4 shiftwidth=4 foldmethod=marker foldmarker={{{,}}}
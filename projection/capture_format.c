@@ -0,0 +1,289 @@
+/* Name: capture_format.c
+ * Project: atmega8-magnetometer-usb-mouse
+ * Tabsize: 4
+ * License: GNU GPL v2 or GNU GPL v3
+ *
+ * Binary format for magnetometer captures.
+ *
+ * The text format (see 2011-10-24_values.txt) is easy to generate and to
+ * read, but parsing it with scanf() dominates the runtime of the projection
+ * tools for long recordings. The binary format has fixed-size records, and
+ * is mapped directly into memory by capture_open(), so the tools can iterate
+ * over the records without parsing or copying anything.
+ *
+ * Use capture_convert to convert between both formats.
+ */
+
+// For mmap(), fileno() and fmemopen()
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "capture_format.h"
+
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "The capture format is little-endian, and this code reads it directly."
+#endif
+
+// Value that means "overflow", copied from sensor.h
+#define SENSOR_DATA_OVERFLOW -4096
+
+
+static void capture_init_header(CaptureHeader *h, uint64_t count, uint32_t interval_us) {  // {{{
+	memset(h, 0, sizeof(*h));
+	memcpy(h->magic, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE);
+	h->version = CAPTURE_VERSION;
+	h->header_size = sizeof(CaptureHeader);
+	h->record_size = sizeof(CaptureRecord);
+	h->record_count = count;
+	h->sample_interval_us = interval_us;
+}  // }}}
+
+static int capture_use_binary(CaptureFile *cap, const void *data, size_t size, const char *filename) {  // {{{
+	// Points cap at the header and records inside data.
+
+	const CaptureHeader *h = data;
+
+	if (size < sizeof(CaptureHeader)) {
+		fprintf(stderr, "%s: file too short.\n", filename);
+		return 0;
+	}
+	if (h->version != CAPTURE_VERSION
+		|| h->header_size < sizeof(CaptureHeader)
+		|| h->record_size != sizeof(CaptureRecord)
+	) {
+		fprintf(stderr, "%s: unsupported version or record size.\n", filename);
+		return 0;
+	}
+	// header_size comes from the file, and must be checked before the
+	// subtraction below, which would wrap around otherwise.
+	if (h->header_size > size) {
+		fprintf(stderr, "%s: truncated file.\n", filename);
+		return 0;
+	}
+	if (h->record_count > (size - h->header_size) / sizeof(CaptureRecord)) {
+		fprintf(stderr, "%s: truncated file.\n", filename);
+		return 0;
+	}
+
+	cap->header = h;
+	cap->records = (const CaptureRecord*) ((const char*) data + h->header_size);
+	cap->count = h->record_count;
+	return 1;
+}  // }}}
+
+static char* capture_read_all(FILE *f, size_t *size_ptr) {  // {{{
+	size_t size = 0, capacity = 1 << 20;
+	char *buf = malloc(capacity);
+
+	while (buf) {
+		char *bigger;
+
+		size += fread(buf + size, 1, capacity - size, f);
+		if (size < capacity) {
+			break;
+		}
+		capacity *= 2;
+		bigger = realloc(buf, capacity);
+		if (bigger == NULL) {
+			free(buf);
+		}
+		buf = bigger;
+	}
+	*size_ptr = size;
+	return buf;
+}  // }}}
+
+int capture_open(CaptureFile *cap, const char *filename) {  // {{{
+	char magic[CAPTURE_MAGIC_SIZE];
+	struct stat st;
+	FILE *f;
+	int ok = 0;
+
+	memset(cap, 0, sizeof(*cap));
+
+	f = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "r");
+	if (f == NULL || fstat(fileno(f), &st) < 0) {
+		perror(filename);
+		return 0;
+	}
+
+	if (S_ISREG(st.st_mode)) {
+		if (fread(magic, 1, sizeof(magic), f) == sizeof(magic)
+			&& memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) == 0
+		) {
+			cap->map_size = st.st_size;
+			cap->map = mmap(NULL, cap->map_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+			if (cap->map == MAP_FAILED) {
+				cap->map = NULL;
+				perror(filename);
+			} else {
+				ok = capture_use_binary(cap, cap->map, cap->map_size, filename);
+			}
+		} else {
+			rewind(f);
+			ok = capture_read_text(cap, f, filename, CAPTURE_DEFAULT_INTERVAL_US);
+		}
+	} else {
+		// Pipes can't be mapped nor rewinded, so everything is read into
+		// memory first.
+		size_t size;
+		char *data = capture_read_all(f, &size);
+
+		if (data == NULL) {
+			fputs("Out of memory\n", stderr);
+		} else if (size >= CAPTURE_MAGIC_SIZE
+			&& memcmp(data, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE) == 0
+		) {
+			cap->buffer = data;
+			ok = capture_use_binary(cap, data, size, filename);
+		} else {
+			FILE *mem = fmemopen(data, size, "r");
+			if (mem) {
+				ok = capture_read_text(cap, mem, filename, CAPTURE_DEFAULT_INTERVAL_US);
+				fclose(mem);
+			} else {
+				perror(filename);
+			}
+			free(data);
+		}
+	}
+
+	if (f != stdin) {
+		fclose(f);
+	}
+	if (!ok) {
+		capture_close(cap);
+	}
+	return ok;
+}  // }}}
+
+int capture_read_text(CaptureFile *cap, FILE *f, const char *filename, uint32_t interval_us) {  // {{{
+	// Same parsing rules as the scanf() loop from linear_eq_conversion.c.
+
+	CaptureHeader *h;
+	CaptureRecord *records = NULL;
+	uint64_t count = 0, capacity = 0, samples = 0;
+	short int x, y, z;
+	int next_corner = -1;
+
+	memset(cap, 0, sizeof(*cap));
+
+	h = malloc(sizeof(*h));
+	if (h == NULL) {
+		fputs("Out of memory\n", stderr);
+		return 0;
+	}
+	capture_init_header(h, 0, interval_us);
+
+	while (1) {
+		if (fscanf(f, "%hd%hd%hd", &x, &y, &z) == 3) {
+			CaptureRecord *r;
+
+			if (next_corner >= 0 && samples == 0) {
+				// No samples yet, this is the initial calibration.
+				h->calibration.corners[next_corner][0] = x;
+				h->calibration.corners[next_corner][1] = y;
+				h->calibration.corners[next_corner][2] = z;
+				h->calibration_flags |= 1 << next_corner;
+				next_corner = -1;
+				continue;
+			}
+
+			if (count == capacity) {
+				CaptureRecord *bigger;
+
+				capacity = capacity ? capacity * 2 : 4096;
+				bigger = realloc(records, capacity * sizeof(*records));
+				if (bigger == NULL) {
+					fputs("Out of memory\n", stderr);
+					free(records);
+					free(h);
+					return 0;
+				}
+				records = bigger;
+			}
+
+			r = &records[count++];
+			r->x = x;
+			r->y = y;
+			r->z = z;
+			// Corners get the timestamp of the next sample.
+			r->timestamp_us = samples * interval_us;
+			r->flags = CAPTURE_FLAG_SYNTHETIC_TIMESTAMP;
+			if (next_corner >= 0) {
+				r->flags |= 1 << next_corner;
+			} else {
+				if (x == SENSOR_DATA_OVERFLOW || y == SENSOR_DATA_OVERFLOW || z == SENSOR_DATA_OVERFLOW) {
+					r->flags |= CAPTURE_FLAG_OVERFLOW;
+				}
+				samples++;
+			}
+			next_corner = -1;
+		} else {
+			char s[64];
+			if (fscanf(f, " %63s", s) == 1) {
+				if (strcmp(s, "topleft") ==  0) {
+					next_corner = 0;
+				} else if (strcmp(s, "topright") ==  0) {
+					next_corner = 1;
+				} else if (strcmp(s, "bottomleft") ==  0) {
+					next_corner = 2;
+				} else if (strcmp(s, "bottomright") ==  0) {
+					next_corner = 3;
+				}
+			} else {
+				break;
+			}
+		}
+	}
+
+	if (!feof(f)) {
+		fprintf(stderr, "%s: fscanf failed.\n", filename);
+		free(h);
+		free(records);
+		return 0;
+	}
+
+	h->record_count = count;
+	cap->header = h;
+	cap->records = records;
+	cap->count = count;
+	cap->buffer = records;
+	return 1;
+}  // }}}
+
+int capture_write(const CaptureFile *cap, FILE *f, const char *filename) {  // {{{
+	CaptureHeader h;
+
+	// Always writing the current version of the header.
+	capture_init_header(&h, cap->count, cap->header->sample_interval_us);
+	h.calibration_flags = cap->header->calibration_flags;
+	h.calibration = cap->header->calibration;
+
+	if (fwrite(&h, sizeof(h), 1, f) != 1
+		|| (cap->count > 0 && fwrite(cap->records, sizeof(CaptureRecord), cap->count, f) != cap->count)
+		|| fflush(f) != 0
+	) {
+		perror(filename);
+		return 0;
+	}
+	return 1;
+}  // }}}
+
+void capture_close(CaptureFile *cap) {  // {{{
+	if (cap->map) {
+		munmap(cap->map, cap->map_size);
+	} else if (cap->header && (const void*) cap->header != cap->buffer) {
+		// Allocated by capture_read_text()
+		free((void*) cap->header);
+	}
+	free(cap->buffer);
+	memset(cap, 0, sizeof(*cap));
+}  // }}}
+
+// vim:noexpandtab tabstop=4 shiftwidth=4 foldmethod=marker foldmarker={{{,}}}
@@ -0,0 +1,117 @@
+/* Name: capture_format.h
+ * Project: atmega8-magnetometer-usb-mouse
+ * Tabsize: 4
+ * License: GNU GPL v2 or GNU GPL v3
+ *
+ * Binary format for magnetometer captures, and functions for reading and
+ * writing it. See capture_format.c for more information.
+ */
+
+#ifndef __capture_format_h_included__
+#define __capture_format_h_included__
+
+#include <stdint.h>
+#include <stdio.h>
+
+
+// File layout (all values are little-endian, just like on AVR):
+//   CaptureHeader      64 bytes
+//   CaptureRecord[]    12 bytes each, header.record_count records
+//
+// Each record is either a sensor sample, or a calibration corner (exactly
+// like the "topleft" markers from the text format). Corners that appear
+// before the first sample are stored in the header instead.
+
+#define CAPTURE_MAGIC        "MAGCAP\r\n"
+#define CAPTURE_MAGIC_SIZE   8
+#define CAPTURE_VERSION      1
+
+// Default sample interval for text files, which have no timestamps.
+// The sensor is configured for 75Hz by sensor_init_configuration().
+#define CAPTURE_DEFAULT_INTERVAL_US 13333
+
+// CaptureRecord.flags
+// The first 4 bits mean the record is a corner, and not a sample. The bit
+// order is the same as SensorEepromData.corners[].
+#define CAPTURE_FLAG_TOPLEFT     0x0001
+#define CAPTURE_FLAG_TOPRIGHT    0x0002
+#define CAPTURE_FLAG_BOTTOMLEFT  0x0004
+#define CAPTURE_FLAG_BOTTOMRIGHT 0x0008
+#define CAPTURE_FLAG_CORNER_MASK 0x000F
+// One of the axes has the SENSOR_DATA_OVERFLOW value.
+#define CAPTURE_FLAG_OVERFLOW    0x0010
+// The timestamp was not measured, but calculated from the sample interval.
+#define CAPTURE_FLAG_SYNTHETIC_TIMESTAMP 0x0020
+
+// Same layout as SensorEepromData at the AVR EEPROM (where int is 16 bits).
+typedef struct CaptureCalibration {
+	uint8_t zero_compensation;
+	int16_t zero[3];
+	int16_t corners[4][3];
+} __attribute__((packed)) CaptureCalibration;
+
+typedef struct CaptureHeader {
+	char     magic[CAPTURE_MAGIC_SIZE];
+	uint16_t version;
+	// Offset of the first record, for future extensions of the header.
+	uint16_t header_size;
+	uint16_t record_size;
+	// CAPTURE_FLAG_* bits of the corners that are valid in calibration.
+	uint16_t calibration_flags;
+	uint64_t record_count;
+	// Nominal interval between samples, or zero if unknown.
+	uint32_t sample_interval_us;
+	CaptureCalibration calibration;
+	uint8_t  reserved[5];
+} __attribute__((packed)) CaptureHeader;
+
+typedef struct CaptureRecord {
+	int16_t  x, y, z;
+	uint16_t flags;
+	// Microseconds since the beginning of the capture. Wraps around after
+	// about 71 minutes, so only differences between records are meaningful.
+	uint32_t timestamp_us;
+} __attribute__((packed)) CaptureRecord;
+
+// An open capture, either mapped from a binary file or parsed from text.
+typedef struct CaptureFile {
+	const CaptureHeader *header;
+	const CaptureRecord *records;
+	uint64_t count;
+
+	// Private
+	void *map;
+	size_t map_size;
+	void *buffer;
+} CaptureFile;
+
+
+// All functions return 1 on success and 0 on failure, after printing an
+// error message to stderr.
+
+// Opens a binary capture (using mmap, without copying the records), or
+// parses a text file with the default sample interval. "-" is stdin.
+int capture_open(CaptureFile *cap, const char *filename);
+
+// Parses the text format used by linear_eq_conversion.
+int capture_read_text(CaptureFile *cap, FILE *f, const char *filename, uint32_t interval_us);
+
+int capture_write(const CaptureFile *cap, FILE *f, const char *filename);
+
+void capture_close(CaptureFile *cap);
+
+// Returns the corner index (0..3) of a corner record, or -1 for samples.
+static inline int capture_record_corner(const CaptureRecord *r) {
+	switch (r->flags & CAPTURE_FLAG_CORNER_MASK) {
+		case CAPTURE_FLAG_TOPLEFT:     return 0;
+		case CAPTURE_FLAG_TOPRIGHT:    return 1;
+		case CAPTURE_FLAG_BOTTOMLEFT:  return 2;
+		case CAPTURE_FLAG_BOTTOMRIGHT: return 3;
+		default:                       return -1;
+	}
+}
+
+
+#endif  // __capture_format_h_included__
+
+// vim:noexpandtab tabstop=4 shiftwidth=4 foldmethod=marker foldmarker={{{,}}}
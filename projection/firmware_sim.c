@@ -0,0 +1,682 @@
+/* Name: firmware_sim.c
+ * Project: atmega8-magnetometer-usb-mouse
+ * Tabsize: 4
+ * License: GNU GPL v2 or GNU GPL v3
+ *
+ * Runs the whole firmware on a PC: the real main() loop from main.c, and
+ * the real sensor.c, mouseemu.c, buttons.c, keyemu.c and menu.c. A capture
+ * (see capture_format.h) is replayed through a simulated HMC5883L, and the
+ * time from each sample to its mouse report is measured.
+ *
+ * The missing pieces are simulated here, on a virtual clock counted in CPU
+ * cycles:
+ * - Main loop: each iteration (each usbPoll() call) costs "-l" cycles, and
+ *   each mouse report costs "-c" extra cycles for the coordinate
+ *   conversion. Use "make benchmark" from ../firmware to get realistic
+ *   values.
+ * - Timer0: TOV0 is set every 16384 cycles, as configured by main.c.
+ * - Timer1: counts the virtual clock with prescaler = 64.
+ * - TWI_Master: replaced by functions with the same interface, talking to a
+ *   simulated HMC5883L at 400KHz. The bus is busy for the duration of each
+ *   transfer, and queued jobs finish (as if by the TWI interrupt) once
+ *   their transfer is over. The CPU time spent in the TWI interrupt is not
+ *   counted. With "-e", every Nth queued job fails (as if by noise on the
+ *   bus), without reaching the sensor, in order to exercise the retries.
+ *   The bus never gets stuck.
+ * - HMC5883L: its data registers take the value of each sample at the
+ *   sample timestamp. The register pointer works like the real one. The
+ *   capture values are the field at the default gain (1.3Ga), and are
+ *   converted to the gain set in Configuration Register B, with overflow
+ *   outside -2048..2047. With "-k", the field around the zero calibration
+ *   is multiplied by a factor (as if there were a magnet nearby), in order
+ *   to exercise the automatic gain ranging. With "-s", every Nth sample
+ *   gets a spike of SIM_SPIKE on the X axis (as if by a relay switching
+ *   nearby), in order to exercise ENABLE_OUTLIER_REJECTION. When
+ *   built with ENABLE_SENSOR_DRDY=1 (firmware_sim_drdy), the DRDY
+ *   interrupt runs as soon as the simulation notices the new sample, which
+ *   is at most one main loop iteration ("-l") late.
+ * - V-USB: usbInterruptIsReady() is false from usbSetInterrupt() until the
+ *   next poll by the USB host, every USB_CFG_INTR_POLL_INTERVAL ms. The
+ *   interrupts from the USB driver are not simulated.
+ * - EEPROM: the calibration from the capture is "programmed" into the
+ *   eeprom_sensor variable before starting the firmware. Corners found in
+ *   the middle of the capture are copied into sensor.e, as the menu would
+ *   do. The acquisition profile (see sensor.h) is programmed from "-p".
+ *   Whatever the profile, the samples keep the timing of the capture.
+ * - Buttons: the switch is held down (mouse mode) for the whole run. The
+ *   first sample appears after a warm-up period, after the switch has
+ *   been debounced and the pointer is no longer frozen.
+ *
+ * For each sample, the latency is measured from its timestamp (when the
+ * sensor has it ready) to the moment its report is queued by
+ * usbSetInterrupt(), and to the moment the USB host fetches it. Samples
+ * that never generate a report (out-of-bounds, overflow, or overwritten by
+ * the next sample before being read) are only counted, as are the samples
+ * dropped because the sample ring (see sensor.h) was full.
+ *
+ * Usage:
+ *   firmware_sim [-l loop_cycles] [-c conversion_cycles] [-p profile] [-k factor] [-e N] [-s N] [-v] capture
+ *
+ * With -v, prints one line per report: sample index, virtual time (us)
+ * when it was queued, latency (us), X and Y.
+ */
+
+// For getopt()
+#define _DEFAULT_SOURCE
+
+#include <math.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "capture_format.h"
+
+// The real main() from the firmware, renamed, so that it can be called (and
+// left with longjmp) by the simulation.
+#define main firmware_main
+#include "../firmware/main.c"
+#undef main
+
+
+// Virtual time  {{{
+
+#define CYCLES_PER_US (F_CPU / 1000000)
+
+// TCCR0 = 3 means prescaler = 64
+#define TIMER0_OVERFLOW_CYCLES (64 * 256L)
+
+// TWI_TWBR = 7 gives 400KHz at 12MHz, or 30 cycles per bit. Each byte
+// takes 9 bits, plus the START and STOP conditions.
+#define TWI_CYCLES_PER_BIT (16 + 2 * TWI_TWBR)
+
+#define USB_POLL_CYCLES (USB_CFG_INTR_POLL_INTERVAL * 1000L * CYCLES_PER_US)
+
+// Time before the first sample. The switch takes about 11ms to be
+// debounced, and then the pointer is frozen for 64 ticks (87ms), just like
+// after a click.
+#define WARMUP_CYCLES (150 * 1000L * CYCLES_PER_US)
+
+static uint64_t now;
+static uint64_t end_time;
+static uint64_t iterations;
+
+static jmp_buf sim_end;
+
+static long loop_cycles = 400;
+static long conversion_cycles = 5000;
+static int profile = SENSOR_PROFILE_LOW_NOISE;
+static double field_factor = 1;
+static long fail_every = 0;
+static long spike_every = 0;
+static int verbose = 0;
+
+// }}}
+
+// Simulated hardware state  {{{
+
+// Registers declared by host/avr/io.h
+volatile unsigned char PORTB, DDRB, PINB;
+volatile unsigned char PORTC, DDRC, PINC;
+volatile unsigned char PORTD, DDRD, PIND;
+volatile unsigned char TCCR0, TCNT0, TIMSK, TIFR;
+volatile unsigned char MCUCR, GICR, GIFR;
+volatile unsigned char TCCR1A, TCCR1B;
+volatile unsigned short TCNT1;
+
+// Declared by host/usbdrv.h
+uchar *usbMsgPtr;
+
+typedef struct SimSample {
+	// Capture record
+	uint64_t record;
+	uint64_t acquired;
+	// Zero if never happened
+	uint64_t queued;
+	uint64_t delivered;
+	uchar read;
+} SimSample;
+
+static CaptureFile cap;
+static uint64_t *record_times;
+static SimSample *samples;
+static long samples_count;
+
+// Next capture record to be applied to the sensor
+static uint64_t next_record;
+// Sample currently in the sensor data registers
+static long sensor_sample = -1;
+
+// HMC5883L registers, starting with the power-on defaults of the
+// configuration registers A and B and the mode register (single-shot)
+static uchar hmc_regs[13] = {0x10, 0x20, 0x01};
+static uchar hmc_pointer;
+static long hmc_gain_changes;
+
+// Last sample read by the firmware
+static long delivered_sample = -1;
+
+static uchar usb_pending;
+static long usb_pending_sample;
+static uint64_t usb_next_poll;
+
+// }}}
+
+
+// Simulated HMC5883L  {{{
+
+// Added to the X axis by "-s", in units of the default gain.
+#define SIM_SPIKE 200
+
+static void hmc_set_data(uchar reg, int value, int zero) {  // {{{
+	// Same values as SENSOR_GAIN_SCALE_* in sensor.c
+	static const double scales[8] = {0.73, 0.92, 1.22, 1.52, 2.27, 2.56, 3.03, 4.35};
+	double field = zero + (value - zero) * field_factor;
+	long raw = lround(field * scales[1] / scales[hmc_regs[1] >> 5]);
+
+	if (raw < -2048 || raw > 2047) {
+		raw = SENSOR_DATA_OVERFLOW;
+	}
+	hmc_regs[reg] = (uint16_t) raw >> 8;
+	hmc_regs[reg + 1] = raw;
+}  // }}}
+
+#if ENABLE_SENSOR_DRDY
+// DRDY interrupt, from sensor.c
+void INT1_vect(void);
+#endif
+
+static void sensor_advance() {  // {{{
+	// Applies all capture records up to the current time.
+	uchar drdy = 0;
+
+	while (next_record < cap.count && record_times[next_record] <= now) {
+		const CaptureRecord *r = &cap.records[next_record];
+		int corner = capture_record_corner(r);
+
+		if (corner >= 0) {
+			sensor.e.corners[corner].x = r->x;
+			sensor.e.corners[corner].y = r->y;
+			sensor.e.corners[corner].z = r->z;
+			sensor.corners_changed = 1;
+		} else {
+			sensor_sample++;
+			// Data registers: X, Z, Y, MSB first
+			hmc_set_data(3,
+				r->x + (spike_every && (sensor_sample + 1) % spike_every == 0 ? SIM_SPIKE : 0),
+				cap.header->calibration.zero[0]);
+			hmc_set_data(5, r->z, cap.header->calibration.zero[2]);
+			hmc_set_data(7, r->y, cap.header->calibration.zero[1]);
+			drdy = 1;
+		}
+		next_record++;
+	}
+
+#if ENABLE_SENSOR_DRDY
+	// DRDY pulse, if INT1 is enabled. Only after updating the registers, as
+	// the interrupt reads them (and calls this function again).
+	if (drdy && (GICR & (1 << INT1))) {
+		INT1_vect();
+	}
+#else
+	(void) drdy;
+#endif
+}  // }}}
+
+static uchar hmc_read_next() {  // {{{
+	uchar value = hmc_regs[hmc_pointer];
+
+	// After the last data register, the pointer goes back to the first
+	// one. Otherwise, it wraps around after the last register.
+	if (hmc_pointer == 8) {
+		hmc_pointer = 3;
+	} else if (hmc_pointer >= 12) {
+		hmc_pointer = 0;
+	} else {
+		hmc_pointer++;
+	}
+	return value;
+}  // }}}
+
+// }}}
+
+// Stand-ins for avr315/TWI_Master.c  {{{
+
+union TWI_statusReg TWI_statusReg;
+TWI_Counters TWI_counters;
+
+static uchar twi_buf[TWI_BUFFER_SIZE];
+static uint64_t twi_busy_until;
+
+// Queued jobs, in bus order, with the time each one finishes
+static TWI_Job *twi_jobs[TWI_QUEUE_SIZE];
+static uint64_t twi_jobs_end[TWI_QUEUE_SIZE];
+static long twi_jobs_sample[TWI_QUEUE_SIZE];
+static uchar twi_jobs_failed[TWI_QUEUE_SIZE];
+static uchar twi_jobs_count;
+static long twi_jobs_total;
+
+static void twi_wait() {  // {{{
+	// The real driver spins until the previous transfer has finished.
+	if (now < twi_busy_until) {
+		now = twi_busy_until;
+	}
+}  // }}}
+
+static long twi_transfer(const uchar *write_data, uchar write_size, uchar *read_data, uchar read_size) {  // {{{
+	// Talks to the HMC5883L: the first written byte sets the register
+	// pointer, the next ones are written to the registers, and then
+	// read_size registers are read. Returns the sample that has been read
+	// from the data registers, or -1.
+	long sample = -1;
+	uchar i;
+
+	sensor_advance();
+
+	if (write_size > 0) {
+		hmc_pointer = write_data[0];
+		for (i = 1; i < write_size; i++) {
+			// Only the configuration registers are writable.
+			if (hmc_pointer <= 2) {
+				if (hmc_pointer == 1 && hmc_regs[1] != write_data[i]) {
+					hmc_gain_changes++;
+				}
+				hmc_regs[hmc_pointer] = write_data[i];
+			}
+			hmc_read_next();
+		}
+	}
+	for (i = 0; i < read_size; i++) {
+		if (hmc_pointer >= 3 && hmc_pointer <= 8) {
+			sample = sensor_sample;
+		}
+		read_data[i] = hmc_read_next();
+	}
+	return sample;
+}  // }}}
+
+static void twi_complete_jobs() {  // {{{
+	// Finishes the jobs whose transfer has ended, as the TWI interrupt would.
+	while (twi_jobs_count > 0 && twi_jobs_end[0] <= now) {
+		TWI_Job *job = twi_jobs[0];
+		long sample = twi_jobs_sample[0];
+		uchar failed = twi_jobs_failed[0];
+
+		// Timer1 (prescaler = 64) at the end of the transfer
+		TCNT1 = twi_jobs_end[0] / 64;
+
+		twi_jobs_count--;
+		memmove(twi_jobs, twi_jobs + 1, twi_jobs_count * sizeof(*twi_jobs));
+		memmove(twi_jobs_end, twi_jobs_end + 1, twi_jobs_count * sizeof(*twi_jobs_end));
+		memmove(twi_jobs_sample, twi_jobs_sample + 1, twi_jobs_count * sizeof(*twi_jobs_sample));
+		memmove(twi_jobs_failed, twi_jobs_failed + 1, twi_jobs_count * sizeof(*twi_jobs_failed));
+
+		if (failed) {
+			TWI_statusReg.lastTransOK = 0;
+			TWI_counters.errors++;
+			job->status = TWI_JOB_ERROR;
+		} else {
+			if (sample >= 0) {
+				samples[sample].read = 1;
+				delivered_sample = sample;
+			}
+			TWI_statusReg.lastTransOK = 1;
+			job->status = TWI_JOB_DONE;
+		}
+		if (job->callback) {
+			job->callback(job);
+		}
+	}
+}  // }}}
+
+void TWI_Master_Initialise(void) {  // {{{
+	TWI_statusReg.all = 0;
+}  // }}}
+
+unsigned char TWI_Transceiver_Busy(void) {  // {{{
+	return now < twi_busy_until;
+}  // }}}
+
+unsigned char TWI_Get_State_Info(void) {  // {{{
+	twi_wait();
+	return TWI_NO_STATE;
+}  // }}}
+
+void TWI_Start_Transceiver_With_Data(unsigned char *msg, unsigned char msgSize) {  // {{{
+	twi_wait();
+	twi_complete_jobs();
+
+	twi_buf[0] = msg[0];
+	if (msg[0] & (1 << TWI_READ_BIT)) {
+		twi_transfer(NULL, 0, twi_buf + 1, msgSize - 1);
+	} else {
+		twi_transfer(msg + 1, msgSize - 1, NULL, 0);
+	}
+
+	twi_busy_until = now + TWI_CYCLES_PER_BIT * (9 * msgSize + 2);
+	TWI_statusReg.lastTransOK = 1;
+}  // }}}
+
+unsigned char TWI_Get_Data_From_Transceiver(unsigned char *msg, unsigned char msgSize) {  // {{{
+	uchar i;
+
+	twi_wait();
+	for (i = 0; i < msgSize; i++) {
+		msg[i] = twi_buf[i];
+	}
+	return TWI_statusReg.lastTransOK;
+}  // }}}
+
+unsigned char TWI_Enqueue_Job(TWI_Job *job) {  // {{{
+	// The whole job is a single transfer, with a repeated START between
+	// writing and reading. The registers are read when the job starts.
+	uint64_t start = now > twi_busy_until ? now : twi_busy_until;
+	// START and STOP
+	uint64_t bits = 2;
+
+	if (twi_jobs_count == TWI_QUEUE_SIZE) {
+		return 0;
+	}
+	// Same as the ISR: SLA+W is skipped if there is only reading to do.
+	if (job->write_size > 0 || job->read_size == 0) {
+		bits += 9 * (1 + job->write_size);
+		if (job->read_size > 0) {
+			// Repeated START
+			bits += 1;
+		}
+	}
+	if (job->read_size > 0) {
+		bits += 9 * (1 + job->read_size);
+	}
+
+	twi_busy_until = start + TWI_CYCLES_PER_BIT * bits;
+
+	job->status = TWI_JOB_PENDING;
+	twi_jobs[twi_jobs_count] = job;
+	twi_jobs_end[twi_jobs_count] = twi_busy_until;
+	twi_jobs_total++;
+	if (fail_every > 0 && twi_jobs_total % fail_every == 0) {
+		twi_jobs_failed[twi_jobs_count] = 1;
+		twi_jobs_sample[twi_jobs_count] = -1;
+	} else {
+		twi_jobs_failed[twi_jobs_count] = 0;
+		twi_jobs_sample[twi_jobs_count] = twi_transfer(job->write_data, job->write_size, job->read_data, job->read_size);
+	}
+	twi_jobs_count++;
+	return 1;
+}  // }}}
+
+unsigned char TWI_Check_Bus(void) {  // {{{
+	return 0;
+}  // }}}
+
+// }}}
+
+// Stand-ins for int_eeprom.c and V-USB  {{{
+
+void int_eeprom_write_block(const void *src, void *address, unsigned char size) {  // {{{
+	// On the PC, EEMEM variables are ordinary variables.
+	memcpy(address, src, size);
+}  // }}}
+
+unsigned char int_eeprom_busy(void) {  // {{{
+	return 0;
+}  // }}}
+
+void usbInit(void) {  // {{{
+	usb_next_poll = USB_POLL_CYCLES;
+}  // }}}
+
+void usbPoll(void) {  // {{{
+	// Called once per main loop iteration, so this is where the virtual
+	// clock moves forward.
+	uint64_t before = now;
+
+	now += loop_cycles;
+	iterations++;
+
+	// The firmware clears TOV0 right after reading it, so it is enough to
+	// set it for one iteration.
+	if (now / TIMER0_OVERFLOW_CYCLES != before / TIMER0_OVERFLOW_CYCLES) {
+		TIFR = 1 << TOV0;
+	} else {
+		TIFR = 0;
+	}
+
+	// USB host polling the interrupt endpoint
+	while (usb_next_poll <= now) {
+		if (usb_pending) {
+			if (usb_pending_sample >= 0) {
+				samples[usb_pending_sample].delivered = usb_next_poll;
+			}
+			usb_pending = 0;
+		}
+		usb_next_poll += USB_POLL_CYCLES;
+	}
+
+	TCNT1 = now / 64;
+
+	sensor_advance();
+	twi_complete_jobs();
+
+	if (now >= end_time) {
+		longjmp(sim_end, 1);
+	}
+}  // }}}
+
+uchar usbInterruptIsReady(void) {  // {{{
+	return !usb_pending;
+}  // }}}
+
+void usbSetInterrupt(uchar *data, uchar len) {  // {{{
+	(void) len;
+
+	usb_pending = 1;
+	usb_pending_sample = -1;
+
+	if (data != (uchar *) &mouse_report) {
+		return;
+	}
+
+	// The conversion has just been done by mouse_prepare_next_report().
+	now += conversion_cycles;
+
+	// Only the first report of each sample is counted. The same sample may
+	// be read twice, as the firmware polls the sensor at twice its rate.
+	if (delivered_sample >= 0 && samples[delivered_sample].queued == 0) {
+		SimSample *s = &samples[delivered_sample];
+
+		s->queued = now;
+		usb_pending_sample = delivered_sample;
+
+		if (verbose) {
+			printf("%ld %.1f %.1f %d %d\n",
+				delivered_sample,
+				(double) now / CYCLES_PER_US,
+				(double) (now - s->acquired) / CYCLES_PER_US,
+				mouse_report.x,
+				mouse_report.y
+			);
+		}
+	}
+}  // }}}
+
+// }}}
+
+
+// Setup and statistics  {{{
+
+static int load_capture(const char *filename) {  // {{{
+	const CaptureHeader *h;
+	uint64_t i, t = WARMUP_CYCLES;
+	uint32_t prev_ts = 0;
+
+	if (!capture_open(&cap, filename)) {
+		return 0;
+	}
+
+	record_times = malloc(cap.count * sizeof(*record_times));
+	samples = calloc(cap.count, sizeof(*samples));
+	if ((cap.count && record_times == NULL) || (cap.count && samples == NULL)) {
+		fputs("Out of memory\n", stderr);
+		return 0;
+	}
+
+	// Timestamps wrap around, only the differences are meaningful.
+	for (i = 0; i < cap.count; i++) {
+		const CaptureRecord *r = &cap.records[i];
+		if (i > 0) {
+			t += (uint64_t) (uint32_t) (r->timestamp_us - prev_ts) * CYCLES_PER_US;
+		}
+		prev_ts = r->timestamp_us;
+		record_times[i] = t;
+
+		if (capture_record_corner(r) < 0) {
+			samples[samples_count].record = i;
+			samples[samples_count].acquired = t;
+			samples_count++;
+		}
+	}
+	// Enough time for the last report to reach the USB host.
+	end_time = t + 3 * USB_POLL_CYCLES;
+
+	// Programming the EEPROM
+	h = cap.header;
+	eeprom_sensor.zero_compensation = h->calibration.zero_compensation;
+	eeprom_sensor.zero.x = h->calibration.zero[0];
+	eeprom_sensor.zero.y = h->calibration.zero[1];
+	eeprom_sensor.zero.z = h->calibration.zero[2];
+	for (i = 0; i < 4; i++) {
+		if (h->calibration_flags & (1 << i)) {
+			eeprom_sensor.corners[i].x = h->calibration.corners[i][0];
+			eeprom_sensor.corners[i].y = h->calibration.corners[i][1];
+			eeprom_sensor.corners[i].z = h->calibration.corners[i][2];
+		}
+	}
+
+	return 1;
+}  // }}}
+
+static int compare_uint64(const void *a, const void *b) {  // {{{
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+	return (x > y) - (x < y);
+}  // }}}
+
+static void print_latency(const char *name, int delivered) {  // {{{
+	uint64_t *values = malloc((samples_count + 1) * sizeof(*values));
+	uint64_t sum = 0;
+	long i, n = 0;
+
+	for (i = 0; i < samples_count; i++) {
+		uint64_t t = delivered ? samples[i].delivered : samples[i].queued;
+		if (t) {
+			values[n] = t - samples[i].acquired;
+			sum += values[n];
+			n++;
+		}
+	}
+	if (n == 0) {
+		printf("%-20s %9s\n", name, "-");
+		free(values);
+		return;
+	}
+	qsort(values, n, sizeof(*values), compare_uint64);
+
+	#define US(cycles) ((double) (cycles) / CYCLES_PER_US)
+	printf("%-20s %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+		name,
+		US(values[0]),
+		US(sum) / n,
+		US(values[n / 2]),
+		US(values[(n * 95) / 100]),
+		US(values[n - 1])
+	);
+	#undef US
+	free(values);
+}  // }}}
+
+static void print_statistics() {  // {{{
+	long i, read = 0, queued = 0, delivered = 0;
+
+	for (i = 0; i < samples_count; i++) {
+		read += samples[i].read;
+		queued += samples[i].queued != 0;
+		delivered += samples[i].delivered != 0;
+	}
+
+	printf("# loop %ld cycles, conversion %ld cycles, profile %d, field x%g, %llu iterations, %.1f ms\n",
+		loop_cycles, conversion_cycles, profile, field_factor,
+		(unsigned long long) iterations,
+		(double) now / CYCLES_PER_US / 1000
+	);
+	printf("samples              %9ld\n", samples_count);
+	printf("read by firmware     %9ld\n", read);
+	printf("ring overruns        %9u\n", sensor.ring.overruns);
+	printf("gain changes         %9ld\n", hmc_gain_changes);
+	printf("TWI errors           %9u\n", TWI_counters.errors);
+	printf("TWI retries          %9u\n", TWI_counters.retries);
+#if ENABLE_OUTLIER_REJECTION
+	printf("outliers rejected    %9u\n", mouse_outliers.rejected);
+#endif
+	printf("queued as report     %9ld\n", queued);
+	printf("fetched by host      %9ld\n", delivered);
+	printf("%-20s %9s %9s %9s %9s %9s\n", "latency (us)", "min", "avg", "median", "95%", "max");
+	print_latency("sample -> queued", 0);
+	print_latency("sample -> host", 1);
+}  // }}}
+
+static void usage(const char *argv0) {  // {{{
+	fprintf(stderr,
+		"Usage: %s [-l loop_cycles] [-c conversion_cycles] [-p profile] [-k factor] [-e N] [-s N] [-v] capture\n",
+		argv0
+	);
+}  // }}}
+
+// }}}
+
+
+int main(int argc, char *argv[]) {  // {{{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "l:c:p:k:e:s:v")) != -1) {
+		switch (opt) {
+			case 'l': loop_cycles = atol(optarg); break;
+			case 'c': conversion_cycles = atol(optarg); break;
+			case 'p': profile = atoi(optarg); break;
+			case 'k': field_factor = atof(optarg); break;
+			case 'e': fail_every = atol(optarg); break;
+			case 's': spike_every = atol(optarg); break;
+			case 'v': verbose = 1; break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (optind + 1 != argc || loop_cycles <= 0 || conversion_cycles < 0 || fail_every < 0 || spike_every < 0
+		|| profile < 0 || profile >= SENSOR_TOTAL_PROFILES
+	) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (!load_capture(argv[optind])) {
+		return 1;
+	}
+	eeprom_sensor_profile = profile;
+
+	// Buttons read as zero when pressed. Holding the switch down.
+	PINC = 0xFF & ~BUTTON_SWITCH;
+
+	if (setjmp(sim_end) == 0) {
+		firmware_main();
+	}
+
+	print_statistics();
+	capture_close(&cap);
+	return 0;
+}  // }}}
+
+// vim:noexpandtab tabstop=4 shiftwidth=4 foldmethod=marker foldmarker={{{,}}}
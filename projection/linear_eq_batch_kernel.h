@@ -0,0 +1,200 @@
+/* Name: linear_eq_batch_kernel.h
+ * Project: atmega8-magnetometer-usb-mouse
+ * Tabsize: 4
+ * License: GNU GPL v2 or GNU GPL v3
+ *
+ * Vectorized versions of mouse_axes_linear_equation_system() and
+ * mouse_axes_homography() from linear_eq_conversion.c, used by its batch
+ * mode (-b).
+ *
+ * This file is a template: it is included once for each vector width, with
+ * these macros defined before the #include:
+ *   KERNEL_LANES   - how many samples are processed at once (4 or 8)
+ *   KERNEL_SUFFIX  - appended to the function names (e.g. _sse, _avx2)
+ *   KERNEL_ATTR    - function attributes (e.g. a target("avx2") attribute)
+ *
+ * Each lane runs exactly the same float operations, in the same order, as
+ * the per-sample code. There is no FMA, and round() is done by truncating
+ * and then looking at the fraction. Thus the results are bit-identical to
+ * the per-sample path. Lanes that fail (singular matrix, out-of-bounds) keep
+ * computing garbage, but are flagged as failed in ok[].
+ *
+ * The input arrays must have room for a multiple of KERNEL_LANES samples.
+ */
+
+#define KERNEL_CONCAT2(a, b) a##b
+#define KERNEL_CONCAT(a, b) KERNEL_CONCAT2(a, b)
+#define KERNEL_NAME(name) KERNEL_CONCAT(name, KERNEL_SUFFIX)
+
+// Vector types  {{{
+#define vf KERNEL_NAME(vf)
+#define vi KERNEL_NAME(vi)
+typedef float vf __attribute__((vector_size(KERNEL_LANES * 4)));
+typedef int   vi __attribute__((vector_size(KERNEL_LANES * 4)));
+// }}}
+
+// Helpers  {{{
+static inline KERNEL_ATTR vf KERNEL_NAME(vload)(const float *p) {
+	vf v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline KERNEL_ATTR vf KERNEL_NAME(vabs)(vf a) {
+	return (vf)((vi)a & 0x7FFFFFFF);
+}
+
+// Returns a where mask is set, b elsewhere.
+static inline KERNEL_ATTR vf KERNEL_NAME(vselect)(vi mask, vf a, vf b) {
+	return (vf)((mask & (vi)a) | (~mask & (vi)b));
+}
+
+// Same as (int) round(a * 32767), for 0.0 <= a <= 1.0.
+static inline KERNEL_ATTR vi KERNEL_NAME(vround_scale)(vf a) {
+	vf scaled = a * 32767.0f;
+	vi truncated = __builtin_convertvector(scaled, vi);
+	vf fraction = scaled - __builtin_convertvector(truncated, vf);
+	// The comparison yields -1 for true.
+	return truncated - (fraction >= 0.5f);
+}
+
+static inline KERNEL_ATTR void KERNEL_NAME(vstore_results)(
+	int i, vi ok_mask, vf u, vf v,
+	short *out_x, short *out_y, unsigned char *ok
+) {
+	vi final_x, final_y;
+	uchar lane;
+
+	final_x = KERNEL_NAME(vround_scale)(u);
+	final_y = KERNEL_NAME(vround_scale)(v);
+
+	for (lane = 0; lane < KERNEL_LANES; lane++) {
+		out_x[i + lane] = final_x[lane];
+		out_y[i + lane] = final_y[lane];
+		ok[i + lane] = ok_mask[lane] != 0;
+	}
+}
+// }}}
+
+static KERNEL_ATTR void KERNEL_NAME(batch_linear_equation_system)(  // {{{
+	const BatchCalibration *cal,
+	const float *px, const float *py, const float *pz, int count,
+	short *out_x, short *out_y, unsigned char *ok
+) {
+#define W 4
+#define H 3
+	int i;
+
+	for (i = 0; i < count; i += KERNEL_LANES) {
+		vf m[H][W];
+		vf sol1, sol2;
+		vi ok_mask;
+		uchar y, x;
+
+		// Same as fill_matrix_from_sensor()
+		m[0][0] = -KERNEL_NAME(vload)(px + i);
+		m[1][0] = -KERNEL_NAME(vload)(py + i);
+		m[2][0] = -KERNEL_NAME(vload)(pz + i);
+		for (y = 0; y < H; y++) {
+			for (x = 1; x < W; x++) {
+				m[y][x] = (vf){} + cal->m[y][x];
+			}
+		}
+
+		ok_mask = (vi){} - 1;
+
+		// Gauss-Jordan elimination, with a different pivot row per lane.
+		for (y = 0; y < H; y++) {
+			vi maxrow;
+			vf pivot;
+			uchar y2;
+
+			maxrow = (vi){} + y;
+			pivot = KERNEL_NAME(vabs)(m[y][y]);
+			for (y2 = y + 1; y2 < H; y2++) {
+				vf newpivot;
+				vi greater;
+				newpivot = KERNEL_NAME(vabs)(m[y2][y]);
+				greater = newpivot > pivot;
+				pivot = KERNEL_NAME(vselect)(greater, newpivot, pivot);
+				maxrow = (greater & y2) | (~greater & maxrow);
+			}
+			// Singular
+			ok_mask &= pivot >= 0.0009765625f;  // 2**-10
+
+			// Swapping rows. Columns before y are not used anymore.
+			for (y2 = y + 1; y2 < H; y2++) {
+				vi swap = maxrow == y2;
+				for (x = y; x < W; x++) {
+					vf tmp = m[y][x];
+					m[y][x] = KERNEL_NAME(vselect)(swap, m[y2][x], m[y][x]);
+					m[y2][x] = KERNEL_NAME(vselect)(swap, tmp, m[y2][x]);
+				}
+			}
+
+			// Eliminating the column y. Column y itself is not used anymore.
+			for (y2 = y + 1; y2 < H; y2++) {
+				vf c = m[y2][y] / m[y][y];
+				for (x = y + 1; x < W; x++) {
+					m[y2][x] -= m[y][x] * c;
+				}
+			}
+		}
+
+		sol2 = m[2][3] / m[2][2];
+		sol1 = m[1][3] / m[1][1] - m[1][2] * sol2 / m[1][1];
+
+		// Out-of-bounds
+		ok_mask &= sol1 >= 0.0f;
+		ok_mask &= sol1 <= 1.0f;
+		ok_mask &= sol2 >= 0.0f;
+		ok_mask &= sol2 <= 1.0f;
+
+		KERNEL_NAME(vstore_results)(i, ok_mask, sol1, sol2, out_x, out_y, ok);
+	}
+#undef W
+#undef H
+}  // }}}
+
+static KERNEL_ATTR void KERNEL_NAME(batch_homography)(  // {{{
+	const BatchCalibration *cal,
+	const float *px, const float *py, const float *pz, int count,
+	short *out_x, short *out_y, unsigned char *ok
+) {
+	int i;
+
+	for (i = 0; i < count; i += KERNEL_LANES) {
+		vf p0, p1, p2;
+		vf u, v, w;
+		vi ok_mask;
+
+		p0 = KERNEL_NAME(vload)(px + i);
+		p1 = KERNEL_NAME(vload)(py + i);
+		p2 = KERNEL_NAME(vload)(pz + i);
+
+		// Same as dot_product()
+		w = p0 * cal->h[2][0] + p1 * cal->h[2][1] + p2 * cal->h[2][2];
+		// Singular
+		ok_mask = KERNEL_NAME(vabs)(w) >= 1.0f;
+
+		w = 1.0f / w;
+		u = (p0 * cal->h[0][0] + p1 * cal->h[0][1] + p2 * cal->h[0][2]) * w;
+		v = (p0 * cal->h[1][0] + p1 * cal->h[1][1] + p2 * cal->h[1][2]) * w;
+
+		// Out-of-bounds
+		ok_mask &= u >= 0.0f;
+		ok_mask &= u <= 1.0f;
+		ok_mask &= v >= 0.0f;
+		ok_mask &= v <= 1.0f;
+
+		KERNEL_NAME(vstore_results)(i, ok_mask, u, v, out_x, out_y, ok);
+	}
+}  // }}}
+
+#undef vf
+#undef vi
+#undef KERNEL_NAME
+#undef KERNEL_CONCAT
+#undef KERNEL_CONCAT2
+
+// vim:noexpandtab tabstop=4 shiftwidth=4 foldmethod=marker foldmarker={{{,}}}
@@ -1,6 +1,13 @@
+// For clock_gettime()
+#define _POSIX_C_SOURCE 199309L
+
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <time.h>
+
+#include "capture_format.h"
 
 // Compatibility begin  {{{
 
@@ -267,15 +274,553 @@ static uchar mouse_axes_linear_equation_system() {  // {{{
 #undef H
 }  // }}}
 
+// Four-corner projective mapping (homography), copied from mouseemu.c
+// (with ENABLE_HOMOGRAPHY=1 and ENABLE_FIXED_POINT=0).  {{{
+// See mouse_update_projection_basis() in mouseemu.c for the math.
+
+static float homography[3][3];
+static uchar homography_needs_update = 1;
+
+static void cross_product(float out[3], const float a[3], const float b[3]) {  // {{{
+	out[0] = a[1] * b[2] - a[2] * b[1];
+	out[1] = a[2] * b[0] - a[0] * b[2];
+	out[2] = a[0] * b[1] - a[1] * b[0];
+}  // }}}
+
+static float dot_product(const float a[3], const float b[3]) {  // {{{
+	return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}  // }}}
+
+static void update_homography() {  // {{{
+	float corners[4][3];
+	float crosses[3][3];
+	float k[3], products[3];
+	uchar i, j;
+
+	for (i = 0; i < 4; i++) {
+		corners[i][0] = sensor.e.corners[i].x;
+		corners[i][1] = sensor.e.corners[i].y;
+		corners[i][2] = sensor.e.corners[i].z;
+	}
+
+	cross_product(crosses[0], corners[1], corners[2]);
+	cross_product(crosses[1], corners[2], corners[0]);
+	cross_product(crosses[2], corners[0], corners[1]);
+
+	for (i = 0; i < 3; i++) {
+		k[i] = dot_product(corners[3], crosses[i]);
+	}
+
+	products[0] = k[1] * k[2];
+	products[1] = k[0] * k[2];
+	products[2] = k[0] * k[1];
+
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < 3; j++) {
+			crosses[i][j] *= products[i];
+		}
+	}
+
+	for (j = 0; j < 3; j++) {
+		homography[0][j] = crosses[1][j];
+		homography[1][j] = crosses[2][j];
+		homography[2][j] = crosses[1][j] + crosses[2][j] - crosses[0][j];
+	}
+}  // }}}
+
+static uchar mouse_axes_homography() {  // {{{
+	float p[3];
+	float u, v, w;
+
+	int final_x, final_y;
+
+	if (homography_needs_update) {
+		homography_needs_update = 0;
+		update_homography();
+	}
+
+	p[0] = sensor.data.x;
+	p[1] = sensor.data.y;
+	p[2] = sensor.data.z;
+
+	w = dot_product(p, homography[2]);
+	if (fabs(w) < 1.0) {
+		// Singular
+		return 0;
+	}
+
+	w = 1.0 / w;
+	u = dot_product(p, homography[0]) * w;
+	v = dot_product(p, homography[1]) * w;
+
+	if (
+		   u < 0.0
+		|| u > 1.0
+		|| v < 0.0
+		|| v > 1.0
+	) {
+		// Out-of-bounds
+		return 0;
+	}
+
+	final_x = (int) round(u * 32767);
+	final_y = (int) round(v * 32767);
+
+	mouse_report.x = final_x;
+	mouse_report.y = final_y;
+
+	return 1;
+}  // }}}
+
+// }}}
+
 #undef int
 //#undef float
 
 
+// Batch mode  {{{
+// Instead of converting one vector at a time, the whole input is read at
+// once, and the samples are stored in structure-of-arrays buffers. Each
+// buffer is then converted by a vectorized kernel (see
+// linear_eq_batch_kernel.h), and the reports are printed afterwards.
+// The output is exactly the same as the per-sample mode.
+
+// Must be a multiple of the widest kernel.
+#define BATCH_SIZE 4096
+
+// The calibration values, pre-converted to float.
+typedef struct BatchCalibration {
+	// Same as the matrix from fill_matrix_from_sensor(), column 0 is unused.
+	float m[3][4];
+	// Same as homography[][]
+	float h[3][3];
+} BatchCalibration;
+
+typedef void (*BatchKernel)(
+	const BatchCalibration *cal,
+	const float *px, const float *py, const float *pz, int count,
+	short *out_x, short *out_y, unsigned char *ok
+);
+
+// Scalar fallback, which just calls the per-sample functions.  {{{
+static void batch_scalar(
+	uchar (*convert)(),
+	const float *px, const float *py, const float *pz, int count,
+	short *out_x, short *out_y, unsigned char *ok
+) {
+	MouseReport previous_report = mouse_report;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		sensor.data.x = px[i];
+		sensor.data.y = py[i];
+		sensor.data.z = pz[i];
+		ok[i] = convert();
+		out_x[i] = mouse_report.x;
+		out_y[i] = mouse_report.y;
+	}
+
+	// The report is updated later, by batch_flush().
+	mouse_report = previous_report;
+}
+
+static void batch_linear_equation_system_scalar(
+	const BatchCalibration *cal,
+	const float *px, const float *py, const float *pz, int count,
+	short *out_x, short *out_y, unsigned char *ok
+) {
+	batch_scalar(mouse_axes_linear_equation_system,
+		px, py, pz, count, out_x, out_y, ok);
+}
+
+static void batch_homography_scalar(
+	const BatchCalibration *cal,
+	const float *px, const float *py, const float *pz, int count,
+	short *out_x, short *out_y, unsigned char *ok
+) {
+	batch_scalar(mouse_axes_homography,
+		px, py, pz, count, out_x, out_y, ok);
+}
+// }}}
+
+// 4 lanes. Plain SSE2 on x86-64, generic vector code elsewhere.
+#define KERNEL_LANES 4
+#define KERNEL_SUFFIX _sse
+#define KERNEL_ATTR
+#include "linear_eq_batch_kernel.h"
+#undef KERNEL_LANES
+#undef KERNEL_SUFFIX
+#undef KERNEL_ATTR
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_AVX2_KERNEL 1
+// 8 lanes. Only used if the CPU supports it.
+#define KERNEL_LANES 8
+#define KERNEL_SUFFIX _avx2
+#define KERNEL_ATTR __attribute__((target("avx2")))
+#include "linear_eq_batch_kernel.h"
+#undef KERNEL_LANES
+#undef KERNEL_SUFFIX
+#undef KERNEL_ATTR
+#endif
+
+typedef struct BatchKernelInfo {
+	const char *name;
+	BatchKernel linear_equation_system;
+	BatchKernel homography;
+} BatchKernelInfo;
+
+// Sorted from the slowest to the fastest.
+static const BatchKernelInfo batch_kernels[] = {
+	{"scalar", batch_linear_equation_system_scalar, batch_homography_scalar},
+	{"sse",    batch_linear_equation_system_sse,    batch_homography_sse},
+#if HAVE_AVX2_KERNEL
+	{"avx2",   batch_linear_equation_system_avx2,   batch_homography_avx2},
+#endif
+};
+#define BATCH_KERNELS_COUNT (sizeof(batch_kernels) / sizeof(batch_kernels[0]))
+
+static const BatchKernelInfo* batch_find_kernel(const char *name) {  // {{{
+	unsigned int i;
+
+	if (name == NULL) {
+		// Picking the fastest one supported by this CPU.
+#if HAVE_AVX2_KERNEL
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2")) {
+			name = "avx2";
+		} else {
+			name = "sse";
+		}
+#else
+		name = "sse";
+#endif
+	}
+
+	for (i = 0; i < BATCH_KERNELS_COUNT; i++) {
+		if (strcmp(batch_kernels[i].name, name) == 0) {
+			return &batch_kernels[i];
+		}
+	}
+	return NULL;
+}  // }}}
+
+// The buffers are not inside a struct, because of -fpack-struct.
+static BatchKernel batch_kernel;
+static BatchCalibration batch_cal;
+// Set whenever a corner changes.
+static uchar batch_calibration_changed;
+
+static int batch_count;
+static float batch_x[BATCH_SIZE];
+static float batch_y[BATCH_SIZE];
+static float batch_z[BATCH_SIZE];
+static short batch_out_x[BATCH_SIZE];
+static short batch_out_y[BATCH_SIZE];
+static unsigned char batch_ok[BATCH_SIZE];
+
+// The printf("%f") output for each possible report value.
+static char batch_text[32768][12];
+
+// Statistics
+static long batch_total_samples;
+static double batch_kernel_seconds;
+
+static double batch_time() {  // {{{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}  // }}}
+
+static void batch_init(BatchKernel kernel) {  // {{{
+	int i;
+
+	batch_kernel = kernel;
+	batch_calibration_changed = 1;
+
+	// Printing is the slowest part, so it is done only once per value.
+	for (i = 0; i < 32768; i++) {
+		float f = (float)i / 32767;
+		snprintf(batch_text[i], sizeof(batch_text[i]), "%f", f);
+	}
+}  // }}}
+
+static void batch_flush() {  // {{{
+	double start;
+	int i;
+
+	if (batch_count == 0) {
+		return;
+	}
+
+	if (batch_calibration_changed) {
+		float m[3][4];
+
+		batch_calibration_changed = 0;
+
+		fill_matrix_from_sensor(m);
+		memcpy(batch_cal.m, m, sizeof(m));
+
+		homography_needs_update = 0;
+		update_homography();
+		memcpy(batch_cal.h, homography, sizeof(homography));
+	}
+
+	// Padding up to the kernel width. The padding lanes just fail.
+	for (i = batch_count; i % 8 != 0; i++) {
+		batch_x[i] = batch_y[i] = batch_z[i] = 0;
+	}
+
+	start = batch_time();
+	batch_kernel(&batch_cal, batch_x, batch_y, batch_z, batch_count,
+		batch_out_x, batch_out_y, batch_ok);
+	batch_kernel_seconds += batch_time() - start;
+
+	// Failed conversions keep the previous report, so this part must be
+	// sequential.
+	for (i = 0; i < batch_count; i++) {
+		if (batch_ok[i]) {
+			mouse_report.x = batch_out_x[i];
+			mouse_report.y = batch_out_y[i];
+		}
+		fputs(batch_text[mouse_report.x], stdout);
+		putchar(' ');
+		fputs(batch_text[mouse_report.y], stdout);
+		putchar('\n');
+	}
+
+	batch_total_samples += batch_count;
+	batch_count = 0;
+}  // }}}
+
+static char* batch_read_all(FILE *f) {  // {{{
+	size_t size = 0, capacity = 1 << 20;
+	char *buf = malloc(capacity);
+
+	while (buf) {
+		size += fread(buf + size, 1, capacity - size - 1, f);
+		if (size < capacity - 1) {
+			break;
+		}
+		capacity *= 2;
+		buf = realloc(buf, capacity);
+	}
+	if (buf) {
+		buf[size] = '\0';
+	}
+	return buf;
+}  // }}}
+
+static uchar batch_token_is(const char *token, const char *end, const char *word) {  // {{{
+	size_t len = end - token;
+	return strlen(word) == len && memcmp(token, word, len) == 0;
+}  // }}}
+
+static void batch_add_sample(short x, short y, short z) {  // {{{
+	batch_x[batch_count] = x;
+	batch_y[batch_count] = y;
+	batch_z[batch_count] = z;
+	batch_count++;
+	if (batch_count == BATCH_SIZE) {
+		batch_flush();
+	}
+}  // }}}
+
+static void batch_set_corner(XYZVector *corner, short x, short y, short z) {  // {{{
+	// The pending samples use the previous corners.
+	batch_flush();
+	corner->x = x;
+	corner->y = y;
+	corner->z = z;
+	batch_calibration_changed = 1;
+}  // }}}
+
+static int batch_run_text() {  // {{{
+	// Reads the text format from stdin.
+	char *input, *p;
+	XYZVector* next_vector;
+	short numbers[3];
+	int numbers_count = 0;
+
+	input = batch_read_all(stdin);
+	if (input == NULL) {
+		fputs("Out of memory while reading the input.\n", stderr);
+		return 0;
+	}
+
+	// Same parsing rules as the scanf() loop from main().
+	next_vector = &sensor.data;
+	p = input;
+	while (1) {
+		char *token, *end;
+		long value;
+
+		while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') {
+			p++;
+		}
+		if (*p == '\0') {
+			break;
+		}
+		token = p;
+		while (*p != '\0' && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') {
+			p++;
+		}
+
+		value = strtol(token, &end, 10);
+		if (end == p) {
+			numbers[numbers_count++] = value;
+			if (numbers_count < 3) {
+				continue;
+			}
+			numbers_count = 0;
+
+			if (next_vector == &sensor.data) {
+				batch_add_sample(numbers[0], numbers[1], numbers[2]);
+			} else {
+				batch_set_corner(next_vector, numbers[0], numbers[1], numbers[2]);
+			}
+
+			// Next one gets stored at the sensor data.
+			next_vector = &sensor.data;
+		} else {
+			// Incomplete vectors are discarded.
+			numbers_count = 0;
+
+			if (batch_token_is(token, p, "topleft")) {
+				next_vector = &sensor.e.corners[0];
+			} else if (batch_token_is(token, p, "topright")) {
+				next_vector = &sensor.e.corners[1];
+			} else if (batch_token_is(token, p, "bottomleft")) {
+				next_vector = &sensor.e.corners[2];
+			} else if (batch_token_is(token, p, "bottomright")) {
+				next_vector = &sensor.e.corners[3];
+			}
+		}
+	}
+
+	free(input);
+	return 1;
+}  // }}}
+
+static int batch_run_capture(const char *filename) {  // {{{
+	// Reads a capture file (see capture_format.h), without parsing.
+	CaptureFile cap;
+	const CaptureHeader *h;
+	uint64_t i;
+	int c;
+
+	if (!capture_open(&cap, filename)) {
+		return 0;
+	}
+
+	h = cap.header;
+	for (c = 0; c < 4; c++) {
+		if (h->calibration_flags & (1 << c)) {
+			batch_set_corner(&sensor.e.corners[c],
+				h->calibration.corners[c][0],
+				h->calibration.corners[c][1],
+				h->calibration.corners[c][2]);
+		}
+	}
+
+	for (i = 0; i < cap.count; i++) {
+		const CaptureRecord *r = &cap.records[i];
+		c = capture_record_corner(r);
+		if (c < 0) {
+			batch_add_sample(r->x, r->y, r->z);
+		} else {
+			batch_set_corner(&sensor.e.corners[c], r->x, r->y, r->z);
+		}
+	}
+
+	capture_close(&cap);
+	return 1;
+}  // }}}
+
+static int batch_main(BatchKernel kernel, const char *kernel_name, const char *capture_name) {  // {{{
+	double start, seconds;
+	int ok;
+
+	start = batch_time();
+
+	setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+	batch_init(kernel);
+
+	if (capture_name) {
+		ok = batch_run_capture(capture_name);
+	} else {
+		ok = batch_run_text();
+	}
+	batch_flush();
+	fflush(stdout);
+	if (!ok) {
+		return 1;
+	}
+
+	seconds = batch_time() - start;
+	fprintf(stderr,
+		"%ld samples, %s kernel: %.0f samples/s (kernel only), %.0f samples/s (total)\n",
+		batch_total_samples,
+		kernel_name,
+		batch_total_samples / batch_kernel_seconds,
+		batch_total_samples / seconds
+	);
+
+	return 0;
+}  // }}}
+
+// }}}
+
 
 int main(int argc, char *argv[]) {
 
 	short int x, y, z;
 	XYZVector* next_vector;
+	unsigned char use_homography = 0;
+	unsigned char use_batch = 0;
+	const char *kernel_name = NULL;
+	const char *capture_name = NULL;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-H") == 0) {
+			use_homography = 1;
+		} else if (strcmp(argv[i], "-b") == 0) {
+			use_batch = 1;
+		} else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc) {
+			use_batch = 1;
+			kernel_name = argv[++i];
+		} else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+			use_batch = 1;
+			capture_name = argv[++i];
+		} else {
+			fprintf(stderr,
+				"Usage: %s [-H] [-b] [-k scalar|sse|avx2] [-f capture]\n"
+				"Reads 3D vectors from stdin and prints 2D screen coordinates.\n"
+				"  -H  Use all four corners (homography) instead of only three\n"
+				"  -b  Batch mode: reads the whole input before converting it,\n"
+				"      and prints the speed (samples/s) to stderr\n"
+				"  -k  Batch mode, using the given kernel (default: fastest)\n"
+				"  -f  Batch mode, reading from a capture file instead of stdin\n"
+				"      (binary, see capture_format.h, or text)\n",
+				argv[0]
+			);
+			return 1;
+		}
+	}
+
+	if (use_batch) {
+		const BatchKernelInfo *info = batch_find_kernel(kernel_name);
+		if (info == NULL) {
+			fprintf(stderr, "Unknown kernel: %s\n", kernel_name);
+			return 1;
+		}
+		return batch_main(
+			use_homography ? info->homography : info->linear_equation_system,
+			info->name,
+			capture_name
+		);
+	}
 
 	// By default, store numbers at the sensor data.
 	next_vector = &sensor.data;
@@ -290,11 +835,17 @@ int main(int argc, char *argv[]) {
 			if (next_vector == &sensor.data) {
 				float fx, fy;
 				// Do the conversion
-				mouse_axes_linear_equation_system();
+				if (use_homography) {
+					mouse_axes_homography();
+				} else {
+					mouse_axes_linear_equation_system();
+				}
 				fx = (float)mouse_report.x / 32767;
 				fy = (float)mouse_report.y / 32767;
 				printf("%f %f\n", fx, fy);
 				fflush(stdout);
+			} else {
+				homography_needs_update = 1;
 			}
 
 			// Next one gets stored at the sensor data.
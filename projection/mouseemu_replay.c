@@ -0,0 +1,86 @@
+/* Name: mouseemu_replay.c
+ * Project: atmega8-magnetometer-usb-mouse
+ * Tabsize: 4
+ * License: GNU GPL v2 or GNU GPL v3
+ *
+ * Runs the actual firmware code from mouseemu.c on a PC, feeding it with
+ * sensor values read from stdin (same input format as linear_eq_conversion).
+ *
+ * For each input vector, prints the X,Y values from the mouse report, as
+ * integers between 0 and 32767. If the conversion fails, the previous values
+ * are printed again (just like the firmware keeps the previous report).
+ *
+ * The same source-code is compiled twice by the Makefile, with
+ * ENABLE_FIXED_POINT set to 0 and 1, and the outputs can be compared with:
+ *   make compare_fixed_point
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+// The firmware code, compiled for the PC.
+// Including the .c file gives access to the static functions and variables.
+#include "../firmware/mouseemu.c"
+
+
+// Globals that would come from other firmware modules.
+SensorData sensor;
+ButtonState button;
+
+
+int main(int argc, char *argv[]) {  // {{{
+	short int x, y, z;
+	XYZVector* next_vector;
+
+	init_mouse_emulation();
+
+	// By default, store numbers at the sensor data.
+	next_vector = &sensor.data;
+
+	while (1) {
+		if (scanf("%hd%hd%hd", &x, &y, &z) == 3) {
+			// Save it to the SensorData struct
+			next_vector->x = x;
+			next_vector->y = y;
+			next_vector->z = z;
+
+			if (next_vector == &sensor.data) {
+				// Do the conversion, through the same path used by the
+				// firmware main loop.
+				// There are no timestamps in the text format.
+				sensor_ring_push(&sensor.ring, &sensor.data, 0, 0);
+				mouse_prepare_next_report();
+				printf("%d %d\n", mouse_report.x, mouse_report.y);
+			} else {
+				sensor.corners_changed = 1;
+			}
+
+			// Next one gets stored at the sensor data.
+			next_vector = &sensor.data;
+		} else {
+			char s[64];
+			if (scanf(" %63s", s) == 1) {
+				if (strcmp(s, "topleft") ==  0) {
+					next_vector = &sensor.e.corners[0];
+				} else if (strcmp(s, "topright") ==  0) {
+					next_vector = &sensor.e.corners[1];
+				} else if (strcmp(s, "bottomleft") ==  0) {
+					next_vector = &sensor.e.corners[2];
+				} else if (strcmp(s, "bottomright") ==  0) {
+					next_vector = &sensor.e.corners[3];
+				}
+			} else {
+				if (feof(stdin)) {
+					return 0;
+				} else {
+					puts("scanf failed. This shouldn't happen. Aborting...");
+					return 1;
+				}
+			}
+		}
+	}
+
+	return 0;
+}  // }}}
+
+// vim:noexpandtab tabstop=4 shiftwidth=4 foldmethod=marker foldmarker={{{,}}}
@@ -0,0 +1,570 @@
+/* Name: mouseemu_sweep.c
+ * Project: atmega8-magnetometer-usb-mouse
+ * Tabsize: 4
+ * License: GNU GPL v2 or GNU GPL v3
+ *
+ * Parallel version of mouseemu_replay.c, for replaying large captures with
+ * many different settings.
+ *
+ * Runs the firmware code from mouseemu.c over a capture file, once for each
+ * combination of calibration file and smoothing factor (a "job"). The
+ * capture can be either binary (see capture_format.h), which is mapped
+ * directly into memory, or text, in the same format as linear_eq_conversion.
+ * It may also contain corners. Each calibration file is read in the same
+ * way, and only its corners are used (as if it had been concatenated before
+ * the capture).
+ *
+ * Usage:
+ *   mouseemu_sweep_float [options] capture.mcap
+ * Options:
+ *   -c FILE     Calibration file. Can be repeated.
+ *   -a ALPHA    Smoothing factor. Can be repeated. In fixed point, it must be
+ *               a power of two.
+ *   -j N        Number of worker processes (default: number of CPUs).
+ *   -s N        Number of shards per job (default: same as -j).
+ *   -w N        Warm-up samples before each shard (default: 256).
+ *   -o PREFIX   Writes the reports of job N to PREFIXN.txt, in the same
+ *               format as mouseemu_replay.
+ *
+ * The firmware code uses global variables, so each worker is a separate
+ * process (fork). The capture is loaded before forking, and the results are
+ * written into shared memory.
+ *
+ * Each job is split into shards, which are processed in parallel. The
+ * smoothing filter depends on all previous samples, so each shard starts
+ * with a guess: the state after running the firmware code over the
+ * previous "-w" samples, starting from zero. As the filter forgets old
+ * samples exponentially, the guess is usually exact. Afterwards, each shard
+ * is checked sequentially: starting from the real final state of the
+ * previous shard, samples are replayed again until the state becomes
+ * bitwise equal to the one computed by the worker. Thus, the output is
+ * always exactly the same as mouseemu_replay, and the "fixup" column tells
+ * how many samples had to be replayed again.
+ */
+
+// For MAP_ANONYMOUS and clock_gettime()
+#define _DEFAULT_SOURCE
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+// Smoothing factor, overriding the constants from mouseemu.c
+#if ENABLE_FIXED_POINT
+static unsigned char smoothing_shift;
+#define MOUSE_SMOOTHING_SHIFT smoothing_shift
+#else
+static float smoothing_alpha;
+#define MOUSE_SMOOTHING_ALPHA smoothing_alpha
+#endif
+
+// The firmware code, compiled for the PC.
+// Including the .c file gives access to the static functions and variables.
+#include "../firmware/mouseemu.c"
+
+#include "capture_format.h"
+
+
+// Globals that would come from other firmware modules.
+SensorData sensor;
+ButtonState button;
+
+
+#define MAX_CALIBRATIONS 64
+#define MAX_ALPHAS 64
+
+// Everything that carries over from one sample to the next.
+typedef struct ReplayState {
+	SmoothingVars smooth[2];
+	int x, y;
+} ReplayState;
+
+typedef struct Job {
+	int calibration;
+	double alpha;
+
+	// Shared memory, one element per capture record
+	ReplayState *states;
+	unsigned char *updated;
+
+	// Statistics
+	long fixup;
+} Job;
+
+
+static CaptureFile capture;
+static long samples_count;
+
+// Indexes of the corner records.
+static long *events;
+static long events_count;
+
+static const char *calibration_names[MAX_CALIBRATIONS];
+static XYZVector calibrations[MAX_CALIBRATIONS][4];
+static int calibrations_count;
+
+static double alphas[MAX_ALPHAS];
+static int alphas_count;
+
+static Job *jobs;
+static int jobs_count;
+
+static int shards_count;
+static long warmup_samples = 256;
+
+
+static double now() {  // {{{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}  // }}}
+
+static void* shared_alloc(size_t size) {  // {{{
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	return p;
+}  // }}}
+
+
+// Input  {{{
+
+static void apply_header_corners(const CaptureHeader *h, XYZVector corners[4]) {  // {{{
+	int c;
+
+	for (c = 0; c < 4; c++) {
+		if (h->calibration_flags & (1 << c)) {
+			corners[c].x = h->calibration.corners[c][0];
+			corners[c].y = h->calibration.corners[c][1];
+			corners[c].z = h->calibration.corners[c][2];
+		}
+	}
+}  // }}}
+
+static void apply_record_corner(const CaptureRecord *r, XYZVector corners[4]) {  // {{{
+	int c = capture_record_corner(r);
+
+	corners[c].x = r->x;
+	corners[c].y = r->y;
+	corners[c].z = r->z;
+}  // }}}
+
+static int load_calibration(const char *filename, XYZVector corners[4]) {  // {{{
+	// Only the final values of the corners are used.
+
+	CaptureFile cal;
+	uint64_t i;
+
+	if (!capture_open(&cal, filename)) {
+		return 0;
+	}
+	apply_header_corners(cal.header, corners);
+	for (i = 0; i < cal.count; i++) {
+		if (capture_record_corner(&cal.records[i]) >= 0) {
+			apply_record_corner(&cal.records[i], corners);
+		}
+	}
+	capture_close(&cal);
+	return 1;
+}  // }}}
+
+static int load_capture(const char *filename) {  // {{{
+	long i;
+
+	if (!capture_open(&capture, filename)) {
+		return 0;
+	}
+
+	events = malloc((capture.count + 1) * sizeof(*events));
+	if (events == NULL) {
+		fputs("Out of memory\n", stderr);
+		return 0;
+	}
+	for (i = 0; i < (long) capture.count; i++) {
+		if (capture_record_corner(&capture.records[i]) >= 0) {
+			events[events_count++] = i;
+		} else {
+			samples_count++;
+		}
+	}
+	return 1;
+}  // }}}
+
+// }}}
+
+
+// Replaying  {{{
+
+static void load_state(const ReplayState *st) {  // {{{
+	mouse_smooth[0] = st->smooth[0];
+	mouse_smooth[1] = st->smooth[1];
+	mouse_report.x = st->x;
+	mouse_report.y = st->y;
+}  // }}}
+
+static void save_state(ReplayState *st) {  // {{{
+	// memset() because of memcmp() in fixup_job().
+	memset(st, 0, sizeof(*st));
+	st->smooth[0] = mouse_smooth[0];
+	st->smooth[1] = mouse_smooth[1];
+	st->x = mouse_report.x;
+	st->y = mouse_report.y;
+}  // }}}
+
+static void select_job(const Job *job) {  // {{{
+#if ENABLE_FIXED_POINT
+	smoothing_shift = (unsigned char) lround(-log2(job->alpha));
+#else
+	smoothing_alpha = job->alpha;
+#endif
+}  // }}}
+
+static void apply_corners(const Job *job, long index) {  // {{{
+	// Sets the corners to the ones active just before the given record.
+
+	long e;
+
+	memcpy(sensor.e.corners, calibrations[job->calibration], sizeof(sensor.e.corners));
+	apply_header_corners(capture.header, sensor.e.corners);
+	for (e = 0; e < events_count && events[e] < index; e++) {
+		apply_record_corner(&capture.records[events[e]], sensor.e.corners);
+	}
+	sensor.corners_changed = 1;
+}  // }}}
+
+static unsigned char replay_record(long i) {  // {{{
+	// Processes capture.records[i], through the same path used by the
+	// firmware main loop. Returns 1 if the report was updated.
+
+	const CaptureRecord *r = &capture.records[i];
+
+	if (capture_record_corner(r) >= 0) {
+		apply_record_corner(r, sensor.e.corners);
+		sensor.corners_changed = 1;
+		return 0;
+	}
+
+	sensor.data.x = r->x;
+	sensor.data.y = r->y;
+	sensor.data.z = r->z;
+	// Timer1 runs at F_CPU/64, that is 3/16 of a tick per microsecond.
+	sensor_ring_push(&sensor.ring, &sensor.data, (uint16_t) ((uint64_t) r->timestamp_us * 3 / 16), 0);
+	return mouse_prepare_next_report();
+}  // }}}
+
+static void shard_range(int shard, long *start, long *end) {  // {{{
+	*start = capture.count * shard / shards_count;
+	*end = capture.count * (shard + 1) / shards_count;
+}  // }}}
+
+static void run_unit(int unit) {  // {{{
+	// Runs a single shard of a single job, in a worker process.
+
+	Job *job = &jobs[unit / shards_count];
+	int shard = unit % shards_count;
+	long start, end, from, i;
+
+	shard_range(shard, &start, &end);
+	from = start - warmup_samples;
+	if (from < 0 || shard == 0) {
+		from = 0;
+	}
+
+	select_job(job);
+	memset(mouse_smooth, 0, sizeof(mouse_smooth));
+	init_mouse_emulation();
+	apply_corners(job, from);
+
+	for (i = from; i < end; i++) {
+		unsigned char updated = replay_record(i);
+		if (i >= start) {
+			job->updated[i] = updated;
+			save_state(&job->states[i]);
+		}
+	}
+}  // }}}
+
+static void fixup_job(Job *job) {  // {{{
+	// Makes the shards of a job consistent, see the comment at the top.
+
+	int shard;
+
+	select_job(job);
+
+	for (shard = 1; shard < shards_count; shard++) {
+		long start, end, i;
+
+		shard_range(shard, &start, &end);
+		if (start == 0) {
+			continue;
+		}
+
+		load_state(&job->states[start - 1]);
+		apply_corners(job, start);
+
+		for (i = start; i < end; i++) {
+			ReplayState st;
+
+			job->updated[i] = replay_record(i);
+			save_state(&st);
+			if (memcmp(&st, &job->states[i], sizeof(st)) == 0) {
+				// From here on, the worker result is exact.
+				break;
+			}
+			job->states[i] = st;
+			job->fixup++;
+		}
+	}
+}  // }}}
+
+static int run_workers(int workers_count) {  // {{{
+	// Each worker takes the next unit from a shared counter, until all
+	// units are done.
+
+	int units_count = jobs_count * shards_count;
+	int *next_unit;
+	int w, failed = 0;
+
+	next_unit = shared_alloc(sizeof(*next_unit));
+	*next_unit = 0;
+
+	if (workers_count > units_count) {
+		workers_count = units_count;
+	}
+
+	fflush(NULL);
+	for (w = 0; w < workers_count; w++) {
+		pid_t pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			return 0;
+		}
+		if (pid == 0) {
+			int unit;
+			while ((unit = __atomic_fetch_add(next_unit, 1, __ATOMIC_RELAXED)) < units_count) {
+				run_unit(unit);
+			}
+			_exit(0);
+		}
+	}
+
+	for (w = 0; w < workers_count; w++) {
+		int status;
+		if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			failed = 1;
+		}
+	}
+	if (failed) {
+		fputs("A worker process failed.\n", stderr);
+		return 0;
+	}
+	return 1;
+}  // }}}
+
+// }}}
+
+
+static void print_job(int index) {  // {{{
+	// Prints one line of the summary table.
+	// "step" is the mean distance between consecutive reports. Lower values
+	// mean a steadier pointer.
+
+	const Job *job = &jobs[index];
+	const ReplayState *previous = NULL;
+	long i, updated = 0;
+	double step = 0;
+
+	for (i = 0; i < (long) capture.count; i++) {
+		if (capture_record_corner(&capture.records[i]) >= 0) {
+			continue;
+		}
+		updated += job->updated[i];
+		if (previous) {
+			step += abs(job->states[i].x - previous->x);
+			step += abs(job->states[i].y - previous->y);
+		}
+		previous = &job->states[i];
+	}
+	if (samples_count > 1) {
+		step /= samples_count - 1;
+	}
+
+	printf("%3d %-30s %8.5f %9ld %9ld %7ld %9.2f\n",
+		index,
+		calibration_names[job->calibration],
+		job->alpha,
+		samples_count,
+		updated,
+		job->fixup,
+		step
+	);
+}  // }}}
+
+static int write_job(int index, const char *prefix) {  // {{{
+	const Job *job = &jobs[index];
+	char filename[1024];
+	FILE *f;
+	long i;
+
+	snprintf(filename, sizeof(filename), "%s%d.txt", prefix, index);
+	f = fopen(filename, "w");
+	if (f == NULL) {
+		perror(filename);
+		return 0;
+	}
+	for (i = 0; i < (long) capture.count; i++) {
+		if (capture_record_corner(&capture.records[i]) < 0) {
+			fprintf(f, "%d %d\n", job->states[i].x, job->states[i].y);
+		}
+	}
+	fclose(f);
+	return 1;
+}  // }}}
+
+static void usage(const char *argv0) {  // {{{
+	fprintf(stderr,
+		"Usage: %s [-c calibration.txt]... [-a alpha]... [-j workers]\n"
+		"       [-s shards] [-w warmup] [-o prefix] capture.mcap\n"
+		"See the comment at the top of mouseemu_sweep.c for details.\n",
+		argv0
+	);
+}  // }}}
+
+int main(int argc, char *argv[]) {  // {{{
+	const char *output_prefix = NULL;
+	const char *capture_name;
+	int workers_count;
+	int opt, c, a, i;
+	double start;
+
+	workers_count = sysconf(_SC_NPROCESSORS_ONLN);
+	if (workers_count < 1) {
+		workers_count = 1;
+	}
+
+	while ((opt = getopt(argc, argv, "c:a:j:s:w:o:")) != -1) {
+		switch (opt) {
+			case 'c':
+				if (calibrations_count == MAX_CALIBRATIONS) {
+					fputs("Too many calibration files.\n", stderr);
+					return 1;
+				}
+				calibration_names[calibrations_count] = optarg;
+				if (!load_calibration(optarg, calibrations[calibrations_count])) {
+					return 1;
+				}
+				calibrations_count++;
+				break;
+			case 'a':
+				if (alphas_count == MAX_ALPHAS) {
+					fputs("Too many smoothing factors.\n", stderr);
+					return 1;
+				}
+				alphas[alphas_count] = atof(optarg);
+				if (alphas[alphas_count] <= 0 || alphas[alphas_count] > 1) {
+					fprintf(stderr, "Invalid smoothing factor: %s\n", optarg);
+					return 1;
+				}
+#if ENABLE_FIXED_POINT
+				if (alphas[alphas_count] != ldexp(1, -lround(-log2(alphas[alphas_count])))) {
+					fprintf(stderr, "In fixed point, the smoothing factor must be a power of two: %s\n", optarg);
+					return 1;
+				}
+#endif
+				alphas_count++;
+				break;
+			case 'j':
+				workers_count = atoi(optarg);
+				break;
+			case 's':
+				shards_count = atoi(optarg);
+				break;
+			case 'w':
+				warmup_samples = atol(optarg);
+				break;
+			case 'o':
+				output_prefix = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (optind != argc - 1 || workers_count < 1 || shards_count < 0 || warmup_samples < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	capture_name = argv[optind];
+
+	if (calibrations_count == 0) {
+		// Only the corners from the capture itself.
+		calibration_names[0] = "(capture)";
+		calibrations_count = 1;
+	}
+	if (alphas_count == 0) {
+#if ENABLE_FIXED_POINT
+		alphas[0] = ldexp(1, -3);
+#else
+		alphas[0] = 0.125;
+#endif
+		alphas_count = 1;
+	}
+	if (shards_count == 0) {
+		shards_count = workers_count;
+	}
+
+	start = now();
+
+	if (!load_capture(capture_name)) {
+		return 1;
+	}
+	if (shards_count > (long) capture.count) {
+		shards_count = capture.count > 0 ? capture.count : 1;
+	}
+
+	jobs_count = calibrations_count * alphas_count;
+	jobs = shared_alloc(jobs_count * sizeof(*jobs));
+	for (c = 0; c < calibrations_count; c++) {
+		for (a = 0; a < alphas_count; a++) {
+			Job *job = &jobs[c * alphas_count + a];
+			job->calibration = c;
+			job->alpha = alphas[a];
+			job->states = shared_alloc((capture.count + 1) * sizeof(*job->states));
+			job->updated = shared_alloc(capture.count + 1);
+		}
+	}
+
+	if (!run_workers(workers_count)) {
+		return 1;
+	}
+
+	printf("job calibration                       alpha   samples   updated   fixup      step\n");
+	for (i = 0; i < jobs_count; i++) {
+		fixup_job(&jobs[i]);
+		print_job(i);
+		if (output_prefix && !write_job(i, output_prefix)) {
+			return 1;
+		}
+	}
+
+	fprintf(stderr,
+		"%d jobs, %ld samples each, %d shards, %d workers: %.2f s, %.0f samples/s\n",
+		jobs_count,
+		samples_count,
+		shards_count,
+		workers_count,
+		now() - start,
+		(double) jobs_count * samples_count / (now() - start)
+	);
+
+	return 0;
+}  // }}}
+
+// vim:noexpandtab tabstop=4 shiftwidth=4 foldmethod=marker foldmarker={{{,}}}
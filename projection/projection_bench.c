@@ -0,0 +1,155 @@
+/* Name: projection_bench.c
+ * Project: atmega8-magnetometer-usb-mouse
+ * Tabsize: 4
+ * License: GNU GPL v2 or GNU GPL v3
+ *
+ * Compares the speed and the accuracy of all methods from
+ * projection_methods.c.
+ *
+ * The samples are generated by sphere_vectors.c, exactly like
+ * generate_sphere_vectors.py (same options and defaults), and compared
+ * against two "ground truth" values (flat and angular, see
+ * sphere_vectors.c).
+ *
+ * For each method, prints:
+ * - ns/sample: average time per conversion on this PC. Only useful to
+ *   compare the methods against each other.
+ * - failed: percentage of the samples inside the screen that couldn't be
+ *   converted.
+ * - mean and max error: distance between the converted point and the ground
+ *   truth, as a percentage of the screen size. Only for the samples inside
+ *   the screen.
+ *
+ * Usage:
+ *   projection_bench [-r radius] [-P phi_aperture] [-T theta_aperture]
+ *                    [-p phi_offset] [-t theta_offset]
+ */
+
+// For clock_gettime() and getopt()
+#define _DEFAULT_SOURCE
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "projection_methods.h"
+#include "sphere_vectors.h"
+
+
+static SphereOptions options;
+
+static SphereSample *samples;
+static long samples_count;
+
+
+static double now() {  // {{{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}  // }}}
+
+
+static double bench_speed(const ProjectionContext *ctx, uchar method) {  // {{{
+	// Returns nanoseconds per sample.
+	volatile float sink = 0;
+	long reps = 1, r, i;
+	double elapsed;
+
+	while (1) {
+		double start = now();
+		for (r = 0; r < reps; r++) {
+			for (i = 0; i < samples_count; i++) {
+				float x, y;
+				if (projection_convert(ctx, method, &samples[i].v, &x, &y)) {
+					sink += x + y;
+				}
+			}
+		}
+		elapsed = now() - start;
+		if (elapsed > 0.1) {
+			break;
+		}
+		reps *= 2;
+	}
+	(void) sink;
+
+	return elapsed * 1e9 / (reps * samples_count);
+}  // }}}
+
+static void bench_method(const ProjectionContext *ctx, uchar method) {  // {{{
+	SphereErrors err;
+
+	sphere_measure_errors(ctx, method, samples, samples_count, &err);
+
+	printf("%-14s %9.1f %7.2f %9.3f %9.3f %9.3f %9.3f\n",
+		projection_method_name(method),
+		bench_speed(ctx, method),
+		err.inside_flat ? 100.0 * err.failed / err.inside_flat : 0.0,
+		err.converted_flat ? 100 * err.flat_sum / err.converted_flat : NAN,
+		100 * err.flat_max,
+		err.converted_angular ? 100 * err.angular_sum / err.converted_angular : NAN,
+		100 * err.angular_max
+	);
+}  // }}}
+
+static void usage(const char *argv0) {  // {{{
+	fprintf(stderr,
+		"Usage: %s [-r radius] [-P phi_aperture] [-T theta_aperture]\n"
+		"       [-p phi_offset] [-t theta_offset]\n"
+		"Same options as generate_sphere_vectors.py.\n",
+		argv0
+	);
+}  // }}}
+
+int main(int argc, char *argv[]) {  // {{{
+	SensorEepromData e;
+	ProjectionContext ctx;
+	uchar method;
+	int opt;
+
+	sphere_default_options(&options);
+	while ((opt = getopt(argc, argv, "r:P:T:p:t:")) != -1) {
+		switch (opt) {
+			case 'r': options.radius = atoi(optarg); break;
+			case 'P': options.phi_aperture = atoi(optarg); break;
+			case 'T': options.theta_aperture = atoi(optarg); break;
+			case 'p': options.phi_offset = atoi(optarg); break;
+			case 't': options.theta_offset = atoi(optarg); break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (optind != argc || options.radius <= 0 || options.phi_aperture < 2 || options.theta_aperture < 2) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	samples = sphere_generate(&options, &e, &samples_count);
+	if (samples == NULL) {
+		fputs("Out of memory\n", stderr);
+		return 1;
+	}
+	projection_prepare(&ctx, &e);
+
+	printf("# radius %d, aperture %dx%d, offset %d,%d, %ld samples\n",
+		options.radius,
+		options.phi_aperture, options.theta_aperture,
+		options.phi_offset, options.theta_offset,
+		samples_count
+	);
+	printf("# %-12s %9s %7s %19s %19s\n", "", "", "", "flat error %", "angular error %");
+	printf("%-14s %9s %7s %9s %9s %9s %9s\n",
+		"method", "ns/sample", "failed%", "mean", "max", "mean", "max");
+
+	for (method = PROJECTION_FIRST_METHOD; method <= PROJECTION_LAST_METHOD; method++) {
+		bench_method(&ctx, method);
+	}
+
+	return 0;
+}  // }}}
+
+// vim:noexpandtab tabstop=4 shiftwidth=4 foldmethod=marker foldmarker={{{,}}}
@@ -0,0 +1,351 @@
+/* Name: projection_methods.c
+ * Project: atmega8-magnetometer-usb-mouse
+ * Tabsize: 4
+ * License: GNU GPL v2 or GNU GPL v3
+ *
+ * C version of the 3D->2D conversion methods from convert_coordinates.py,
+ * so they can be compared at a cost closer to the firmware, and over many
+ * more samples. See projection_bench.c.
+ *
+ * It uses the same types as the firmware (from sensor.h), and is compiled
+ * with the stand-in headers from firmware/host/.
+ *
+ * Differences from the Python code:
+ * - Everything that depends only on the corners is calculated once, in
+ *   projection_prepare().
+ * - The corners are converted to unit vectors before anything else. The
+ *   Python code does this as a side-effect of "A /= norm(A)", which modifies
+ *   the calibration in place, and thus most methods only give the intended
+ *   results after the first sample.
+ * - "dist" uses sqrt(2 - 2*cos) for the distance between two unit vectors,
+ *   which is the same value, without normalizing C'.
+ * - "exact" solves its 2x2 system by Cramer's rule.
+ * - The linear equation system is solved by Cramer's rule, as in mouseemu.c.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "projection_methods.h"
+
+
+static const char *method_names[PROJECTION_LAST_METHOD + 1] = {
+	NULL,
+	"2edges-angle",
+	"2edges-cos",
+	"2edges-sin",
+	"2edges-tan",
+	"2edges-dist",
+	"2edges-exact",
+	"4edges-angle",
+	"4edges-cos",
+	"4edges-sin",
+	"4edges-tan",
+	"4edges-dist",
+	"4edges-exact",
+	"linear",
+	"homography",
+};
+
+// Edge interpolation strategies
+#define USING_ANGLE 0
+#define USING_COS   1
+#define USING_SIN   2
+#define USING_TAN   3
+#define USING_DIST  4
+#define USING_EXACT 5
+
+
+// Vector math  {{{
+
+static float dot(const float a[3], const float b[3]) {  // {{{
+	return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}  // }}}
+
+static void cross(float out[3], const float a[3], const float b[3]) {  // {{{
+	out[0] = a[1] * b[2] - a[2] * b[1];
+	out[1] = a[2] * b[0] - a[0] * b[2];
+	out[2] = a[0] * b[1] - a[1] * b[0];
+}  // }}}
+
+static void normalize(float v[3]) {  // {{{
+	float norm = sqrtf(dot(v, v));
+	if (norm > 0) {
+		v[0] /= norm;
+		v[1] /= norm;
+		v[2] /= norm;
+	}
+}  // }}}
+
+// }}}
+
+
+// Preparation  {{{
+
+static void prepare_edge(ProjectionEdge *edge, const float a[3], const float b[3]) {  // {{{
+	float ba[3];
+	uchar i;
+
+	memcpy(edge->a, a, sizeof(edge->a));
+	memcpy(edge->b, b, sizeof(edge->b));
+
+	cross(edge->n, a, b);
+	normalize(edge->n);
+
+	edge->cos_ab = dot(a, b);
+	edge->angle_ab = acosf(edge->cos_ab);
+	edge->sin_ab = sqrtf(1 - edge->cos_ab * edge->cos_ab);
+	edge->tan_ab = edge->sin_ab / edge->cos_ab;
+	edge->dist_ab = sqrtf(2 - 2 * edge->cos_ab);
+
+	// X axis is a, Y axis is perpendicular to a, inside the a-b plane
+	cross(edge->y_axis, a, edge->n);
+	normalize(edge->y_axis);
+	for (i = 0; i < 3; i++) {
+		ba[i] = b[i] - a[i];
+	}
+	edge->ba_x = dot(ba, a);
+	edge->ba_y = dot(ba, edge->y_axis);
+}  // }}}
+
+static void prepare_linear(ProjectionContext *ctx) {  // {{{
+	// Same as the three-corner mouse_update_projection_basis() in mouseemu.c
+	const float *a = ctx->corners[0];
+	float e1[3], e2[3];
+	uchar i;
+
+	for (i = 0; i < 3; i++) {
+		e1[i] = ctx->corners[1][i] - a[i];
+		e2[i] = ctx->corners[2][i] - a[i];
+	}
+	cross(ctx->linear[0], e2, a);
+	cross(ctx->linear[1], a, e1);
+	cross(ctx->linear[2], e1, e2);
+}  // }}}
+
+static void prepare_homography(ProjectionContext *ctx) {  // {{{
+	// Same as the four-corner mouse_update_projection_basis() in mouseemu.c
+	float crosses[3][3];
+	float k[3];
+	uchar i, j;
+
+	#define A ctx->corners[0]
+	#define B ctx->corners[1]
+	#define C ctx->corners[2]
+	#define D ctx->corners[3]
+	cross(crosses[0], B, C);
+	cross(crosses[1], C, A);
+	cross(crosses[2], A, B);
+	for (i = 0; i < 3; i++) {
+		k[i] = dot(D, crosses[i]);
+	}
+	#undef A
+	#undef B
+	#undef C
+	#undef D
+
+	for (j = 0; j < 3; j++) {
+		crosses[0][j] *= k[1] * k[2];
+		crosses[1][j] *= k[0] * k[2];
+		crosses[2][j] *= k[0] * k[1];
+	}
+	for (j = 0; j < 3; j++) {
+		ctx->homography[0][j] = crosses[1][j];
+		ctx->homography[1][j] = crosses[2][j];
+		ctx->homography[2][j] = crosses[1][j] + crosses[2][j] - crosses[0][j];
+	}
+}  // }}}
+
+void projection_prepare(ProjectionContext *ctx, const SensorEepromData *e) {  // {{{
+	uchar i;
+
+	for (i = 0; i < 4; i++) {
+		ctx->corners[i][0] = e->corners[i].x;
+		ctx->corners[i][1] = e->corners[i].y;
+		ctx->corners[i][2] = e->corners[i].z;
+		normalize(ctx->corners[i]);
+	}
+
+	#define TOPLEFT     ctx->corners[0]
+	#define TOPRIGHT    ctx->corners[1]
+	#define BOTTOMLEFT  ctx->corners[2]
+	#define BOTTOMRIGHT ctx->corners[3]
+	prepare_edge(&ctx->edges[PROJECTION_EDGE_TOP],    TOPLEFT,     TOPRIGHT);
+	prepare_edge(&ctx->edges[PROJECTION_EDGE_RIGHT],  TOPRIGHT,    BOTTOMRIGHT);
+	prepare_edge(&ctx->edges[PROJECTION_EDGE_BOTTOM], BOTTOMRIGHT, BOTTOMLEFT);
+	prepare_edge(&ctx->edges[PROJECTION_EDGE_LEFT],   BOTTOMLEFT,  TOPLEFT);
+	#undef TOPLEFT
+	#undef TOPRIGHT
+	#undef BOTTOMLEFT
+	#undef BOTTOMRIGHT
+
+	prepare_linear(ctx);
+	prepare_homography(ctx);
+}  // }}}
+
+// }}}
+
+
+// Conversion  {{{
+
+static uchar single_edge_interpolation(const ProjectionEdge *edge, const float c[3], uchar using, float *result) {  // {{{
+	// Returns how close to a is the projection of c onto the a-b plane, as
+	// a value between 0.0 (at a) and 1.0 (at b).
+	// Returns 0 if c is at the opposite side of n, when looking at the
+	// plane a-b. See convert_coordinates.py for a nice drawing.
+
+	float n_dot_c;
+	float c_proj[3];
+	float c_proj_norm;
+	float cos_ac, cos_bc;
+	uchar i;
+
+	n_dot_c = dot(edge->n, c);
+	if (n_dot_c < 0) {
+		return 0;
+	}
+
+	// Projection of c onto the a-b plane
+	for (i = 0; i < 3; i++) {
+		c_proj[i] = c[i] - n_dot_c * edge->n[i];
+	}
+	c_proj_norm = sqrtf(dot(c_proj, c_proj));
+
+	cos_ac = dot(edge->a, c_proj) / c_proj_norm;
+	cos_bc = dot(edge->b, c_proj) / c_proj_norm;
+
+	// Written this way, so that NaN also fails.
+	if (!(   cos_ac >= -1 && cos_ac <= 1
+		  && cos_bc >= -1 && cos_bc <= 1)
+	) {
+		return 0;
+	}
+
+	switch (using) {
+		case USING_ANGLE:
+			*result = acosf(cos_ac) / edge->angle_ab;
+			break;
+		case USING_COS:
+			*result = (1 - cos_ac) / (1 - edge->cos_ab);
+			break;
+		case USING_SIN:
+			*result = sqrtf(1 - cos_ac * cos_ac) / edge->sin_ab;
+			break;
+		case USING_TAN:
+			*result = (sqrtf(1 - cos_ac * cos_ac) / cos_ac) / edge->tan_ab;
+			break;
+		case USING_DIST:
+			*result = sqrtf(2 - 2 * cos_ac) / edge->dist_ab;
+			break;
+		case USING_EXACT: {
+			// Intersection between the line a + alpha*(b-a) and the line
+			// beta*c_proj, in the 2D coordinate system of the a-b plane:
+			//   alpha*ba_x - beta*c_x = -1
+			//   alpha*ba_y - beta*c_y = 0
+			float c_x = dot(c_proj, edge->a);
+			float c_y = dot(c_proj, edge->y_axis);
+			float det = c_x * edge->ba_y - edge->ba_x * c_y;
+			if (det == 0) {
+				return 0;
+			}
+			*result = c_y / det;
+			break;
+		}
+		default:
+			return 0;
+	}
+
+	return 1;
+}  // }}}
+
+static uchar interpolation_using_2_edges(const ProjectionContext *ctx, const float p[3], uchar using, float *x, float *y) {  // {{{
+	// This is a very bad approximation
+	if (   !single_edge_interpolation(&ctx->edges[PROJECTION_EDGE_TOP],  p, using, x)
+		|| !single_edge_interpolation(&ctx->edges[PROJECTION_EDGE_LEFT], p, using, y)
+	) {
+		return 0;
+	}
+	*y = 1 - *y;
+	return 1;
+}  // }}}
+
+static uchar interpolation_using_4_edges(const ProjectionContext *ctx, const float p[3], uchar using, float *x, float *y) {  // {{{
+	// Traces a line joining the projections at the top and bottom edges,
+	// and another joining the left and right edges. See
+	// convert_coordinates.py for the math.
+	float ab, bc, dc, ad;
+
+	if (   !single_edge_interpolation(&ctx->edges[PROJECTION_EDGE_TOP],    p, using, &ab)
+		|| !single_edge_interpolation(&ctx->edges[PROJECTION_EDGE_RIGHT],  p, using, &bc)
+		|| !single_edge_interpolation(&ctx->edges[PROJECTION_EDGE_BOTTOM], p, using, &dc)
+		|| !single_edge_interpolation(&ctx->edges[PROJECTION_EDGE_LEFT],   p, using, &ad)
+	) {
+		return 0;
+	}
+
+	dc = 1 - dc;
+	ad = 1 - ad;
+
+	*x = (ad * (dc - ab) + ab) / (1 - (bc - ad) * (dc - ab));
+	*y = *x * (bc - ad) + ad;
+	return 1;
+}  // }}}
+
+static uchar interpolation_using_basis(const float rows[3][3], const float p[3], float *x, float *y) {  // {{{
+	float w = dot(p, rows[2]);
+
+	if (w == 0) {
+		// Singular
+		return 0;
+	}
+	w = 1 / w;
+	*x = dot(p, rows[0]) * w;
+	*y = dot(p, rows[1]) * w;
+	return 1;
+}  // }}}
+
+uchar projection_convert(const ProjectionContext *ctx, uchar method, const XYZVector *vec, float *x, float *y) {  // {{{
+	float p[3];
+
+	p[0] = vec->x;
+	p[1] = vec->y;
+	p[2] = vec->z;
+
+	switch (method) {
+		case PROJECTION_2EDGES_ANGLE:
+		case PROJECTION_2EDGES_COS:
+		case PROJECTION_2EDGES_SIN:
+		case PROJECTION_2EDGES_TAN:
+		case PROJECTION_2EDGES_DIST:
+		case PROJECTION_2EDGES_EXACT:
+			return interpolation_using_2_edges(ctx, p, method - PROJECTION_2EDGES_ANGLE, x, y);
+
+		case PROJECTION_4EDGES_ANGLE:
+		case PROJECTION_4EDGES_COS:
+		case PROJECTION_4EDGES_SIN:
+		case PROJECTION_4EDGES_TAN:
+		case PROJECTION_4EDGES_DIST:
+		case PROJECTION_4EDGES_EXACT:
+			return interpolation_using_4_edges(ctx, p, method - PROJECTION_4EDGES_ANGLE, x, y);
+
+		case PROJECTION_LINEAR:
+			return interpolation_using_basis(ctx->linear, p, x, y);
+
+		case PROJECTION_HOMOGRAPHY:
+			return interpolation_using_basis(ctx->homography, p, x, y);
+
+		default:
+			return 0;
+	}
+}  // }}}
+
+const char* projection_method_name(uchar method) {  // {{{
+	if (method < PROJECTION_FIRST_METHOD || method > PROJECTION_LAST_METHOD) {
+		return NULL;
+	}
+	return method_names[method];
+}  // }}}
+
+// }}}
+
+// vim:noexpandtab tabstop=4 shiftwidth=4 foldmethod=marker foldmarker={{{,}}}
@@ -0,0 +1,93 @@
+/* Name: projection_methods.h
+ *
+ * See the .c file for more information
+ */
+
+#ifndef __projection_methods_h_included__
+#define __projection_methods_h_included__
+
+#include "common.h"
+#include "sensor.h"
+
+
+// Methods, numbered as the -a option of convert_coordinates.py.
+// Edge interpolation using 2 edges (topleft-topright and bottomleft-topleft)
+#define PROJECTION_2EDGES_ANGLE  1
+#define PROJECTION_2EDGES_COS    2
+#define PROJECTION_2EDGES_SIN    3
+#define PROJECTION_2EDGES_TAN    4
+#define PROJECTION_2EDGES_DIST   5
+#define PROJECTION_2EDGES_EXACT  6
+// Edge interpolation using all 4 edges
+#define PROJECTION_4EDGES_ANGLE  7
+#define PROJECTION_4EDGES_COS    8
+#define PROJECTION_4EDGES_SIN    9
+#define PROJECTION_4EDGES_TAN   10
+#define PROJECTION_4EDGES_DIST  11
+#define PROJECTION_4EDGES_EXACT 12
+// Linear equation system, using 3 corners (same as linear_eq_conversion)
+#define PROJECTION_LINEAR       13
+// Not in convert_coordinates.py: homography, using 4 corners (same as
+// mouseemu.c with ENABLE_HOMOGRAPHY)
+#define PROJECTION_HOMOGRAPHY   14
+
+#define PROJECTION_FIRST_METHOD  1
+#define PROJECTION_LAST_METHOD  14
+
+
+// Values derived from two corners, for single_edge_interpolation()
+typedef struct ProjectionEdge {
+	// Unit vectors
+	float a[3];
+	float b[3];
+	// Unit vector normal to the plane of a and b
+	float n[3];
+
+	// Measures of the a-b edge, used as the denominator of each method
+	float cos_ab;
+	float angle_ab;
+	float sin_ab;
+	float tan_ab;
+	float dist_ab;
+
+	// (b - a) in a 2D coordinate system of the a-b plane, where a is (1, 0)
+	float ba_x;
+	float ba_y;
+	// Unit vector of the Y axis of that coordinate system
+	float y_axis[3];
+} ProjectionEdge;
+
+// Index of ProjectionContext.edges[]
+#define PROJECTION_EDGE_TOP    0  // topleft     -> topright
+#define PROJECTION_EDGE_RIGHT  1  // topright    -> bottomright
+#define PROJECTION_EDGE_BOTTOM 2  // bottomright -> bottomleft
+#define PROJECTION_EDGE_LEFT   3  // bottomleft  -> topleft
+
+typedef struct ProjectionContext {
+	// Calibration corners as unit vectors, same order as
+	// SensorEepromData.corners
+	float corners[4][3];
+
+	ProjectionEdge edges[4];
+
+	// Rows of the projection matrix for PROJECTION_LINEAR and
+	// PROJECTION_HOMOGRAPHY. u = P.rows[0] / P.rows[2], v = P.rows[1] / P.rows[2]
+	float linear[3][3];
+	float homography[3][3];
+} ProjectionContext;
+
+
+// Must be called whenever the corners change.
+void projection_prepare(ProjectionContext *ctx, const SensorEepromData *e);
+
+// Converts a sensor vector into screen coordinates, where 0.0 and 1.0 are
+// the screen borders. The coordinates are not clamped.
+// Returns 0 if the method can't convert this vector.
+uchar projection_convert(const ProjectionContext *ctx, uchar method, const XYZVector *p, float *x, float *y);
+
+const char* projection_method_name(uchar method);
+
+
+#endif  // __projection_methods_h_included__
+
+// vim:noexpandtab tabstop=4 shiftwidth=4 foldmethod=marker foldmarker={{{,}}}
@@ -0,0 +1,397 @@
+/* Name: projection_sweep.c
+ * Project: atmega8-magnetometer-usb-mouse
+ * Tabsize: 4
+ * License: GNU GPL v2 or GNU GPL v3
+ *
+ * Accuracy of every method from projection_methods.c over a grid of
+ * calibration pyramids, replacing the manual runs of
+ * generate_sphere_vectors.py and render_images.sh.
+ *
+ * For each configuration (aperture x offset x noise), the samples are
+ * generated by sphere_vectors.c and converted by each method. The result is
+ * a single table, with one line per configuration and method:
+ *   P T p t noise method samples failed% flat_mean flat_max angular_mean angular_max
+ * The errors are percentages of the screen size, the same as in
+ * projection_bench.c.
+ *
+ * Usage:
+ *   projection_sweep [options]
+ * Options (LIST is either "a,b,c" or "start:stop:step", inclusive):
+ *   -P LIST     Phi (horizontal) apertures (default: 30,45,60,75,85).
+ *   -T LIST     Theta (vertical) apertures. By default, the same as phi,
+ *               giving square pyramids (P30T30, P45T45...), just like
+ *               render_images.sh. If given, all combinations are used.
+ *   -p LIST     Phi offsets (default: 0).
+ *   -t LIST     Theta offsets (default: 0).
+ *   -n LIST     Noise, as the standard deviation in sensor units
+ *               (default: 0).
+ *   -m LIST     Methods, numbered as in projection_methods.h (default: all).
+ *   -r RADIUS   Radius of the sphere (default: 200).
+ *   -s SEED     Seed for the noise (default: 1). Each configuration gets
+ *               the same seed, so the results don't depend on the order.
+ *   -j N        Number of worker processes (default: number of CPUs).
+ *   -o FILE     Writes the table to FILE instead of stdout.
+ *
+ * Same as mouseemu_sweep.c, the workers are processes (fork) taking
+ * configurations from a shared counter, and writing the results into shared
+ * memory.
+ */
+
+// For MAP_ANONYMOUS, clock_gettime() and getopt()
+#define _DEFAULT_SOURCE
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "projection_methods.h"
+#include "sphere_vectors.h"
+
+
+#define MAX_LIST 256
+
+typedef struct SweepList {
+	double values[MAX_LIST];
+	int count;
+} SweepList;
+
+typedef struct SweepConfig {
+	int phi_aperture;
+	int theta_aperture;
+	int phi_offset;
+	int theta_offset;
+	double noise;
+} SweepConfig;
+
+typedef struct SweepResult {
+	long samples;
+	// One per method in the "methods" list
+	SphereErrors errors[PROJECTION_LAST_METHOD];
+} SweepResult;
+
+
+static SweepConfig *configs;
+static int configs_count;
+
+static uchar methods[PROJECTION_LAST_METHOD];
+static int methods_count;
+
+static int radius = 200;
+static unsigned long seed = 1;
+
+// Shared memory
+static SweepResult *results;
+
+
+static double now() {  // {{{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}  // }}}
+
+static void* shared_alloc(size_t size) {  // {{{
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	return p;
+}  // }}}
+
+
+// Options  {{{
+
+static int parse_list(const char *s, SweepList *list) {  // {{{
+	// Parses "a,b,c" or "start:stop:step" (inclusive).
+	double start, stop, step;
+	char *end;
+
+	list->count = 0;
+
+	if (sscanf(s, "%lf:%lf:%lf", &start, &stop, &step) == 3) {
+		double v;
+		if (step == 0 || (stop - start) / step < 0) {
+			return 0;
+		}
+		// Small tolerance, so that 0:1:0.1 includes 1.
+		for (v = start; step > 0 ? v <= stop + step * 1e-9 : v >= stop + step * 1e-9; v += step) {
+			if (list->count == MAX_LIST) {
+				return 0;
+			}
+			list->values[list->count++] = v;
+		}
+		return 1;
+	}
+
+	while (*s) {
+		if (list->count == MAX_LIST) {
+			return 0;
+		}
+		list->values[list->count++] = strtod(s, &end);
+		if (end == s || (*end != ',' && *end != '\0')) {
+			return 0;
+		}
+		s = (*end == ',') ? end + 1 : end;
+	}
+	return list->count > 0;
+}  // }}}
+
+static int build_configs(const SweepList *phi_apertures, const SweepList *theta_apertures, const SweepList *phi_offsets, const SweepList *theta_offsets, const SweepList *noises) {  // {{{
+	// If theta_apertures is NULL, each phi aperture is paired with the same
+	// theta aperture.
+	int ta_count = theta_apertures ? theta_apertures->count : 1;
+	int pa, ta, po, to, n;
+
+	configs = malloc(
+		phi_apertures->count * ta_count * phi_offsets->count
+		* theta_offsets->count * noises->count * sizeof(*configs)
+	);
+	if (configs == NULL) {
+		fputs("Out of memory\n", stderr);
+		return 0;
+	}
+
+	for (pa = 0; pa < phi_apertures->count; pa++) {
+		for (ta = 0; ta < ta_count; ta++) {
+			for (po = 0; po < phi_offsets->count; po++) {
+				for (to = 0; to < theta_offsets->count; to++) {
+					for (n = 0; n < noises->count; n++) {
+						SweepConfig *c = &configs[configs_count++];
+						c->phi_aperture = (int) phi_apertures->values[pa];
+						c->theta_aperture = theta_apertures ? (int) theta_apertures->values[ta] : c->phi_aperture;
+						c->phi_offset = (int) phi_offsets->values[po];
+						c->theta_offset = (int) theta_offsets->values[to];
+						c->noise = noises->values[n];
+
+						if (c->phi_aperture < 2 || c->theta_aperture < 2 || c->noise < 0) {
+							fputs("Apertures must be at least 2, and noise can't be negative.\n", stderr);
+							return 0;
+						}
+					}
+				}
+			}
+		}
+	}
+	return 1;
+}  // }}}
+
+// }}}
+
+
+// Workers  {{{
+
+static void run_config(int index) {  // {{{
+	const SweepConfig *c = &configs[index];
+	SweepResult *r = &results[index];
+	SphereOptions o;
+	SensorEepromData e;
+	ProjectionContext ctx;
+	SphereSample *samples;
+	int m;
+
+	sphere_default_options(&o);
+	o.radius = radius;
+	o.phi_aperture = c->phi_aperture;
+	o.theta_aperture = c->theta_aperture;
+	o.phi_offset = c->phi_offset;
+	o.theta_offset = c->theta_offset;
+	o.noise = c->noise;
+	o.seed = seed;
+
+	samples = sphere_generate(&o, &e, &r->samples);
+	if (samples == NULL) {
+		fputs("Out of memory\n", stderr);
+		_exit(1);
+	}
+	projection_prepare(&ctx, &e);
+
+	for (m = 0; m < methods_count; m++) {
+		sphere_measure_errors(&ctx, methods[m], samples, r->samples, &r->errors[m]);
+	}
+
+	free(samples);
+}  // }}}
+
+static int run_workers(int workers_count) {  // {{{
+	// Each worker takes the next configuration from a shared counter, until
+	// all of them are done.
+
+	int *next_config;
+	int w, failed = 0;
+
+	next_config = shared_alloc(sizeof(*next_config));
+	*next_config = 0;
+
+	if (workers_count > configs_count) {
+		workers_count = configs_count;
+	}
+
+	fflush(NULL);
+	for (w = 0; w < workers_count; w++) {
+		pid_t pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			return 0;
+		}
+		if (pid == 0) {
+			int index;
+			while ((index = __atomic_fetch_add(next_config, 1, __ATOMIC_RELAXED)) < configs_count) {
+				run_config(index);
+			}
+			_exit(0);
+		}
+	}
+
+	for (w = 0; w < workers_count; w++) {
+		int status;
+		if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			failed = 1;
+		}
+	}
+	if (failed) {
+		fputs("A worker process failed.\n", stderr);
+		return 0;
+	}
+	return 1;
+}  // }}}
+
+// }}}
+
+
+static void print_results(FILE *f) {  // {{{
+	int i, m;
+
+	fprintf(f, "# %3s %3s %4s %4s %6s %-14s %7s %7s %9s %9s %9s %9s\n",
+		"P", "T", "p", "t", "noise", "method", "samples", "failed%",
+		"flat_mean", "flat_max", "ang_mean", "ang_max");
+
+	for (i = 0; i < configs_count; i++) {
+		const SweepConfig *c = &configs[i];
+		const SweepResult *r = &results[i];
+
+		for (m = 0; m < methods_count; m++) {
+			const SphereErrors *err = &r->errors[m];
+
+			fprintf(f, "%5d %3d %4d %4d %6.2f %-14s %7ld %7.2f %9.3f %9.3f %9.3f %9.3f\n",
+				c->phi_aperture,
+				c->theta_aperture,
+				c->phi_offset,
+				c->theta_offset,
+				c->noise,
+				projection_method_name(methods[m]),
+				r->samples,
+				err->inside_flat ? 100.0 * err->failed / err->inside_flat : 0.0,
+				err->converted_flat ? 100 * err->flat_sum / err->converted_flat : NAN,
+				100 * err->flat_max,
+				err->converted_angular ? 100 * err->angular_sum / err->converted_angular : NAN,
+				100 * err->angular_max
+			);
+		}
+	}
+}  // }}}
+
+static void usage(const char *argv0) {  // {{{
+	fprintf(stderr,
+		"Usage: %s [-P LIST] [-T LIST] [-p LIST] [-t LIST] [-n LIST] [-m LIST]\n"
+		"       [-r radius] [-s seed] [-j workers] [-o output]\n"
+		"LIST is either \"a,b,c\" or \"start:stop:step\". See the source for details.\n",
+		argv0
+	);
+}  // }}}
+
+int main(int argc, char *argv[]) {  // {{{
+	SweepList phi_apertures, theta_apertures, phi_offsets, theta_offsets, noises, method_list;
+	int has_theta_apertures = 0, has_methods = 0;
+	const char *output = NULL;
+	FILE *f = stdout;
+	long workers_count;
+	double start;
+	int opt, i;
+
+	parse_list("30,45,60,75,85", &phi_apertures);
+	parse_list("0", &phi_offsets);
+	parse_list("0", &theta_offsets);
+	parse_list("0", &noises);
+
+	workers_count = sysconf(_SC_NPROCESSORS_ONLN);
+	if (workers_count < 1) {
+		workers_count = 1;
+	}
+
+	while ((opt = getopt(argc, argv, "P:T:p:t:n:m:r:s:j:o:")) != -1) {
+		SweepList *list = NULL;
+		switch (opt) {
+			case 'P': list = &phi_apertures; break;
+			case 'T': list = &theta_apertures; has_theta_apertures = 1; break;
+			case 'p': list = &phi_offsets; break;
+			case 't': list = &theta_offsets; break;
+			case 'n': list = &noises; break;
+			case 'm': list = &method_list; has_methods = 1; break;
+			case 'r': radius = atoi(optarg); break;
+			case 's': seed = strtoul(optarg, NULL, 10); break;
+			case 'j': workers_count = atol(optarg); break;
+			case 'o': output = optarg; break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+		if (list && !parse_list(optarg, list)) {
+			fprintf(stderr, "Invalid list: %s\n", optarg);
+			return 1;
+		}
+	}
+	if (optind != argc || radius <= 0 || workers_count < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (has_methods) {
+		for (i = 0; i < method_list.count; i++) {
+			int m = (int) method_list.values[i];
+			if (m < PROJECTION_FIRST_METHOD || m > PROJECTION_LAST_METHOD || methods_count == PROJECTION_LAST_METHOD) {
+				fprintf(stderr, "Invalid method: %g\n", method_list.values[i]);
+				return 1;
+			}
+			methods[methods_count++] = m;
+		}
+	} else {
+		for (i = PROJECTION_FIRST_METHOD; i <= PROJECTION_LAST_METHOD; i++) {
+			methods[methods_count++] = i;
+		}
+	}
+
+	if (!build_configs(&phi_apertures, has_theta_apertures ? &theta_apertures : NULL, &phi_offsets, &theta_offsets, &noises)) {
+		return 1;
+	}
+
+	if (output) {
+		f = fopen(output, "w");
+		if (f == NULL) {
+			perror(output);
+			return 1;
+		}
+	}
+
+	results = shared_alloc(configs_count * sizeof(*results));
+
+	start = now();
+	if (!run_workers(workers_count)) {
+		return 1;
+	}
+
+	fprintf(f, "# radius %d, seed %lu, %d configurations, %d methods, %ld workers, %.2f s\n",
+		radius, seed, configs_count, methods_count, workers_count, now() - start);
+	print_results(f);
+
+	if (f != stdout) {
+		fclose(f);
+	}
+	return 0;
+}  // }}}
+
+// vim:noexpandtab tabstop=4 shiftwidth=4 foldmethod=marker foldmarker={{{,}}}
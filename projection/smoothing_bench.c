@@ -0,0 +1,315 @@
+/* Name: smoothing_bench.c
+ * Project: atmega8-magnetometer-usb-mouse
+ * Tabsize: 4
+ * License: GNU GPL v2 or GNU GPL v3
+ *
+ * Measures how the smoothing filter from mouseemu.c (apply_smoothing())
+ * behaves on a recorded capture (see capture_format.h): how much the
+ * pointer shakes while the sensor is held still, and how far behind it
+ * stays while the sensor moves.
+ *
+ * Each sample is projected by mouse_project(), exactly like the firmware,
+ * and the unsmoothed positions are also kept. The "true" path of the
+ * pointer is estimated by a centered moving average of the unsmoothed
+ * positions (2 * W + 1 samples, non-causal, thus without lag), and its
+ * speed from the capture timestamps. Only the samples that could be
+ * converted are used; the others are skipped, like the firmware does.
+ *
+ * - At rest (true speed below "-r" screens per second): the jitter is the
+ *   RMS of the distance between consecutive reports, for both the raw and
+ *   the smoothed positions.
+ * - Moving (true speed above "-f" screens per second): the lag is the mean
+ *   distance between the report and the true path, in units of the
+ *   0..32767 range, and in milliseconds (distance divided by speed). The
+ *   raw positions are not exactly on the true path either, because of the
+ *   noise, so their distance is printed too.
+ * - Edge and centre (true speed below "-f"): the jitter is the RMS of the
+ *   second difference between consecutive reports, which is small for
+ *   smooth movements, thus slow movements count too. The edge region is
+ *   the border of the screen, "-m" screens wide (measured on the true
+ *   path), where the projection amplifies the noise the most.
+ *
+ * The same source-code is compiled by the Makefile once for each filter
+ * (see ENABLE_ONE_EURO, ENABLE_KALMAN, ENABLE_PREDICTION and
+ * ENABLE_DIRECTION_FILTER in mouseemu.c), and they can be compared with:
+ *   make compare_smoothing
+ *
+ * Usage:
+ *   smoothing_bench [-w W] [-r rest_speed] [-f fast_speed] [-m margin] capture
+ */
+
+// For getopt()
+#define _DEFAULT_SOURCE
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// The firmware code, compiled for the PC.
+// Including the .c file gives access to the static functions and variables.
+#include "../firmware/mouseemu.c"
+
+#include "capture_format.h"
+
+
+// Globals that would come from other firmware modules.
+SensorData sensor;
+ButtonState button;
+
+
+typedef struct BenchSample {
+	// Capture record
+	uint64_t record;
+	// Seconds since the beginning of the capture
+	double time;
+	// Positions in units of the 0..32767 range
+	double raw_x, raw_y;
+	double out_x, out_y;
+	double true_x, true_y;
+	// Screens per second
+	double speed;
+} BenchSample;
+
+static BenchSample *samples;
+static long samples_count;
+
+static int window = 4;
+static double rest_speed = 0.2;
+static double fast_speed = 1.0;
+static double edge_margin = 0.3;
+
+
+static void apply_record_corner(const CaptureRecord *r) {  // {{{
+	int c = capture_record_corner(r);
+
+	sensor.e.corners[c].x = r->x;
+	sensor.e.corners[c].y = r->y;
+	sensor.e.corners[c].z = r->z;
+	sensor.corners_changed = 1;
+}  // }}}
+
+static int replay(const CaptureFile *cap) {  // {{{
+	// Runs every sample through the projection and the smoothing, in the
+	// same order as the firmware.
+	const CaptureHeader *h = cap->header;
+	uint64_t i;
+	uint32_t prev_ts = 0;
+	double t = 0;
+	int c;
+
+	samples = malloc((cap->count + 1) * sizeof(*samples));
+	if (samples == NULL) {
+		fputs("Out of memory\n", stderr);
+		return 0;
+	}
+
+	for (c = 0; c < 4; c++) {
+		if (h->calibration_flags & (1 << c)) {
+			sensor.e.corners[c].x = h->calibration.corners[c][0];
+			sensor.e.corners[c].y = h->calibration.corners[c][1];
+			sensor.e.corners[c].z = h->calibration.corners[c][2];
+		}
+	}
+	sensor.corners_changed = 1;
+	init_mouse_emulation();
+
+	for (i = 0; i < cap->count; i++) {
+		const CaptureRecord *r = &cap->records[i];
+		XYZVector v;
+		coord_t u, w;
+
+		// Timestamps wrap around, only the differences are meaningful.
+		if (i > 0) {
+			t += (uint32_t) (r->timestamp_us - prev_ts) * 1e-6;
+		}
+		prev_ts = r->timestamp_us;
+
+		if (capture_record_corner(r) >= 0) {
+			apply_record_corner(r);
+			continue;
+		}
+#if ENABLE_ONE_EURO || ENABLE_PREDICTION
+		// As mouse_update_axes() does for each sample. Timer1 runs at
+		// F_CPU/64, that is 3/16 of a tick per microsecond.
+		mouse_track_sample_interval((uint16_t) ((uint64_t) r->timestamp_us * 3 / 16));
+#endif
+		if (r->flags & CAPTURE_FLAG_OVERFLOW) {
+			continue;
+		}
+
+		v.x = r->x;
+		v.y = r->y;
+		v.z = r->z;
+		if (!mouse_axes_linear_equation_system(&v)) {
+			continue;
+		}
+		// Same projection again, without the smoothing. With
+		// ENABLE_DIRECTION_FILTER, the raw sample may be out-of-bounds.
+		if (!mouse_project(&v, &u, &w)) {
+			continue;
+		}
+
+		samples[samples_count].record = i;
+		samples[samples_count].time = t;
+		samples[samples_count].raw_x = (double) u / COORD_ONE * 32767;
+		samples[samples_count].raw_y = (double) w / COORD_ONE * 32767;
+		samples[samples_count].out_x = mouse_report.x;
+		samples[samples_count].out_y = mouse_report.y;
+		samples_count++;
+	}
+	return 1;
+}  // }}}
+
+static void estimate_true_path() {  // {{{
+	long i, j;
+
+	for (i = 0; i < samples_count; i++) {
+		long from = i - window, to = i + window;
+		double sx = 0, sy = 0;
+
+		if (from < 0) from = 0;
+		if (to >= samples_count) to = samples_count - 1;
+		for (j = from; j <= to; j++) {
+			sx += samples[j].raw_x;
+			sy += samples[j].raw_y;
+		}
+		samples[i].true_x = sx / (to - from + 1);
+		samples[i].true_y = sy / (to - from + 1);
+	}
+
+	for (i = 0; i < samples_count; i++) {
+		long a = i > 0 ? i - 1 : i;
+		long b = i + 1 < samples_count ? i + 1 : i;
+		double dt = samples[b].time - samples[a].time;
+
+		samples[i].speed = dt > 0
+			? hypot(samples[b].true_x - samples[a].true_x, samples[b].true_y - samples[a].true_y) / 32767 / dt
+			: 0;
+	}
+}  // }}}
+
+static double second_difference(double a, double b, double c) {  // {{{
+	return a - 2 * b + c;
+}  // }}}
+
+static uchar in_edge_region(const BenchSample *s) {  // {{{
+	double m = edge_margin * 32767;
+	return s->true_x < m || s->true_x > 32767 - m
+		|| s->true_y < m || s->true_y > 32767 - m;
+}  // }}}
+
+static void print_statistics() {  // {{{
+	long i, rest = 0, moving = 0;
+	double raw_jitter = 0, out_jitter = 0;
+	double raw_lag = 0, lag = 0, lag_ms = 0, lag_max = 0;
+	// Index 0 for the centre, 1 for the edge region
+	long region_count[2] = {0, 0};
+	double region_raw[2] = {0, 0}, region_out[2] = {0, 0};
+
+	for (i = 1; i < samples_count; i++) {
+		const BenchSample *s = &samples[i];
+		const BenchSample *p = &samples[i - 1];
+
+		if (s->speed < rest_speed && p->speed < rest_speed) {
+			double rx = s->raw_x - p->raw_x, ry = s->raw_y - p->raw_y;
+			double ox = s->out_x - p->out_x, oy = s->out_y - p->out_y;
+
+			raw_jitter += rx * rx + ry * ry;
+			out_jitter += ox * ox + oy * oy;
+			rest++;
+		}
+		if (s->speed > fast_speed) {
+			double d = hypot(s->out_x - s->true_x, s->out_y - s->true_y);
+
+			raw_lag += hypot(s->raw_x - s->true_x, s->raw_y - s->true_y);
+			lag += d;
+			lag_ms += d / 32767 / s->speed * 1000;
+			if (d > lag_max) lag_max = d;
+			moving++;
+		}
+		// Only for consecutive samples
+		if (i >= 2 && s->record - samples[i - 2].record == 2 && p->speed < fast_speed) {
+			const BenchSample *q = &samples[i - 2];
+			uchar edge = in_edge_region(p);
+			double rx = second_difference(s->raw_x, p->raw_x, q->raw_x);
+			double ry = second_difference(s->raw_y, p->raw_y, q->raw_y);
+			double ox = second_difference(s->out_x, p->out_x, q->out_x);
+			double oy = second_difference(s->out_y, p->out_y, q->out_y);
+
+			region_raw[edge] += rx * rx + ry * ry;
+			region_out[edge] += ox * ox + oy * oy;
+			region_count[edge]++;
+		}
+	}
+
+	printf("# ENABLE_ONE_EURO %d, ENABLE_KALMAN %d, ENABLE_PREDICTION %d, ENABLE_DIRECTION_FILTER %d, ENABLE_FIXED_POINT %d\n",
+		ENABLE_ONE_EURO, ENABLE_KALMAN, ENABLE_PREDICTION, ENABLE_DIRECTION_FILTER, ENABLE_FIXED_POINT);
+	printf("# window %d, rest < %g, fast > %g screens/s, edge margin %g\n",
+		2 * window + 1, rest_speed, fast_speed, edge_margin);
+	printf("converted samples    %9ld\n", samples_count);
+	printf("at rest              %9ld\n", rest);
+	if (rest) {
+		printf("raw jitter (RMS)     %9.1f\n", sqrt(raw_jitter / rest));
+		printf("jitter (RMS)         %9.1f\n", sqrt(out_jitter / rest));
+	}
+	printf("moving fast          %9ld\n", moving);
+	if (moving) {
+		printf("raw lag (mean)       %9.1f\n", raw_lag / moving);
+		printf("lag (mean)           %9.1f\n", lag / moving);
+		printf("lag (max)            %9.1f\n", lag_max);
+		printf("lag (mean ms)        %9.1f\n", lag_ms / moving);
+	}
+	for (i = 0; i < 2; i++) {
+		printf("%-6s samples       %9ld\n", i ? "edge" : "centre", region_count[i]);
+		if (region_count[i]) {
+			printf("%-6s raw jitter    %9.1f\n", i ? "edge" : "centre", sqrt(region_raw[i] / region_count[i]));
+			printf("%-6s jitter        %9.1f\n", i ? "edge" : "centre", sqrt(region_out[i] / region_count[i]));
+		}
+	}
+}  // }}}
+
+static void usage(const char *argv0) {  // {{{
+	fprintf(stderr,
+		"Usage: %s [-w W] [-r rest_speed] [-f fast_speed] [-m margin] capture\n",
+		argv0
+	);
+}  // }}}
+
+
+int main(int argc, char *argv[]) {  // {{{
+	CaptureFile cap;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "w:r:f:m:")) != -1) {
+		switch (opt) {
+			case 'w': window = atoi(optarg); break;
+			case 'r': rest_speed = atof(optarg); break;
+			case 'f': fast_speed = atof(optarg); break;
+			case 'm': edge_margin = atof(optarg); break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (optind + 1 != argc || window < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (!capture_open(&cap, argv[optind])) {
+		return 1;
+	}
+	if (!replay(&cap)) {
+		return 1;
+	}
+	estimate_true_path();
+	print_statistics();
+
+	free(samples);
+	capture_close(&cap);
+	return 0;
+}  // }}}
+
+// vim:noexpandtab tabstop=4 shiftwidth=4 foldmethod=marker foldmarker={{{,}}}
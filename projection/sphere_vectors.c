@@ -0,0 +1,254 @@
+/* Name: sphere_vectors.c
+ * Project: atmega8-magnetometer-usb-mouse
+ * Tabsize: 4
+ * License: GNU GPL v2 or GNU GPL v3
+ *
+ * C version of generate_sphere_vectors.py, for projection_bench.c and
+ * projection_sweep.c.
+ *
+ * The samples are generated exactly like the Python script (same options
+ * and defaults), and each sample gets two "ground truth" values, calculated
+ * in double precision from the unrounded, noiseless angles:
+ * - flat: the screen is a flat rectangle, seen from the sensor. The exact
+ *   mapping from directions to a flat screen is the homography between the
+ *   four corner directions and the four screen corners.
+ * - angular: the screen coordinates are proportional to the angles (phi,
+ *   theta) used to generate the samples, as if the screen were curved
+ *   around the sensor.
+ *
+ * Optionally, gaussian noise is added to every vector (the corners too)
+ * before rounding them, as the real sensor would do.
+ */
+
+// For M_PI
+#define _DEFAULT_SOURCE
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sphere_vectors.h"
+
+
+typedef struct NoiseState {
+	uint64_t state;
+	// Box-Muller gives two values at a time
+	double spare;
+	uchar has_spare;
+} NoiseState;
+
+
+void sphere_default_options(SphereOptions *o) {  // {{{
+	memset(o, 0, sizeof(*o));
+	o->radius = 200;
+	o->phi_aperture = 45;
+	o->theta_aperture = 45;
+	o->phi_range[0] = 90;
+	o->phi_range[1] = -91;
+	o->phi_range[2] = -1;
+	o->theta_range[0] = 45;
+	o->theta_range[1] = -45;
+	o->theta_range[2] = -2;
+	o->seed = 1;
+}  // }}}
+
+
+// Noise  {{{
+
+static double noise_uniform(NoiseState *n) {  // {{{
+	// xorshift64*, returns a value in (0, 1]
+	n->state ^= n->state >> 12;
+	n->state ^= n->state << 25;
+	n->state ^= n->state >> 27;
+	return ((n->state * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0) + (1.0 / 9007199254740992.0);
+}  // }}}
+
+static double noise_gaussian(NoiseState *n) {  // {{{
+	double r, a;
+
+	if (n->has_spare) {
+		n->has_spare = 0;
+		return n->spare;
+	}
+	r = sqrt(-2 * log(noise_uniform(n)));
+	a = 2 * M_PI * noise_uniform(n);
+	n->spare = r * sin(a);
+	n->has_spare = 1;
+	return r * cos(a);
+}  // }}}
+
+// }}}
+
+
+// Generation  {{{
+
+static void spherical_to_cartesian(const SphereOptions *o, double theta, double phi, double out[3]) {  // {{{
+	// These are not exactly the same equations as in:
+	// http://en.wikipedia.org/wiki/Spherical_coordinates
+	out[0] = o->radius * cos(theta * M_PI / 180) * cos(phi * M_PI / 180);
+	out[1] = o->radius * cos(theta * M_PI / 180) * sin(phi * M_PI / 180);
+	out[2] = o->radius * sin(theta * M_PI / 180);
+}  // }}}
+
+static void to_xyz_vector(const SphereOptions *o, NoiseState *n, const double in[3], XYZVector *out) {  // {{{
+	double v[3];
+	uchar i;
+
+	for (i = 0; i < 3; i++) {
+		v[i] = in[i];
+		if (o->noise > 0) {
+			v[i] += o->noise * noise_gaussian(n);
+		}
+	}
+
+	// Python's round() also rounds half away from zero.
+	out->x = (int) round(v[0]);
+	out->y = (int) round(v[1]);
+	out->z = (int) round(v[2]);
+}  // }}}
+
+static void cross_double(double out[3], const double a[3], const double b[3]) {  // {{{
+	out[0] = a[1] * b[2] - a[2] * b[1];
+	out[1] = a[2] * b[0] - a[0] * b[2];
+	out[2] = a[0] * b[1] - a[1] * b[0];
+}  // }}}
+
+static double dot_double(const double a[3], const double b[3]) {  // {{{
+	return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}  // }}}
+
+SphereSample* sphere_generate(const SphereOptions *o, SensorEepromData *e, long *count) {  // {{{
+	// Python 2 integer division, as in print_calibration()
+	int pitch = o->theta_aperture / 2;
+	int yaw = o->phi_aperture / 2;
+
+	// Same order as SensorEepromData.corners
+	const int offsets[4][2] = {
+		{+pitch, +yaw},  // topleft
+		{+pitch, -yaw},  // topright
+		{-pitch, +yaw},  // bottomleft
+		{-pitch, -yaw},  // bottomright
+	};
+
+	NoiseState noise;
+	SphereSample *samples;
+	double corners[4][3];
+	double crosses[3][3], k[3], h[3][3];
+	long capacity, samples_count;
+	int theta, phi, i, j;
+
+	memset(&noise, 0, sizeof(noise));
+	noise.state = o->seed * 0x9E3779B97F4A7C15ULL + 1;
+
+	memset(e, 0, sizeof(*e));
+	for (i = 0; i < 4; i++) {
+		spherical_to_cartesian(
+			o,
+			o->theta_offset + offsets[i][0],
+			o->phi_offset + offsets[i][1],
+			corners[i]
+		);
+		to_xyz_vector(o, &noise, corners[i], &e->corners[i]);
+	}
+
+	// Ground truth homography, see mouse_update_projection_basis() in
+	// mouseemu.c for the math.
+	cross_double(crosses[0], corners[1], corners[2]);
+	cross_double(crosses[1], corners[2], corners[0]);
+	cross_double(crosses[2], corners[0], corners[1]);
+	for (i = 0; i < 3; i++) {
+		k[i] = dot_double(corners[3], crosses[i]);
+	}
+	for (j = 0; j < 3; j++) {
+		h[0][j] = crosses[1][j] * k[0] * k[2];
+		h[1][j] = crosses[2][j] * k[0] * k[1];
+		h[2][j] = h[0][j] + h[1][j] - crosses[0][j] * k[1] * k[2];
+	}
+
+	capacity = 1024;
+	samples = malloc(capacity * sizeof(*samples));
+	samples_count = 0;
+	if (samples == NULL) {
+		return NULL;
+	}
+
+	#define IN_RANGE(v, r) ((r)[2] > 0 ? (v) < (r)[1] : (v) > (r)[1])
+	for (theta = o->theta_range[0]; IN_RANGE(theta, o->theta_range); theta += o->theta_range[2]) {
+		for (phi = o->phi_range[0]; IN_RANGE(phi, o->phi_range); phi += o->phi_range[2]) {
+			SphereSample *s;
+			double p[3], w;
+
+			if (samples_count == capacity) {
+				SphereSample *bigger;
+				capacity *= 2;
+				bigger = realloc(samples, capacity * sizeof(*samples));
+				if (bigger == NULL) {
+					free(samples);
+					return NULL;
+				}
+				samples = bigger;
+			}
+			s = &samples[samples_count++];
+
+			spherical_to_cartesian(o, theta, phi, p);
+			to_xyz_vector(o, &noise, p, &s->v);
+
+			w = dot_double(p, h[2]);
+			s->flat_x = dot_double(p, h[0]) / w;
+			s->flat_y = dot_double(p, h[1]) / w;
+
+			s->angular_x = (double) (o->phi_offset + yaw - phi) / (2 * yaw);
+			s->angular_y = (double) (o->theta_offset + pitch - theta) / (2 * pitch);
+		}
+	}
+	#undef IN_RANGE
+
+	*count = samples_count;
+	return samples;
+}  // }}}
+
+// }}}
+
+
+static uchar inside_screen(double x, double y) {  // {{{
+	return x >= 0 && x <= 1 && y >= 0 && y <= 1;
+}  // }}}
+
+void sphere_measure_errors(const ProjectionContext *ctx, uchar method, const SphereSample *samples, long count, SphereErrors *err) {  // {{{
+	long i;
+
+	memset(err, 0, sizeof(*err));
+
+	for (i = 0; i < count; i++) {
+		const SphereSample *s = &samples[i];
+		uchar in_flat = inside_screen(s->flat_x, s->flat_y);
+		uchar in_angular = inside_screen(s->angular_x, s->angular_y);
+		float x, y;
+		uchar ok;
+
+		err->inside_flat += in_flat;
+		err->inside_angular += in_angular;
+
+		ok = projection_convert(ctx, method, &s->v, &x, &y);
+		if (!ok || !isfinite(x) || !isfinite(y)) {
+			err->failed += in_flat;
+			continue;
+		}
+
+		if (in_flat) {
+			double d = hypot(x - s->flat_x, y - s->flat_y);
+			err->flat_sum += d;
+			if (d > err->flat_max) err->flat_max = d;
+			err->converted_flat++;
+		}
+		if (in_angular) {
+			double d = hypot(x - s->angular_x, y - s->angular_y);
+			err->angular_sum += d;
+			if (d > err->angular_max) err->angular_max = d;
+			err->converted_angular++;
+		}
+	}
+}  // }}}
+
+// vim:noexpandtab tabstop=4 shiftwidth=4 foldmethod=marker foldmarker={{{,}}}
@@ -0,0 +1,62 @@
+/* Name: sphere_vectors.h
+ *
+ * See the .c file for more information
+ */
+
+#ifndef __sphere_vectors_h_included__
+#define __sphere_vectors_h_included__
+
+#include "projection_methods.h"
+
+
+// Same options (and defaults) as generate_sphere_vectors.py, plus noise.
+typedef struct SphereOptions {
+	int radius;
+	int phi_aperture;
+	int theta_aperture;
+	int phi_offset;
+	int theta_offset;
+	// Same as Python's range(start, stop, step)
+	int phi_range[3];
+	int theta_range[3];
+
+	// Standard deviation of the gaussian noise added to each axis of each
+	// vector (including the corners), in sensor units.
+	double noise;
+	// Seed for the noise. The same seed always gives the same vectors.
+	unsigned long seed;
+} SphereOptions;
+
+typedef struct SphereSample {
+	XYZVector v;
+	// Ground truth
+	double flat_x, flat_y;
+	double angular_x, angular_y;
+} SphereSample;
+
+// Accuracy of one method over a set of samples, see
+// sphere_measure_errors(). Errors are fractions of the screen size.
+typedef struct SphereErrors {
+	long inside_flat;
+	long inside_angular;
+	// Samples inside the (flat) screen that couldn't be converted
+	long failed;
+	long converted_flat;
+	long converted_angular;
+	double flat_sum, flat_max;
+	double angular_sum, angular_max;
+} SphereErrors;
+
+
+void sphere_default_options(SphereOptions *o);
+
+// Generates the calibration corners into *e, and returns a malloc'ed array
+// of samples. Returns NULL if out of memory.
+SphereSample* sphere_generate(const SphereOptions *o, SensorEepromData *e, long *count);
+
+void sphere_measure_errors(const ProjectionContext *ctx, uchar method, const SphereSample *samples, long count, SphereErrors *err);
+
+
+#endif  // __sphere_vectors_h_included__
+
+// vim:noexpandtab tabstop=4 shiftwidth=4 foldmethod=marker foldmarker={{{,}}}
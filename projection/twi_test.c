@@ -0,0 +1,361 @@
+/* Name: twi_test.c
+ * Project: atmega8-magnetometer-usb-mouse
+ * Tabsize: 4
+ * License: GNU GPL v2 or GNU GPL v3
+ *
+ * Runs the real TWI driver (../firmware/avr315/TWI_Master.c) on a PC, and
+ * calls its interrupt handler with sequences of status codes in TWSR, as
+ * the TWI module would set them after each bus event. After each step, it
+ * checks the job status, the fault flags, and what the driver has asked
+ * the TWI module to do next (through TWCR).
+ *
+ * The bus pins (PINC) always read high, as on an idle bus.
+ *
+ * Usage:
+ *   twi_test
+ *
+ * Prints every failed check, and exits with 1 if there was any.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <avr/io.h>
+
+#include "avr315/TWI_Master.h"
+
+
+// Registers declared by host/avr/io.h
+volatile unsigned char PORTB, DDRB, PINB;
+volatile unsigned char PORTC, DDRC, PINC;
+volatile unsigned char PORTD, DDRD, PIND;
+volatile unsigned char TCCR0, TCNT0, TIMSK, TIFR;
+volatile unsigned char MCUCR, GICR, GIFR;
+volatile unsigned char TCCR1A, TCCR1B;
+volatile unsigned short TCNT1;
+volatile unsigned char TWBR, TWSR, TWDR, TWCR;
+
+// The interrupt handler, see ISR() in host/avr/interrupt.h
+void TWI_vect(void);
+
+#define ADDRESS 0x3C
+
+// What the driver writes to TWCR
+#define TWCR_START    ((1<<TWEN)|(1<<TWIE)|(1<<TWINT)|(1<<TWSTA))
+#define TWCR_NEXT     ((1<<TWEN)|(1<<TWIE)|(1<<TWINT))
+#define TWCR_NEXT_ACK ((1<<TWEN)|(1<<TWIE)|(1<<TWINT)|(1<<TWEA))
+#define TWCR_RESTART  ((1<<TWEN)|(1<<TWIE)|(1<<TWINT)|(1<<TWSTA)|(1<<TWSTO))
+#define TWCR_STOP     ((1<<TWEN)|(1<<TWINT)|(1<<TWSTO))
+
+static int failures;
+static int callbacks;
+
+#define CHECK(cond) check((cond), #cond, __LINE__)
+
+static void check(int ok, const char *what, int line) {  // {{{
+	if (!ok) {
+		printf("twi_test.c:%d: failed: %s\n", line, what);
+		failures++;
+	}
+}  // }}}
+
+static void job_finished(TWI_Job *job) {  // {{{
+	(void) job;
+	callbacks++;
+}  // }}}
+
+static void twi_event(unsigned char status) {  // {{{
+	// What the TWI module does after each bus event.
+	TWSR = status;
+	TWI_vect();
+}  // }}}
+
+static void init_job(TWI_Job *job, unsigned char *write_data, unsigned char write_size, unsigned char *read_data, unsigned char read_size) {  // {{{
+	job->address = ADDRESS << TWI_ADR_BITS;
+	job->write_size = write_size;
+	job->read_size = read_size;
+	job->status = TWI_JOB_IDLE;
+	job->write_data = write_data;
+	job->read_data = read_data;
+	job->callback = job_finished;
+}  // }}}
+
+static void check_bus_is_fine(int line) {  // {{{
+	// An idle bus must not be cleared, however many times it is checked.
+	unsigned int recoveries = TWI_counters.recoveries;
+	int i;
+
+	for (i = 0; i <= TWI_STUCK_CHECKS; i++) {
+		check(!TWI_Check_Bus(), "!TWI_Check_Bus()", line);
+	}
+	check(TWI_counters.recoveries == recoveries, "no recovery", line);
+}  // }}}
+
+
+// Tests  {{{
+
+static void test_write(void) {  // {{{
+	unsigned char data[2] = {0x02, 0x00};
+	TWI_Job job;
+
+	init_job(&job, data, 2, NULL, 0);
+	CHECK(TWI_Enqueue_Job(&job));
+	CHECK(TWCR == TWCR_START);
+
+	twi_event(TWI_START);
+	CHECK(TWDR == (ADDRESS << TWI_ADR_BITS));
+	twi_event(TWI_MTX_ADR_ACK);
+	CHECK(TWDR == data[0]);
+	twi_event(TWI_MTX_DATA_ACK);
+	CHECK(TWDR == data[1]);
+	CHECK(job.status == TWI_JOB_PENDING);
+	twi_event(TWI_MTX_DATA_ACK);
+
+	CHECK(job.status == TWI_JOB_DONE);
+	CHECK(TWCR == TWCR_STOP);
+	CHECK(!TWI_statusReg.busFault);
+	check_bus_is_fine(__LINE__);
+}  // }}}
+
+static void test_read(void) {  // {{{
+	// Register pointer, then 3 registers, with a repeated START
+	unsigned char reg = 0x03;
+	unsigned char data[3] = {0, 0, 0};
+	TWI_Job job;
+
+	init_job(&job, &reg, 1, data, 3);
+	CHECK(TWI_Enqueue_Job(&job));
+
+	twi_event(TWI_START);
+	twi_event(TWI_MTX_ADR_ACK);
+	CHECK(TWDR == reg);
+	twi_event(TWI_MTX_DATA_ACK);
+	CHECK(TWCR == (TWCR_NEXT | (1<<TWSTA)));
+	twi_event(TWI_REP_START);
+	CHECK(TWDR == ((ADDRESS << TWI_ADR_BITS) | (1 << TWI_READ_BIT)));
+	twi_event(TWI_MRX_ADR_ACK);
+	CHECK(TWCR == TWCR_NEXT_ACK);
+	TWDR = 0x11;
+	twi_event(TWI_MRX_DATA_ACK);
+	CHECK(TWCR == TWCR_NEXT_ACK);
+	TWDR = 0x22;
+	twi_event(TWI_MRX_DATA_ACK);
+	// NACK after the last byte
+	CHECK(TWCR == TWCR_NEXT);
+	TWDR = 0x33;
+	twi_event(TWI_MRX_DATA_NACK);
+
+	CHECK(job.status == TWI_JOB_DONE);
+	CHECK(data[0] == 0x11 && data[1] == 0x22 && data[2] == 0x33);
+	CHECK(TWCR == TWCR_STOP);
+	CHECK(!TWI_statusReg.busFault);
+}  // }}}
+
+static void test_nack(unsigned char before, unsigned char nack) {  // {{{
+	// A NACK only fails the job. The bus must be released (SCL is held low
+	// until TWINT is cleared), and it is not a bus fault.
+	unsigned char reg = 0x03;
+	unsigned char data[1];
+	unsigned int errors = TWI_counters.errors;
+	int calls = callbacks;
+	TWI_Job job;
+
+	init_job(&job, &reg, 1, data, 1);
+	CHECK(TWI_Enqueue_Job(&job));
+
+	twi_event(TWI_START);
+	if (before == TWI_REP_START) {
+		twi_event(TWI_MTX_ADR_ACK);
+		twi_event(TWI_MTX_DATA_ACK);
+		twi_event(TWI_REP_START);
+	} else if (before == TWI_MTX_ADR_ACK) {
+		twi_event(TWI_MTX_ADR_ACK);
+	}
+	twi_event(nack);
+
+	CHECK(job.status == TWI_JOB_ERROR);
+	CHECK(TWI_counters.errors == errors + 1);
+	CHECK(callbacks == calls + 1);
+	CHECK(TWCR == TWCR_STOP);
+	CHECK(!TWI_statusReg.busFault);
+	check_bus_is_fine(__LINE__);
+}  // }}}
+
+static void test_nack_with_next_job(void) {  // {{{
+	// The next job starts right away, with a STOP followed by a START.
+	unsigned char data[2] = {0x02, 0x00};
+	TWI_Job first, second;
+
+	init_job(&first, data, 2, NULL, 0);
+	init_job(&second, data, 2, NULL, 0);
+	CHECK(TWI_Enqueue_Job(&first));
+	CHECK(TWI_Enqueue_Job(&second));
+
+	twi_event(TWI_START);
+	twi_event(TWI_MTX_ADR_NACK);
+	CHECK(first.status == TWI_JOB_ERROR);
+	CHECK(second.status == TWI_JOB_PENDING);
+	CHECK(TWCR == TWCR_RESTART);
+	CHECK(!TWI_statusReg.busFault);
+
+	twi_event(TWI_START);
+	twi_event(TWI_MTX_ADR_ACK);
+	twi_event(TWI_MTX_DATA_ACK);
+	twi_event(TWI_MTX_DATA_ACK);
+	CHECK(second.status == TWI_JOB_DONE);
+	CHECK(TWCR == TWCR_STOP);
+}  // }}}
+
+static void test_bus_error(void) {  // {{{
+	// A bus error fails the job, and the next TWI_Check_Bus() clears the
+	// bus.
+	unsigned char data[2] = {0x02, 0x00};
+	unsigned int recoveries = TWI_counters.recoveries;
+	TWI_Job job;
+
+	init_job(&job, data, 2, NULL, 0);
+	CHECK(TWI_Enqueue_Job(&job));
+
+	twi_event(TWI_START);
+	twi_event(TWI_MTX_ADR_ACK);
+	twi_event(TWI_BUS_ERROR);
+
+	CHECK(job.status == TWI_JOB_ERROR);
+	CHECK(TWCR == TWCR_STOP);
+	CHECK(TWI_statusReg.busFault);
+	CHECK(TWI_Check_Bus());
+	CHECK(TWI_counters.recoveries == recoveries + 1);
+	CHECK(!TWI_statusReg.busFault);
+	check_bus_is_fine(__LINE__);
+}  // }}}
+
+static void test_arbitration_lost(void) {  // {{{
+	// The START is retried TWI_ARB_LOST_RETRIES times, and then the job
+	// fails, and the bus is cleared.
+	unsigned char data[2] = {0x02, 0x00};
+	unsigned int recoveries = TWI_counters.recoveries;
+	TWI_Job job;
+	int i;
+
+	init_job(&job, data, 2, NULL, 0);
+	CHECK(TWI_Enqueue_Job(&job));
+
+	twi_event(TWI_START);
+	for (i = 0; i < TWI_ARB_LOST_RETRIES; i++) {
+		twi_event(TWI_ARB_LOST);
+		CHECK(job.status == TWI_JOB_PENDING);
+		CHECK(TWCR == (TWCR_NEXT | (1<<TWSTA)));
+		twi_event(TWI_START);
+	}
+	twi_event(TWI_ARB_LOST);
+
+	CHECK(job.status == TWI_JOB_ERROR);
+	CHECK(TWI_statusReg.busFault);
+	CHECK(TWI_Check_Bus());
+	CHECK(TWI_counters.recoveries == recoveries + 1);
+	check_bus_is_fine(__LINE__);
+
+	// And the count starts again with the next job
+	init_job(&job, data, 2, NULL, 0);
+	CHECK(TWI_Enqueue_Job(&job));
+	twi_event(TWI_START);
+	twi_event(TWI_ARB_LOST);
+	CHECK(job.status == TWI_JOB_PENDING);
+	twi_event(TWI_START);
+	twi_event(TWI_MTX_ADR_ACK);
+	twi_event(TWI_MTX_DATA_ACK);
+	twi_event(TWI_MTX_DATA_ACK);
+	CHECK(job.status == TWI_JOB_DONE);
+}  // }}}
+
+static void test_stuck_read(void) {  // {{{
+	// A read that stops in the middle, without any more TWI interrupts (a
+	// slave holding SCL low, or a lost interrupt). TWI_Check_Bus() fails
+	// the job after TWI_STUCK_CHECKS calls, and clears the bus. The caller
+	// then has to start the read again (see sensor_bus_recovered()), and
+	// the new job starts from the beginning, with the register pointer.
+	unsigned char reg = 0x03;
+	unsigned char data[3] = {0, 0, 0};
+	unsigned int errors = TWI_counters.errors;
+	unsigned int recoveries = TWI_counters.recoveries;
+	int calls = callbacks;
+	TWI_Job job;
+	int i;
+
+	init_job(&job, &reg, 1, data, 3);
+	CHECK(TWI_Enqueue_Job(&job));
+
+	twi_event(TWI_START);
+	twi_event(TWI_MTX_ADR_ACK);
+	twi_event(TWI_MTX_DATA_ACK);
+	twi_event(TWI_REP_START);
+	twi_event(TWI_MRX_ADR_ACK);
+	TWDR = 0x11;
+	twi_event(TWI_MRX_DATA_ACK);
+
+	// The first call only sees the activity of the ISR
+	for (i = 0; i < TWI_STUCK_CHECKS; i++) {
+		CHECK(!TWI_Check_Bus());
+		CHECK(job.status == TWI_JOB_PENDING);
+	}
+	CHECK(TWI_Check_Bus());
+
+	CHECK(job.status == TWI_JOB_ERROR);
+	CHECK(TWI_counters.errors == errors + 1);
+	CHECK(TWI_counters.recoveries == recoveries + 1);
+	CHECK(callbacks == calls + 1);
+	CHECK(!TWI_statusReg.busFault);
+	check_bus_is_fine(__LINE__);
+
+	// The read again
+	data[0] = 0;
+	init_job(&job, &reg, 1, data, 3);
+	CHECK(TWI_Enqueue_Job(&job));
+	CHECK(TWCR == TWCR_START);
+
+	twi_event(TWI_START);
+	CHECK(TWDR == (ADDRESS << TWI_ADR_BITS));
+	twi_event(TWI_MTX_ADR_ACK);
+	CHECK(TWDR == reg);
+	twi_event(TWI_MTX_DATA_ACK);
+	twi_event(TWI_REP_START);
+	twi_event(TWI_MRX_ADR_ACK);
+	TWDR = 0x44;
+	twi_event(TWI_MRX_DATA_ACK);
+	TWDR = 0x55;
+	twi_event(TWI_MRX_DATA_ACK);
+	TWDR = 0x66;
+	twi_event(TWI_MRX_DATA_NACK);
+
+	CHECK(job.status == TWI_JOB_DONE);
+	CHECK(data[0] == 0x44 && data[1] == 0x55 && data[2] == 0x66);
+	CHECK(TWCR == TWCR_STOP);
+	check_bus_is_fine(__LINE__);
+}  // }}}
+
+// }}}
+
+
+int main(int argc, char *argv[]) {  // {{{
+	(void) argc;
+	(void) argv;
+
+	// Idle bus, SDA and SCL high
+	PINC = 0xFF;
+	TWI_Master_Initialise();
+
+	test_write();
+	test_read();
+	test_nack(TWI_START, TWI_MTX_ADR_NACK);
+	test_nack(TWI_MTX_ADR_ACK, TWI_MTX_DATA_NACK);
+	test_nack(TWI_REP_START, TWI_MRX_ADR_NACK);
+	test_nack_with_next_job();
+	test_bus_error();
+	test_arbitration_lost();
+	test_stuck_read();
+
+	printf("%s\n", failures ? "FAIL" : "PASS");
+	return failures ? 1 : 0;
+}  // }}}
+
+// vim:noexpandtab tabstop=4 shiftwidth=4 foldmethod=marker foldmarker={{{,}}}